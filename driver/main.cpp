@@ -3,9 +3,11 @@
 #include "codegen_shbin.h"
 #include "parser.h"
 #include "preprocessor.h"
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 char *SlurpFile(const char *FilePath, long *FileSize) {
   std::ifstream is(FilePath);
@@ -23,7 +25,6 @@ char *SlurpFile(const char *FilePath, long *FileSize) {
   return Buffer;
 }
 
-static symtable SymbolTable;
 
 void PrintToken(token *Token) {
   if (Token->Type >= token::ATTRIBUTE && Token->Type <= token::WHILE) {
@@ -191,6 +192,40 @@ void PrintASTNode(ast_node &Child, int Depth) {
     printf("string:%s\n", Child.Id.c_str());
     PrintAST(Child, Depth + 1);
     break;
+  case ast_node::INLINE_ASM:
+    printf("asm:%s\n", Child.Id.c_str());
+    PrintAST(Child, Depth + 1);
+    break;
+  case ast_node::ASM_BINDING:
+    printf("bind:@%ld\n", Child.IntValue);
+    break;
+  case ast_node::LOOP:
+    printf("loop%s\n", Child.Modifiers & ast_node::POST_TEST ? ":do" : "");
+    PrintAST(Child, Depth + 1);
+    break;
+  case ast_node::SELECTION:
+    printf("if\n");
+    PrintAST(Child, Depth + 1);
+    break;
+  case ast_node::NOT:
+    printf("not\n");
+    PrintAST(Child, Depth + 1);
+    break;
+  case ast_node::INDEX:
+    printf("index\n");
+    PrintAST(Child, Depth + 1);
+    break;
+  case ast_node::LESS:
+  case ast_node::GREATER:
+  case ast_node::LESS_EQUAL:
+  case ast_node::GREATER_EQUAL:
+  case ast_node::EQUAL:
+  case ast_node::NOT_EQUAL: {
+    static const char *Operators[] = {"<", ">", "<=", ">=", "==", "!="};
+    printf("Compare %s\n", Operators[Child.Type - ast_node::LESS]);
+    PrintAST(Child, Depth + 1);
+    break;
+  }
   case ast_node::NONE:
     printf("EMPTY\n");
     PrintAST(Child, Depth + 1);
@@ -222,67 +257,161 @@ static void ErrorCallback(const std::string &ErrMsg,
 }
 
 static void PrintHelp(const std::string &ExecName) {
-  printf("Usage: %s <input_shader> [options]\n", ExecName.c_str());
+  printf("Usage: %s <input_shader>... [options]\n", ExecName.c_str());
+  printf("Several input shaders are written to one shbin, a DVLE for each.\n");
   printf("Options:\n");
   printf("     -o <output>       | Select output file\n");
   printf("     -h,--help         | Show this help message\n");
   printf("     --verbose         | Print parse and syntax tree structures\n");
   printf("     -S                | Output nihstro assembler\n");
+  printf("     --print-ir        | Print the optimized IR of every function\n");
+  printf("     --print-layout    | Print the input register of every attribute\n");
+  printf("     --print-paths     | Print the length of main for every bool setting\n");
+  printf("     --preshader <out> | Move uniform-only math to a C function\n");
+  printf("     --geometry <in>   | Compile the input as a geometry shader\n");
+  printf("     --instance-id <a> | Take the instance from the attribute a\n");
+  printf("     --per-instance <u>| Give every instance its own uniform u\n");
+  printf("     --shader-set      | Keep uniforms and attributes in the same\n");
+  printf("                       | registers across all the input shaders\n");
+  printf("     -O0,-O1,-O2       | Set optimization level (default -O1)\n");
+  printf("     -Os               | Fit the shader unit, fastest way first\n");
 }
 
 int main(int argc, char **argv) {
   bool PrintTrees = false;
   bool OutputASM = false;
-  char *InputFilePath = nullptr;
+  bool ShaderSet = false;
+  std::vector<char *> InputFilePaths;
+  std::vector<bool> Geometry;
   char *OutputFilePath = nullptr;
+  char *PreshaderFilePath = nullptr;
+  neocode_options Options;
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
       PrintHelp(argv[0]);
       return 0;
     } else if (strcmp(argv[i], "--verbose") == 0) {
       PrintTrees = true;
+    } else if (strcmp(argv[i], "--print-ir") == 0) {
+      Options.PrintIR = true;
+    } else if (strcmp(argv[i], "--print-layout") == 0) {
+      Options.PrintLayout = true;
+    } else if (strcmp(argv[i], "--print-paths") == 0) {
+      Options.PrintPaths = true;
+    } else if (strcmp(argv[i], "--preshader") == 0 && i + 1 < argc) {
+      Options.Preshader = true;
+      PreshaderFilePath = argv[++i];
+    } else if (strcmp(argv[i], "--geometry") == 0 && i + 1 < argc) {
+      InputFilePaths.push_back(argv[++i]);
+      Geometry.push_back(true);
+    } else if (strcmp(argv[i], "--instance-id") == 0 && i + 1 < argc) {
+      Options.InstanceId = argv[++i];
+    } else if (strcmp(argv[i], "--per-instance") == 0 && i + 1 < argc) {
+      Options.PerInstance.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--shader-set") == 0) {
+      ShaderSet = true;
     } else if (strcmp(argv[i], "-o") == 0) {
       OutputFilePath = argv[++i];
     } else if (strcmp(argv[i], "-S") == 0) {
       OutputASM = true;
+    } else if (strcmp(argv[i], "-Os") == 0) {
+      Options.OptLevel = 2;
+      Options.OptimizeSize = true;
+    } else if (strncmp(argv[i], "-O", 2) == 0) {
+      Options.OptLevel = atoi(argv[i] + 2);
     } else {
-      if (!InputFilePath) {
-        InputFilePath = argv[i];
-      }
+      InputFilePaths.push_back(argv[i]);
+      Geometry.push_back(false);
     }
   }
 
-  lexer_state Lexer;
-  long Size;
-  if (!InputFilePath) {
+  if (!InputFilePaths.size()) {
     printf("error: no input file\n");
     return -1;
   }
-  char *Source = SlurpFile(InputFilePath, &Size);
-  if (!Source) {
-    printf("error: no such file or directory: \'%s\'\n", InputFilePath);
+  if (InputFilePaths.size() > 1 && (OutputASM || PreshaderFilePath)) {
+    printf("error: -S and --preshader take a single input file\n");
     return -1;
   }
-  LexerInit(&Lexer, Source, Source + Size, &SymbolTable);
-  parser Parser = parser(Lexer);
-  Parser.ErrorFunc = ErrorCallback;
-  parse_node RootNode = Parser.ParseTranslationUnit();
-  if (PrintTrees)
-    PrintParseTree(&RootNode, 0);
 
-  ast_node ASTRoot = ast::BuildTranslationUnit(RootNode, &SymbolTable);
+  if (ShaderSet && Options.InstanceId.size()) {
+    printf("error: --shader-set does not combine with --instance-id\n");
+    return -1;
+  }
+
+  size_t Count = InputFilePaths.size();
+  std::vector<symtable> SymbolTables(Count);
+  std::vector<ast_node> ASTRoots(Count);
+  for (size_t f = 0; f < Count; ++f) {
+    char *InputFilePath = InputFilePaths[f];
+    lexer_state Lexer;
+    long Size;
+    char *Source = SlurpFile(InputFilePath, &Size);
+    if (!Source) {
+      printf("error: no such file or directory: \'%s\'\n", InputFilePath);
+      return -1;
+    }
+    LexerInit(&Lexer, Source, Source + Size, &SymbolTables[f]);
+    parser Parser = parser(Lexer);
+    Parser.ErrorFunc = ErrorCallback;
+    parse_node RootNode = Parser.ParseTranslationUnit();
+    if (PrintTrees)
+      PrintParseTree(&RootNode, 0);
+
+    ASTRoots[f] = ast::BuildTranslationUnit(RootNode, &SymbolTables[f]);
+    if (ErrorCount)
+      return -1;
+    if (PrintTrees)
+      PrintAST(ASTRoots[f], 0);
+  }
+
+  if (ShaderSet) {
+    std::vector<ast_node *> Roots;
+    std::vector<symtable *> Tables;
+    for (size_t f = 0; f < Count; ++f) {
+      Roots.push_back(&ASTRoots[f]);
+      Tables.push_back(&SymbolTables[f]);
+    }
+    Options.SharedGlobals =
+        CGNeoLayoutShaderSet(Roots, Tables, Geometry, Options, ErrorCount);
+    if (ErrorCount)
+      return -1;
+  }
+
+  std::vector<neocode_program> Programs;
+  Programs.reserve(Count);
+  for (size_t f = 0; f < Count; ++f) {
+    neocode_options FileOptions = Options;
+    FileOptions.Geometry = Geometry[f];
+    if (Count > 1 && (Options.PrintLayout || Options.PrintPaths))
+      printf("%s:\n", InputFilePaths[f]);
+    Programs.push_back(
+        CGNeoBuildProgramInstance(&ASTRoots[f], &SymbolTables[f], FileOptions));
+  }
+  for (neocode_program &P : Programs)
+    ErrorCount += P.ErrorCount;
   if (ErrorCount)
     return -1;
-  if (PrintTrees)
-    PrintAST(ASTRoot, 0);
-  neocode_program Program = CGNeoBuildProgramInstance(&ASTRoot, &SymbolTable);
+  neocode_program &Program = Programs[0];
   if (OutputFilePath) {
+    std::stringstream Code;
+    if (OutputASM) {
+      CGNeoGenerateCode(&Program, Code);
+    } else {
+      std::vector<neocode_program *> Entries;
+      for (neocode_program &P : Programs)
+        Entries.push_back(&P);
+      if (!CGShbinGenerateCode(Entries, Code))
+        return -1;
+    }
     std::ofstream Fs;
     Fs.open(OutputFilePath);
-    if (OutputASM)
-      CGNeoGenerateCode(&Program, Fs);
-    else
-      CGShbinGenerateCode(&Program, Fs);
+    Fs << Code.str();
+  }
+  if (PreshaderFilePath) {
+    std::ofstream Fs;
+    Fs.open(PreshaderFilePath);
+    CGNeoGeneratePreshader(&Program, Fs);
   }
   return 0;
 }
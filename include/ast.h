@@ -25,7 +25,21 @@ struct ast_node {
     STRING_LITERAL,
     VARIABLE,
     RETURN,
-    ASSIGNMENT
+    ASSIGNMENT,
+    FIELD_SELECTION,
+    NEGATE,
+    INLINE_ASM,
+    ASM_BINDING,
+    LOOP,
+    LESS,
+    GREATER,
+    LESS_EQUAL,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    SELECTION,
+    NOT,
+    INDEX
   };
 
   std::string Id;
@@ -34,9 +48,14 @@ struct ast_node {
   float FloatValue;
   long IntValue;
 
-  enum { DECLARE = 1 << 0 };
+  // POSTFIX marks an x++ or x-- ASSIGNMENT, which yields the old value.
+  // POST_TEST marks a do-while LOOP. A declared array VARIABLE keeps its
+  // length in IntValue; an INDEX reads element Children[1] of Children[0].
+  enum { DECLARE = 1 << 0, POSTFIX = 1 << 1, POST_TEST = 1 << 2 };
   int Modifiers;
 
+  ast_node() : Type(NONE), FloatValue(0), IntValue(0), Modifiers(0) {}
+
   void Append(const ast_node &A) {
     Children.insert(Children.end(), A.Children.begin(), A.Children.end());
   }
@@ -49,9 +68,14 @@ public:
   ast(symtable *S);
   ast_node BuildStatement(parse_node &P);
   ast_node BuildStatementList(parse_node &P);
+  ast_node BuildBody(parse_node &P);
+  ast_node BuildIteration(parse_node &P);
+  ast_node BuildSelection(parse_node &P);
   ast_node BuildFunctionCall(parse_node &P);
   ast_node BuildPrimaryExpression(parse_node &P);
   ast_node BuildAssignmentExpression(parse_node &P);
+  ast_node BuildExpression(parse_node &P);
+  ast_node BuildParameter(parse_node &P);
   ast_node BuildFunctionDefinition(parse_node &P);
   ast_node BuildDeclaration(parse_node &P);
   static ast_node BuildTranslationUnit(parse_node &P, symtable *S);
@@ -9,6 +9,8 @@ struct neocode_register_file {
   int Constants[96];
   int Temp[16];
   int Output[8];
+  int Integers[4];
+  int Booleans[16];
 
   int AllocOutput() {
     for (int i = 0; i < 8; ++i) {
@@ -54,6 +56,30 @@ struct neocode_register_file {
     return -1;
   }
 
+  // The integer uniforms i0-i3 come after the address register.
+  int AllocInteger() {
+    for (int i = 0; i < 4; ++i) {
+      if (!Integers[i]) {
+        Integers[i] = 1;
+        return i + 0x90;
+      }
+    }
+
+    return -1;
+  }
+
+  // The bool uniforms b0-b15 come after the integer ones.
+  int AllocBoolean() {
+    for (int i = 0; i < 16; ++i) {
+      if (!Booleans[i]) {
+        Booleans[i] = 1;
+        return i + 0xA0;
+      }
+    }
+
+    return -1;
+  }
+
   void Free(int Register) {
     if (Register < 0x8)
       Vertex[Register] = 0;
@@ -113,24 +139,98 @@ struct neocode_variable {
   int RegisterType;
   neocode_constant Const;
   int Swizzle;
+  int Negate;
+
+  // Count is the length of a uniform array, 0 for anything else. A Relative
+  // source is read at Register plus a0.x (1), a0.y (2) or aL (3).
+  int Count;
+  int Relative;
+
+  // The float registers taken up: four a mat4, times the array length.
+  int RegisterCount() const {
+    int Rows = TypeName.compare("mat4") == 0 ? 4 : 1;
+    return Count ? Rows * Count : Rows;
+  }
 };
 
 struct neocode_instruction {
-  enum { EMPTY, MOV, MUL, RSQ, RCP, NOP, END, EX2, LG2, DP4 };
+  enum {
+    EMPTY,
+    MOV,
+    MUL,
+    RSQ,
+    RCP,
+    NOP,
+    END,
+    EX2,
+    LG2,
+    DP4,
+    CALL,
+    INVOKE,
+    ADD,
+    DP3,
+    DPH,
+    MAD,
+    MIN,
+    MAX,
+    FLR,
+    SLT,
+    SGE,
+    MOVA,
+    LOOP,
+    ENDLOOP,
+    CMP,
+    IFC,
+    ELSE,
+    ENDIF,
+    IFU,
+    JMPU,
+    CALLU,
+    SETEMIT,
+    EMIT
+  };
 
+  // A LOOP repeats everything up to its ENDLOOP, which marks the end of the
+  // body and is not encoded. Src1 is the integer uniform holding the count
+  // minus one, the initial aL and its increment.
+  // CMP compares the x components of Src1 and Src2 by the CMP_* in
+  // Dst.Const.Integer.X and sets cmp.x, which the IFC right after it tests.
+  // ELSE and ENDIF only mark where the parts of the IFC end.
+  // IFU is an IFC on the bool uniform in Src1 and ends the same way. JMPU
+  // stands for an IFU with an empty then part and skips to its ENDIF when
+  // the bool is set; CALLU makes its CALL only then.
+  // SETEMIT picks the slot Dst.Const.Integer.X that the next EMIT stores
+  // the outputs to, and whether that EMIT completes a triangle (Y) with the
+  // opposite winding (Z). Geometry shaders only.
   int Type;
   neocode_variable Dst;
   neocode_variable Src1;
   neocode_variable Src2;
+  neocode_variable Src3;
   std::string ExtraData;
 
+  // CALL and INVOKE name their callee in ExtraData. An INVOKE is a
+  // user-level call whose Args are still the caller's values; OptLowerCalls
+  // turns it into an inlined body or a register-convention CALL, whose Args
+  // are the callee's parameter registers.
+  std::vector<neocode_variable> Args;
+
   neocode_instruction() {
-    Dst.Swizzle = 0;
-    Src1.Swizzle = 0;
-    Src2.Swizzle = 0;
+    Type = EMPTY;
+    Dst.Type = Src1.Type = Src2.Type = Src3.Type = 0;
+    Dst.Register = Src1.Register = Src2.Register = Src3.Register = 0;
+    Dst.RegisterType = Src1.RegisterType = Src2.RegisterType =
+        Src3.RegisterType = 0;
+    Dst.Swizzle = Src1.Swizzle = Src2.Swizzle = Src3.Swizzle = 0;
+    Dst.Negate = Src1.Negate = Src2.Negate = Src3.Negate = 0;
+    Dst.Count = Src1.Count = Src2.Count = Src3.Count = 0;
+    Dst.Relative = Src1.Relative = Src2.Relative = Src3.Relative = 0;
   }
 };
 
+// The comparisons of CMP, numbered as the hardware does.
+enum { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
 struct neocode_program;
 
 struct neocode_function {
@@ -138,27 +238,76 @@ struct neocode_function {
   int ReturnType;
   std::string Name;
   std::vector<neocode_variable> Variables;
+  std::vector<neocode_variable> Parameters;
   std::vector<neocode_instruction> Instructions;
+  std::vector<std::string> Callees;
 
   neocode_function(neocode_program *P) : Program(P) {}
   neocode_variable *GetVariable(std::string Name);
 };
 
+// With an InstanceId attribute, the uniforms named in PerInstance become
+// arrays of InstanceCount elements, and reading one picks the element of the
+// instance that attribute holds. An InstanceCount of 0 fits as many
+// instances as the float uniforms leave room for.
+// SharedGlobals are the uniforms and attributes of a whole shader set, each
+// in the register it has in every program of the set.
+// OptimizeSize builds the program in every way from plain -O2 towards the
+// smallest, and keeps the fastest that fits the shader unit. SizeLevel is
+// the way being built: bit 0 outlines repeated instruction sequences, and
+// every step above it unrolls and inlines less.
+struct neocode_options {
+  int OptLevel;
+  bool OptimizeSize;
+  int SizeLevel;
+  bool PrintIR;
+  bool PrintLayout;
+  bool Preshader;
+  bool PrintPaths;
+  bool Geometry;
+  std::string InstanceId;
+  std::vector<std::string> PerInstance;
+  int InstanceCount;
+  std::vector<neocode_variable> SharedGlobals;
+  // Receives each error found past parsing, without the "error: " prefix.
+  // Errors go to stdout when unset.
+  void (*ErrorFunc)(const std::string &);
+
+  neocode_options()
+      : OptLevel(1), OptimizeSize(false), SizeLevel(0), PrintIR(false),
+        PrintLayout(false), Preshader(false), PrintPaths(false),
+        Geometry(false), InstanceCount(0), ErrorFunc(nullptr) {}
+};
+
 struct neocode_program {
   std::vector<neocode_function> Functions;
   std::vector<neocode_variable> Globals;
   neocode_register_file Registers;
-};
+  neocode_options Options;
+
+  // C statements that fill the uniforms derived by the preshader pass, and
+  // the uniform registers they read.
+  std::string Preshader;
+  std::vector<int> PreshaderInputs;
+
+  // Errors found past parsing. They are printed as they are found, and a
+  // program with any is not to be written out.
+  int ErrorCount;
 
-struct cg_neo {
-  symtable *SymbolTable;
-  void BuildStatement(neocode_function *Function, ast_node *ASTNode);
-  neocode_instruction BuildInstruction(neocode_function *Function,
-                                       ast_node *ASTNode);
-  neocode_function BuildFunction(neocode_program *Program, ast_node *ASTNode);
+  neocode_program() : ErrorCount(0) {}
 };
 
-neocode_program CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S);
+neocode_program
+CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S,
+                          const neocode_options &Options = neocode_options());
+std::vector<neocode_variable>
+CGNeoLayoutShaderSet(const std::vector<ast_node *> &Roots,
+                     const std::vector<symtable *> &Tables,
+                     const std::vector<bool> &Geometry,
+                     const neocode_options &Options, int &ErrorCount);
+void CGNeoReport(const neocode_options &Options, const char *Format, ...);
+void CGNeoError(neocode_program *Program, const char *Format, ...);
 void CGNeoGenerateCode(neocode_program *Program, std::ostream &os);
+void CGNeoGeneratePreshader(neocode_program *Program, std::ostream &os);
 
 #endif
@@ -4,7 +4,15 @@
 
 #include "codegen_neo.h"
 #include <ostream>
+#include <vector>
 
-void CGShbinGenerateCode(neocode_program *Program, std::ostream &os);
+// False, with nothing written, when the program does not fit the shader
+// unit.
+bool CGShbinGenerateCode(neocode_program *Program, std::ostream &os);
+// One DVLE per program, all of them running from a single shared blob.
+bool CGShbinGenerateCode(const std::vector<neocode_program *> &Programs,
+                         std::ostream &os);
+// Whether the operand descriptors of the program on its own fit the table.
+bool CGShbinFitsOpDescs(neocode_program *Program);
 
 #endif
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 void  SelenaSetErrorHandler(void (*ErrorFunc)(const char *));
+void  SelenaSetOptimizationLevel(int Level);
 char *SelenaCompileShaderSource(const char *Src, int *BinSize);
 
 #ifdef __cplusplus
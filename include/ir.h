@@ -0,0 +1,186 @@
+
+#ifndef IR_H
+#define IR_H
+
+#include "codegen_neo.h"
+#include <map>
+#include <set>
+
+// An operand names an SSA value, a fixed register of the program (attribute,
+// uniform, named constant or output) or an immediate vec4. Swizzle and Negate
+// use the same encoding as neocode_variable and apply on top of the source.
+struct ir_operand {
+  enum { NONE, VALUE, GLOBAL, CONSTANT };
+
+  int Kind;
+  int Value;
+  neocode_variable Global;
+  float Constant[4];
+  int Swizzle;
+  int Negate;
+
+  ir_operand() : Kind(NONE), Value(-1), Global(), Swizzle(0), Negate(0) {
+    Constant[0] = Constant[1] = Constant[2] = Constant[3] = 0.0f;
+  }
+};
+
+// Operations beyond the neocode_instruction opcodes.
+enum {
+  IR_PARAM = 0x100, // defines the parameter called Name on entry
+  IR_STORE,         // writes the Mask components of Src[0] to Dst
+  IR_PHI,           // Src[i] when coming from the i-th predecessor
+  IR_LOAD,          // element x of Src[0] of the uniform array Dst
+  IR_COUNTER,       // x is aL, the counter of the LOOP around it
+};
+
+// Every instruction defines at most one SSA value. Values are vec4 with an
+// explicit component mask; the components outside Mask are taken over from
+// Prior, so a partial write is a new value rather than an update in place.
+struct ir_instruction {
+  int Op;
+  int Result;
+  int Mask;
+  ir_operand Src[3];
+  ir_operand Prior;
+  neocode_variable Dst;
+  std::vector<ir_operand> Args;
+  std::string Name;
+
+  ir_instruction()
+      : Op(neocode_instruction::EMPTY), Result(-1), Mask(0b1111), Dst() {}
+};
+
+struct ir_block {
+  std::vector<ir_instruction> Instructions;
+  std::vector<int> Successors;
+};
+
+// Blocks are laid out in program order. A loop is the blocks Header to Latch,
+// entered from the block before it, which ends in the LOOP instruction whose
+// Dst.Const holds the hardware loop parameters. The phis of a loop come
+// first in its header, and the body always runs at least once.
+// An IFC ends its block and compares Src[0] and Src[1] by the CMP_* in
+// Dst.Const.Integer.X. Its then part starts with the next block, and its
+// second successor starts the else part or, without one, the join. Phis
+// count predecessors in block order, so a header's come entry then latch.
+// An IFU branches the same way on the bool uniform in Src[0].
+// An IR_LOAD counts its index in registers, so a mat4 element is four apart,
+// and picks the row of a mat4 array by Dst.Swizzle as a GLOBAL operand does.
+// An IR_COUNTER follows the phis of a loop header; a load indexed by it reads
+// relative to aL and needs no MOVA.
+struct ir_loop {
+  int Preheader;
+  int Header;
+  int Latch;
+};
+
+struct ir_function {
+  neocode_program *Program;
+  std::string Name;
+  std::vector<ir_block> Blocks;
+  std::vector<int> Parameters;
+  int ValueCount;
+
+  // Filled in by register allocation: the register every value lives in.
+  std::vector<neocode_variable> Locations;
+
+  ir_function(neocode_program *P) : Program(P), ValueCount(0) {}
+  int NewValue() { return ValueCount++; }
+};
+
+struct builtin_function;
+struct counted_loop;
+
+struct cg_neo {
+  symtable *SymbolTable;
+  neocode_program *Program;
+  ir_function *Function;
+  std::map<std::string, ir_operand> Locals;
+  int LoopDepth;
+  bool Measuring;
+  std::set<std::string> Reported;
+
+  // The phi of the counter of the LOOP being built and the IR_COUNTER value
+  // that holds it as aL, or -1 when aL does not count along with it.
+  int LoopCounter;
+  int LoopAddress;
+
+  cg_neo()
+      : LoopDepth(0), Measuring(false), LoopCounter(-1), LoopAddress(-1) {}
+
+  void Error(const char *Format, ...);
+
+  ir_operand Emit(int Op, const ir_operand &A = ir_operand(),
+                  const ir_operand &B = ir_operand(), int Mask = 0b1111,
+                  const ir_operand &Prior = ir_operand());
+  ir_operand EmitPerLane(int Op, const ir_operand &X, int Count);
+  ir_operand EmitDot(const ir_operand &A, const ir_operand &B, int Count);
+  int GetComponentCount(ast_node *ASTNode);
+  ir_operand BuildAsm(ast_node *ASTNode);
+  ir_operand BuildBuiltin(ast_node *ASTNode, const builtin_function &Builtin);
+  ir_operand BuildGeometryBuiltin(ast_node *ASTNode,
+                                  const builtin_function &Builtin);
+  ir_operand EmitLoad(const neocode_variable &Array, int Row,
+                      const ir_operand &Index);
+  ir_operand MatrixRow(const ir_operand &M, int Row);
+  ir_operand IndexArray(const neocode_variable &Array,
+                        const ir_operand &Index);
+  ir_operand InstanceIndex();
+  ir_operand BuildIndex(ast_node *ASTNode);
+  ir_operand BuildAssignment(ast_node *ASTNode);
+  int ExpressionCost(ast_node *Node, std::map<ast_node *, int> &Costs,
+                     int *Choice = nullptr);
+  ir_operand BuildExpression(ast_node *Node);
+  ir_operand BuildInstruction(ast_node *ASTNode);
+  bool AnalyzeLoop(ast_node *ASTNode, counted_loop &Loop);
+  void BuildIteration(ast_node *ASTNode);
+  int Measure(ast_node *First, ast_node *Second = nullptr);
+  void BuildHardwareLoop(ast_node *ASTNode, const counted_loop &Loop);
+  void BuildLoop(ast_node *ASTNode);
+  ir_operand BuildCondition(int Compare, const ir_operand &A,
+                            const ir_operand &B);
+  void BuildFlattenedSelection(ast_node *ASTNode, int Compare,
+                               const ir_operand &A, const ir_operand &B);
+  void BuildBranchedSelection(ast_node *ASTNode, const ir_instruction &Branch);
+  bool BuildStaticSelection(ast_node *ASTNode);
+  void BuildSelection(ast_node *ASTNode);
+  void BuildStatement(ast_node *ASTNode);
+  ir_function BuildFunction(neocode_program *Program, ast_node *ASTNode);
+};
+
+ir_operand IRValue(int Value);
+ir_operand IRGlobal(const neocode_variable &V);
+ir_operand IRConstant(float X, float Y, float Z, float W);
+neocode_variable IRArrayElement(const neocode_variable &Array, int Offset);
+
+int IRSwizzleSelector(const ir_operand &Op, int Lane);
+int IRSourceCount(const ir_instruction &In);
+bool IRHasSideEffects(const ir_instruction &In);
+bool IRIsBranch(const ir_instruction &In);
+bool IRIsCommutative(int Op);
+bool IRIsComponentwise(int Op);
+int IRReadLanes(const ir_instruction &In, int Index);
+int IROperandComponents(const ir_operand &Op, int Lanes);
+bool IRSameOperand(const ir_operand &A, const ir_operand &B);
+std::vector<ir_operand *> IROperands(ir_instruction &In);
+ir_operand IRCompose(const ir_operand &Use, const ir_operand &Def);
+void IRReplaceValue(ir_function *Function, int Value, const ir_operand &With);
+void IRCountUses(ir_function *Function, std::vector<int> &Uses);
+void IRFindLoops(ir_function *Function, std::vector<ir_loop> &Loops);
+void IRFindPredecessors(ir_function *Function,
+                        std::vector<std::vector<int>> &Predecessors);
+void IRPrintFunction(ir_function *Function, std::ostream &os);
+
+void IRFoldConstants(ir_function *Function);
+void IREliminateCommonSubexpressions(ir_function *Function);
+void IRHoistLoopInvariants(ir_function *Function);
+void IRExtractPreshader(ir_function *Function);
+void IRPackLanes(ir_function *Function);
+void IREliminateDeadCode(ir_function *Function);
+void IRSinkLoads(ir_function *Function);
+void IRLegalizeOperands(ir_function *Function);
+void IRAllocateRegisters(ir_function *Function);
+void IRLowerFunction(ir_function *Function, neocode_function *Out);
+void IRRunPasses(ir_function *Function, const neocode_options &Options);
+
+#endif
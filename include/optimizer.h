@@ -0,0 +1,66 @@
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "codegen_neo.h"
+
+// Register slots index every register file in one flat space so that the
+// passes can track per-component liveness without caring about which file an
+// operand lives in.
+enum {
+  OPT_SLOT_INPUT = 0x00,
+  OPT_SLOT_TEMP = 0x10,
+  OPT_SLOT_CONST = 0x20,
+  OPT_SLOT_OUTPUT = 0x80,
+  OPT_SLOT_ADDRESS = 0x90,
+  OPT_SLOT_INTEGER = 0x91,
+  OPT_SLOT_BOOLEAN = 0x95,
+  OPT_SLOT_COUNT = 0xA5,
+
+  // r15 carries return values, both for inlined bodies and across CALL.
+  OPT_SLOT_RETURN = OPT_SLOT_TEMP + 15
+};
+
+// The PICA200 shader unit holds at most 512 instruction words, and a CALL
+// reaches at most 255 of them.
+enum { OPT_MAX_PROGRAM_SIZE = 512, OPT_MAX_CALL_SIZE = 0xFF };
+
+struct opt_live_set {
+  int Mask[OPT_SLOT_COUNT];
+
+  opt_live_set() { Clear(); }
+
+  void Clear() {
+    for (int i = 0; i < OPT_SLOT_COUNT; ++i)
+      Mask[i] = 0;
+  }
+};
+
+int OptRegisterSlot(const neocode_variable &V);
+bool OptIsMarker(const neocode_instruction &In);
+int OptSwizzleSelector(const neocode_variable &V, int Lane);
+int OptSourceCount(const neocode_instruction &In);
+bool OptHasDst(const neocode_instruction &In);
+neocode_variable *OptSource(neocode_instruction *In, int Index);
+int OptWriteMask(const neocode_instruction &In);
+int OptReadMask(const neocode_instruction &In, int Index);
+
+void OptFunctionLiveOut(neocode_function *Function, opt_live_set &Live);
+void OptComputeLiveness(neocode_function *Function,
+                        std::vector<opt_live_set> &LiveAfter);
+
+neocode_function *OptFindFunction(neocode_program *Program,
+                                  const std::string &Name);
+int OptFunctionSize(neocode_function *Function);
+int OptProgramSize(neocode_program *Program);
+
+void OptLowerCalls(neocode_program *Program);
+void OptPropagateCopies(neocode_program *Program);
+void OptEliminateDeadCode(neocode_program *Program);
+void OptFuseMultiplyAdd(neocode_program *Program);
+void OptScheduleInstructions(neocode_program *Program);
+void OptOutlineSequences(neocode_program *Program);
+void OptFinishControlFlow(neocode_program *Program);
+void OptRunPasses(neocode_program *Program);
+
+#endif
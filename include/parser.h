@@ -27,14 +27,20 @@ struct parse_node {
   token Token;
   int Type;
 
-  parse_node() { Type = E; }
+  parse_node() {
+    Type = E;
+    Token.Type = 0;
+  }
 
   parse_node(token &Tok, NodeType NT = T) {
     Token = Tok;
     Type = NT;
   }
 
-  parse_node(NodeType NT) { Type = NT; }
+  parse_node(NodeType NT) {
+    Type = NT;
+    Token.Type = 0;
+  }
 
   void Append(const parse_node &P) {
     Children.insert(Children.end(), P.Children.begin(), P.Children.end());
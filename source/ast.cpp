@@ -1,8 +1,69 @@
 
 #include "ast.h"
+#include <cctype>
 
 ast::ast(symtable *S) : SymbolTable(S) {}
 
+static bool IsAsmIdentifierChar(char C) {
+  return isalnum((unsigned char)C) || C == '_';
+}
+
+// The string of asm("mnemonic [-]operand[.swizzle], ...") is split up here
+// once. The operand list becomes Children[0] of the INLINE_ASM node, built
+// from the usual VARIABLE, FIELD_SELECTION and NEGATE nodes; @N is an
+// ASM_BINDING to Children[N], the N-th argument of the call.
+static ast_node BuildInlineAsm(const std::string &Source) {
+  ast_node A;
+  A.Type = ast_node::INLINE_ASM;
+  size_t i = 0, n = Source.size();
+  while (i < n && isspace((unsigned char)Source[i]))
+    ++i;
+  while (i < n && IsAsmIdentifierChar(Source[i]))
+    A.Id += Source[i++];
+
+  ast_node Operands;
+  while (i < n) {
+    if (isspace((unsigned char)Source[i]) || Source[i] == ',') {
+      ++i;
+      continue;
+    }
+    bool Negate = Source[i] == '-';
+    if (Negate)
+      ++i;
+    ast_node Op;
+    if (i < n && Source[i] == '@') {
+      Op.Type = ast_node::ASM_BINDING;
+      for (++i; i < n && isdigit((unsigned char)Source[i]); ++i)
+        Op.IntValue = Op.IntValue * 10 + (Source[i] - '0');
+    } else {
+      Op.Type = ast_node::VARIABLE;
+      while (i < n && IsAsmIdentifierChar(Source[i]))
+        Op.Id += Source[i++];
+      if (Op.Id.empty()) {
+        ++i;
+        continue;
+      }
+    }
+    if (i < n && Source[i] == '.') {
+      ast_node Field;
+      Field.Type = ast_node::FIELD_SELECTION;
+      for (++i; i < n && IsAsmIdentifierChar(Source[i]); ++i)
+        Field.Id += Source[i];
+      Field.Children.push_back(Op);
+      Op = Field;
+    }
+    if (Negate) {
+      ast_node Negated;
+      Negated.Type = ast_node::NEGATE;
+      Negated.Children.push_back(Op);
+      Op = Negated;
+    }
+    Operands.Children.push_back(Op);
+  }
+  A.Children.push_back(Operands);
+  return A;
+}
+
 ast_node ast::BuildFunctionCall(parse_node &P) {
   ast_node A;
   A.Type = ast_node::FUNCTION_CALL;
@@ -12,6 +73,13 @@ ast_node ast::BuildFunctionCall(parse_node &P) {
       continue;
     A.Children.push_back(BuildAssignmentExpression(PN));
   }
+  if (P.Children[0].Token.Type == token::ASM && A.Children.size() &&
+      A.Children[0].Type == ast_node::STRING_LITERAL) {
+    ast_node Asm = BuildInlineAsm(A.Children[0].Id);
+    Asm.Children.insert(Asm.Children.end(), A.Children.begin() + 1,
+                        A.Children.end());
+    return Asm;
+  }
   return A;
 }
 
@@ -42,24 +110,141 @@ ast_node ast::BuildPrimaryExpression(parse_node &P) {
   return A;
 }
 
-ast_node ast::BuildAssignmentExpression(parse_node &P) {
+static ast_node BuildBinary(int Type, const ast_node &L, const ast_node &R) {
   ast_node A;
-  A.Type = ast_node::ASSIGNMENT;
-  if (P.Children.size() == 3) {
-    if (P.Children[1].Token.Type == token::STAR) {
-      A.Type = ast_node::MULTIPLY;
+  A.Type = Type;
+  A.Children.push_back(L);
+  A.Children.push_back(R);
+  return A;
+}
+
+static int BinaryOperatorType(int TokenType) {
+  switch (TokenType) {
+  case token::PLUS:
+  case token::ADD_ASSIGN:
+    return ast_node::PLUS;
+  case token::DASH:
+  case token::SUB_ASSIGN:
+    return ast_node::MINUS;
+  case token::STAR:
+  case token::MUL_ASSIGN:
+    return ast_node::MULTIPLY;
+  case token::SLASH:
+  case token::DIV_ASSIGN:
+    return ast_node::DIVIDE;
+  case token::LEFT_ANGLE:
+    return ast_node::LESS;
+  case token::RIGHT_ANGLE:
+    return ast_node::GREATER;
+  case token::LE_OP:
+    return ast_node::LESS_EQUAL;
+  case token::GE_OP:
+    return ast_node::GREATER_EQUAL;
+  case token::EQ_OP:
+    return ast_node::EQUAL;
+  case token::NE_OP:
+    return ast_node::NOT_EQUAL;
+  }
+  return ast_node::NONE;
+}
+
+// ++x and x++ are x = x + 1, the postfix form yielding the old value.
+static ast_node BuildIncrement(const ast_node &Target, int TokenType,
+                               bool Postfix) {
+  ast_node One;
+  One.Type = ast_node::INT_LITERAL;
+  One.IntValue = 1;
+  int Op = TokenType == token::INC_OP ? ast_node::PLUS : ast_node::MINUS;
+  ast_node A = BuildBinary(ast_node::ASSIGNMENT, Target,
+                           BuildBinary(Op, Target, One));
+  if (Postfix)
+    A.Modifiers = ast_node::POSTFIX;
+  return A;
+}
+
+static bool IsStepToken(const parse_node &P) {
+  return P.Type == parse_node::T &&
+         (P.Token.Type == token::INC_OP || P.Token.Type == token::DEC_OP);
+}
+
+ast_node ast::BuildExpression(parse_node &P) {
+  ast_node A;
+  switch (P.Type) {
+  case parse_node::PRIMARY_EXPRESSION:
+    if (P.Children.size() == 3 &&
+        P.Children[0].Token.Type == token::LEFT_PAREN) {
+      return BuildExpression(P.Children[1]);
     }
-    A.Children.push_back(BuildPrimaryExpression(P.Children[0]));
-    A.Children.push_back(BuildAssignmentExpression(P.Children[2]));
-  } else if (P.Type == parse_node::PRIMARY_EXPRESSION) {
     return BuildPrimaryExpression(P);
-  } else if (P.Children[0].Token.Type == token::EQUAL) {
-    if (P.Children[1].Type == parse_node::FUNCTION_CALL) {
-      A.Children.push_back(BuildFunctionCall(P.Children[1]));
-    } else
-      A.Children.push_back(BuildPrimaryExpression(P.Children[1]));
-  } else if (P.Type == parse_node::FUNCTION_CALL) {
+  case parse_node::EXPRESSION:
+    return BuildAssignmentExpression(P.Children[0]);
+  case parse_node::FUNCTION_CALL:
     return BuildFunctionCall(P);
+  case parse_node::ASSIGNMENT_EXPR:
+    return BuildAssignmentExpression(P);
+  case parse_node::E:
+    break;
+  default:
+    return A;
+  }
+
+  if (P.Children.size() == 3 &&
+      P.Children[1].Token.Type == token::LEFT_BRACKET) {
+    A.Type = ast_node::INDEX;
+    A.Children.push_back(BuildExpression(P.Children[0]));
+    A.Children.push_back(BuildExpression(P.Children[2]));
+    return A;
+  }
+  if (P.Children.size() == 3 && P.Children[1].Token.Type == token::DOT) {
+    A.Type = ast_node::FIELD_SELECTION;
+    A.Id = P.Children[2].Token.Id;
+    A.Children.push_back(BuildExpression(P.Children[0]));
+    return A;
+  }
+  if (P.Children.size() == 3) {
+    A.Type = BinaryOperatorType(P.Children[1].Token.Type);
+    if (A.Type == ast_node::NONE)
+      return A;
+    return BuildBinary(A.Type, BuildExpression(P.Children[0]),
+                       BuildExpression(P.Children[2]));
+  }
+  if (P.Children.size() == 2 && IsStepToken(P.Children[0]))
+    return BuildIncrement(BuildExpression(P.Children[1]),
+                          P.Children[0].Token.Type, false);
+  if (P.Children.size() == 2 && IsStepToken(P.Children[1]))
+    return BuildIncrement(BuildExpression(P.Children[0]),
+                          P.Children[1].Token.Type, true);
+  if (P.Children.size() == 2 && P.Children[0].Type == parse_node::T) {
+    if (P.Children[0].Token.Type == token::PLUS)
+      return BuildExpression(P.Children[1]);
+    if (P.Children[0].Token.Type == token::DASH) {
+      A.Type = ast_node::NEGATE;
+      A.Children.push_back(BuildExpression(P.Children[1]));
+    } else if (P.Children[0].Token.Type == token::BANG) {
+      A.Type = ast_node::NOT;
+      A.Children.push_back(BuildExpression(P.Children[1]));
+    }
+    return A;
+  }
+  if (P.Children.size() == 1)
+    return BuildExpression(P.Children[0]);
+  return A;
+}
+
+ast_node ast::BuildAssignmentExpression(parse_node &P) {
+  ast_node A;
+  A.Type = ast_node::ASSIGNMENT;
+  if (P.Type == parse_node::ASSIGNMENT_EXPR) {
+    ast_node L = BuildExpression(P.Children[0]);
+    ast_node R = BuildAssignmentExpression(P.Children[2]);
+    int Op = BinaryOperatorType(P.Children[1].Token.Type);
+    A.Children.push_back(L);
+    A.Children.push_back(Op == ast_node::NONE ? R : BuildBinary(Op, L, R));
+  } else if (P.Type == parse_node::E && P.Children.size() == 2 &&
+             P.Children[0].Token.Type == token::EQUAL) {
+    A.Children.push_back(BuildAssignmentExpression(P.Children[1]));
+  } else {
+    return BuildExpression(P);
   }
   return A;
 }
@@ -70,6 +255,24 @@ ast_node ast::BuildStatement(parse_node &P) {
   case parse_node::DECLARATION:
     return BuildDeclaration(P);
   case parse_node::E:
+    if (P.Children[0].Type == parse_node::T &&
+        P.Children[0].Token.Type == token::RETURN) {
+      A.Type = ast_node::RETURN;
+      A.Children.push_back(BuildAssignmentExpression(P.Children[1].Children[0]));
+      return A;
+    }
+    if (P.Children[0].Type == parse_node::T) {
+      switch (P.Children[0].Token.Type) {
+      case token::WHILE:
+      case token::DO:
+      case token::FOR:
+        return BuildIteration(P);
+      case token::IF:
+        return BuildSelection(P);
+      case token::LEFT_BRACE:
+        return BuildBody(P);
+      }
+    }
     return BuildStatement(P.Children[0]);
   case parse_node::ASSIGNMENT_EXPR:
     return BuildAssignmentExpression(P);
@@ -88,12 +291,70 @@ ast_node ast::BuildStatementList(parse_node &P) {
   return A;
 }
 
+// A compound statement or a single one, as a NONE node of statements.
+ast_node ast::BuildBody(parse_node &P) {
+  if (P.Children.size() && P.Children[0].Type == parse_node::T &&
+      P.Children[0].Token.Type == token::LEFT_BRACE) {
+    if (P.Children.size() < 3)
+      return ast_node();
+    return BuildStatementList(P.Children[1]);
+  }
+  ast_node A;
+  A.Children.push_back(BuildStatement(P));
+  return A;
+}
+
+// Every loop becomes a LOOP of init, condition, step and body; the parts a
+// loop lacks are NONE. The step of while and do-while is part of the body.
+ast_node ast::BuildIteration(parse_node &P) {
+  ast_node A;
+  A.Type = ast_node::LOOP;
+  A.Children.resize(4);
+  std::vector<parse_node> &C = P.Children;
+  switch (C[0].Token.Type) {
+  case token::WHILE:
+    A.Children[1] = BuildExpression(C[2]);
+    A.Children[3] = BuildBody(C[4]);
+    break;
+  case token::DO:
+    A.Modifiers = ast_node::POST_TEST;
+    A.Children[1] = BuildExpression(C[4]);
+    A.Children[3] = BuildBody(C[1]);
+    break;
+  case token::FOR: {
+    size_t i = 3;
+    A.Children[0] = BuildStatement(C[2]);
+    if (C[i].Type != parse_node::T)
+      A.Children[1] = BuildExpression(C[i++]);
+    if (C[++i].Type != parse_node::T)
+      A.Children[2] = BuildExpression(C[i++]);
+    A.Children[3] = BuildBody(C[++i]);
+    break;
+  }
+  }
+  return A;
+}
+
+// An if becomes a SELECTION of condition, then and else part, the last NONE
+// when there is no else.
+ast_node ast::BuildSelection(parse_node &P) {
+  ast_node A;
+  A.Type = ast_node::SELECTION;
+  A.Children.resize(3);
+  std::vector<parse_node> &C = P.Children;
+  A.Children[0] = BuildExpression(C[2]);
+  A.Children[1] = BuildBody(C[4]);
+  if (C.size() > 6)
+    A.Children[2] = BuildBody(C[6]);
+  return A;
+}
+
 ast_node ast::BuildDeclaration(parse_node &P) {
   ast_node A;
   parse_node &Declarator = P.Children[0];
   std::string ID;
-  int Qualifier;
-  int Specifier;
+  int Qualifier = 0;
+  int Specifier = 0;
   for (size_t i = 0; i < Declarator.Children.size(); ++i) {
     if (Declarator.Children[i].Type == parse_node::TYPE_QUALIFIER) {
       Qualifier = Declarator.Children[i].Token.Type;
@@ -104,6 +365,9 @@ ast_node ast::BuildDeclaration(parse_node &P) {
     } else if (Declarator.Children[i].Type == parse_node::E &&
                Declarator.Children[i].Children[0].Token.Type == token::EQUAL) {
       A.Children.push_back(BuildAssignmentExpression(Declarator.Children[i]));
+    } else if (Declarator.Children[i].Token.Type == token::LEFT_BRACKET &&
+               i + 1 < Declarator.Children.size()) {
+      A.IntValue = BuildExpression(Declarator.Children[i + 1]).IntValue;
     } else if (Declarator.Children[i].Token.Type == token::SEMICOLON) {
       break;
     }
@@ -118,13 +382,33 @@ ast_node ast::BuildDeclaration(parse_node &P) {
   return A;
 }
 
+ast_node ast::BuildParameter(parse_node &P) {
+  ast_node A;
+  int Specifier = 0;
+  for (parse_node &PN : P.Children) {
+    if (PN.Type == parse_node::TYPE_SPECIFIER) {
+      Specifier = PN.Token.Type;
+    } else if (PN.Token.Type == token::IDENTIFIER) {
+      A.Id = PN.Token.Id;
+    }
+  }
+
+  symtable_entry *E = SymbolTable->Lookup(A.Id);
+  E->TypeSpecifier = Specifier;
+  E->Qualifier = token::IN;
+  A.Type = ast_node::VARIABLE;
+  A.Modifiers = ast_node::DECLARE;
+  return A;
+}
+
 ast_node ast::BuildFunctionDefinition(parse_node &P) {
   ast_node A;
   A.Type = ast_node::FUNCTION;
+  ast_node Params;
   parse_node &Declarator = P;
   std::string ID;
-  int Qualifier;
-  int Specifier;
+  int Qualifier = 0;
+  int Specifier = 0;
   for (size_t i = 0; i < Declarator.Children.size(); ++i) {
     if (Declarator.Children[i].Type == parse_node::TYPE_QUALIFIER) {
       Qualifier = Declarator.Children[i].Token.Type;
@@ -133,13 +417,18 @@ ast_node ast::BuildFunctionDefinition(parse_node &P) {
     } else if (Declarator.Children[i].Token.Type == token::IDENTIFIER) {
       ID = Declarator.Children[i].Token.Id;
     } else if (Declarator.Children[i].Token.Type == token::LEFT_PAREN) {
-      // TODO params
-      ++i;
+      while (Declarator.Children[i + 1].Token.Type != token::RIGHT_PAREN) {
+        parse_node &PN = Declarator.Children[++i];
+        if (PN.Type == parse_node::E && PN.Children.size())
+          Params.Children.push_back(BuildParameter(PN));
+      }
     } else if (Declarator.Children[i].Token.Type == token::LEFT_BRACE) {
       A.Children.push_back(BuildStatementList(Declarator.Children[++i]));
     }
   }
 
+  A.Children.push_back(Params);
+
   symtable_entry *E = SymbolTable->Lookup(ID);
   E->TypeSpecifier = Specifier;
   E->Qualifier = Qualifier;
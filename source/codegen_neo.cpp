@@ -1,60 +1,104 @@
 
-#include "codegen_neo.h"
+#include "codegen_shbin.h"
+#include "ir.h"
 #include "lexer.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
 #include <cstring>
+#include <iostream>
+#include <set>
+#include <unordered_map>
 
 const neocode_variable ReturnReg = {"", "", 0, 15 + 0x10, 0, {0}, 0};
 
-static int GetInstructionFromIdentifier(std::string Name) {
-  if (Name.compare("mov") == 0) {
-    return neocode_instruction::MOV;
-  }
-  if (Name.compare("mul") == 0) {
-    return neocode_instruction::MUL;
-  }
-  if (Name.compare("rsq") == 0) {
-    return neocode_instruction::RSQ;
-  }
-  if (Name.compare("rcp") == 0) {
-    return neocode_instruction::RCP;
-  }
-  if (Name.compare("nop") == 0) {
-    return neocode_instruction::NOP;
-  }
-  if (Name.compare("end") == 0) {
-    return neocode_instruction::END;
-  }
-  if (Name.compare("exp") == 0) {
-    return neocode_instruction::EX2;
-  }
-  if (Name.compare("log") == 0) {
-    return neocode_instruction::LG2;
-  }
-  if (Name.compare("dp4") == 0) {
-    return neocode_instruction::DP4;
-  }
-  return neocode_instruction::EMPTY;
+static void ReportError(const neocode_options &Options, const char *Format,
+                        va_list Args) {
+  char Message[512];
+  vsnprintf(Message, sizeof(Message), Format, Args);
+  if (Options.ErrorFunc)
+    Options.ErrorFunc(Message);
+  else
+    printf("error: %s\n", Message);
 }
 
-static int GetSwizzleFromIdentifier(std::string Id) {
-  int Swizzle = 0;
-  for (int i = 0; i < 4 && i < (Id.length() + 1); ++i) {
-    switch (Id[i]) {
-    case 'x':
-      Swizzle |= (1 << (i * 4));
-      continue;
-    case 'y':
-      Swizzle |= (2 << (i * 4));
-      continue;
-    case 'z':
-      Swizzle |= (3 << (i * 4));
-      continue;
-    case 'w':
-      Swizzle |= (4 << (i * 4));
-      continue;
-    }
+void CGNeoReport(const neocode_options &Options, const char *Format, ...) {
+  va_list Args;
+  va_start(Args, Format);
+  ReportError(Options, Format, Args);
+  va_end(Args);
+}
+
+void CGNeoError(neocode_program *Program, const char *Format, ...) {
+  va_list Args;
+  va_start(Args, Format);
+  ReportError(Program->Options, Format, Args);
+  va_end(Args);
+  ++Program->ErrorCount;
+}
+
+// Measuring builds a body only to count it, so it reports nothing: the real
+// build that follows does. An unrolled body is built once per iteration but
+// reports each error once.
+void cg_neo::Error(const char *Format, ...) {
+  if (Measuring)
+    return;
+  char Message[256];
+  va_list Args;
+  va_start(Args, Format);
+  vsnprintf(Message, sizeof(Message), Format, Args);
+  va_end(Args);
+  std::string Text = Function->Name + ": " + Message;
+  if (Reported.insert(Text).second)
+    CGNeoError(Program, "%s", Text.c_str());
+  else
+    ++Program->ErrorCount;
+}
+
+static int GetInstructionFromIdentifier(const std::string &Name) {
+  static const std::unordered_map<std::string, int> Mnemonics = {
+      {"mov", neocode_instruction::MOV},  {"mul", neocode_instruction::MUL},
+      {"rsq", neocode_instruction::RSQ},  {"rcp", neocode_instruction::RCP},
+      {"nop", neocode_instruction::NOP},  {"end", neocode_instruction::END},
+      {"exp", neocode_instruction::EX2},  {"log", neocode_instruction::LG2},
+      {"dp4", neocode_instruction::DP4},  {"add", neocode_instruction::ADD},
+      {"dp3", neocode_instruction::DP3},  {"dph", neocode_instruction::DPH},
+      {"mad", neocode_instruction::MAD},  {"min", neocode_instruction::MIN},
+      {"max", neocode_instruction::MAX},  {"flr", neocode_instruction::FLR},
+      {"slt", neocode_instruction::SLT},  {"sge", neocode_instruction::SGE},
+      {"mova", neocode_instruction::MOVA},
+  };
+  auto It = Mnemonics.find(Name);
+  return It != Mnemonics.end() ? It->second : neocode_instruction::EMPTY;
+}
+
+static const char *GetInstructionMnemonic(int Type) {
+  switch (Type) {
+  case neocode_instruction::ADD:
+    return "add";
+  case neocode_instruction::MUL:
+    return "mul";
+  case neocode_instruction::DP3:
+    return "dp3";
+  case neocode_instruction::DP4:
+    return "dp4";
+  case neocode_instruction::DPH:
+    return "dph";
+  case neocode_instruction::MIN:
+    return "min";
+  case neocode_instruction::MAX:
+    return "max";
+  case neocode_instruction::SLT:
+    return "slt";
+  case neocode_instruction::SGE:
+    return "sge";
+  case neocode_instruction::FLR:
+    return "flr";
+  case neocode_instruction::MOVA:
+    return "mova";
   }
-  return Swizzle;
+  return "";
 }
 
 static std::string GetSwizzleAsString(neocode_variable &V) {
@@ -76,10 +120,38 @@ static std::string GetSwizzleAsString(neocode_variable &V) {
 
 static std::string RegisterName(neocode_variable &Var, int UseRaw = 0) {
   std::string Swizz = GetSwizzleAsString(Var);
+  if (Var.Negate && !UseRaw) {
+    neocode_variable Positive = Var;
+    Positive.Negate = 0;
+    return "-" + RegisterName(Positive);
+  }
+  if (Var.Relative) {
+    static const char *Index[] = {"", "a0.x", "a0.y", "aL"};
+    neocode_variable Base = Var;
+    Base.Relative = 0;
+    Base.Swizzle = 0;
+    Base.Name.clear();
+    return RegisterName(Base, 1) + "[" + Index[Var.Relative] + "]" + Swizz;
+  }
+  if (Var.TypeName.compare("mat4") == 0 && Var.Name.empty()) {
+    neocode_variable Row = Var;
+    Row.Register += Var.Swizzle;
+    Row.Swizzle = 0;
+    Row.TypeName.clear();
+    return RegisterName(Row, 1);
+  }
   if (Var.Name.size() && !UseRaw)
     return Var.Name + Swizz;
+  if (Var.Register >= 0xA0)
+    return std::string("b") + std::to_string(Var.Register - 0xA0);
   if (Var.RegisterType == 0) {
     int Register = Var.Register;
+    // Past the last float constant live the address register and then the
+    // integer and bool uniforms.
+    if (Register >= 0x90)
+      return std::string("i") + std::to_string(Register - 0x90) + Swizz;
+    if (Register >= 0x80)
+      return std::string("a0") + Swizz;
     if (Register < 0x10)
       return std::string("v") + std::to_string(Register) + Swizz;
     if (Register < 0x20)
@@ -98,6 +170,8 @@ static std::string RegisterName(neocode_variable &Var, int UseRaw = 0) {
 }
 
 static std::string RegisterName(int Register) {
+  if (Register >= 0xA0)
+    return std::string("b") + std::to_string(Register - 0xA0);
   if (Register < 0x10)
     return std::string("o") + std::to_string(Register);
   if (Register < 0x20)
@@ -106,16 +180,194 @@ static std::string RegisterName(int Register) {
   return std::string("c") + std::to_string(Register - 0x20);
 }
 
-static bool IsVariableType(int T) {
-  switch (T) {
-  case ast_node::VARIABLE:
-  case ast_node::FLOAT_LITERAL:
-  case ast_node::INT_LITERAL:
-  case ast_node::BOOL_LITERAL:
-  case ast_node::STRING_LITERAL:
-    return true;
+static int GetComponentFromLetter(char C) {
+  for (const char *Set : {"xyzw", "rgba", "stpq"}) {
+    const char *Match = strchr(Set, C);
+    if (C && Match)
+      return Match - Set;
   }
-  return false;
+  return 0;
+}
+
+static int GetTypeComponentCount(int TypeSpecifier) {
+  switch (TypeSpecifier) {
+  case token::FLOAT:
+  case token::INT:
+  case token::BOOL:
+    return 1;
+  case token::VEC2:
+  case token::IVEC2:
+  case token::BVEC2:
+    return 2;
+  case token::VEC3:
+  case token::IVEC3:
+  case token::BVEC3:
+    return 3;
+  }
+  return 4;
+}
+
+static bool IsLiteral(const ast_node &Node) {
+  return Node.Type == ast_node::FLOAT_LITERAL ||
+         Node.Type == ast_node::INT_LITERAL;
+}
+
+static float LiteralValue(const ast_node &Node) {
+  if (Node.Type == ast_node::INT_LITERAL)
+    return (float)Node.IntValue;
+  return Node.FloatValue;
+}
+
+static neocode_variable *FindGlobal(neocode_program *Program,
+                                    const std::string &Name) {
+  for (neocode_variable &V : Program->Globals) {
+    if (V.Name.compare(Name) == 0)
+      return &V;
+  }
+  return nullptr;
+}
+
+static bool IsPerInstance(const neocode_options &Options,
+                          const std::string &Name) {
+  return Options.InstanceId.size() &&
+         std::find(Options.PerInstance.begin(), Options.PerInstance.end(),
+                   Name) != Options.PerInstance.end();
+}
+
+// Read Op through a swizzle given as component letters; short selections
+// repeat their last letter as the assembler does.
+static ir_operand Select(const ir_operand &Op, const std::string &Letters) {
+  ir_operand Use;
+  for (int i = 0; i < 4 && Letters.size(); ++i) {
+    char C = Letters[i < (int)Letters.size() ? i : Letters.size() - 1];
+    Use.Swizzle |= (GetComponentFromLetter(C) + 1) << (i * 4);
+  }
+  return IRCompose(Use, Op);
+}
+
+static ir_operand Broadcast(const ir_operand &Op) { return Select(Op, "x"); }
+
+// PICA applies the source swizzle per destination lane, whereas GLSL pairs the
+// n-th written component with the n-th source component. Move the source
+// selectors over to the lanes actually written.
+static ir_operand AlignToLanes(const ir_operand &Src, int Count,
+                               const std::vector<int> &Lanes) {
+  ir_operand Use;
+  Use.Swizzle = 0x4321;
+  for (size_t n = 0; n < Lanes.size(); ++n) {
+    Use.Swizzle &= ~(0b1111 << (Lanes[n] * 4));
+    Use.Swizzle |= ((Count == 1 ? 0 : (int)n) + 1) << (Lanes[n] * 4);
+  }
+  return IRCompose(Use, Src);
+}
+
+static int LaneMask(const std::vector<int> &Lanes) {
+  int Mask = 0;
+  for (int Lane : Lanes)
+    Mask |= 1 << Lane;
+  return Mask;
+}
+
+// An output that shares its register with others has its components listed
+// in its Swizzle; component n of the variable lives in that lane.
+static void Store(ir_function *Function, const neocode_variable &Dst,
+                  const ir_operand &Src, int Mask) {
+  ir_instruction In;
+  In.Op = IR_STORE;
+  In.Dst = Dst;
+  In.Src[0] = Src;
+  In.Mask = Mask;
+  if (Dst.RegisterType > 0 && Dst.Swizzle) {
+    ir_operand Use;
+    Use.Swizzle = 0x4321;
+    In.Mask = 0;
+    for (int i = 0; i < 4; ++i) {
+      int Lane = ((Dst.Swizzle >> (i * 4)) & 0b1111) - 1;
+      if (Lane < 0 || !(Mask & (1 << i)))
+        continue;
+      In.Mask |= 1 << Lane;
+      Use.Swizzle &= ~(0b1111 << (Lane * 4));
+      Use.Swizzle |= (i + 1) << (Lane * 4);
+    }
+    In.Src[0] = IRCompose(Use, Src);
+    In.Dst.Name.clear();
+    In.Dst.Swizzle = 0;
+  }
+  Function->Blocks.back().Instructions.push_back(In);
+}
+
+static ir_operand Negated(ir_operand Op) {
+  Op.Negate = !Op.Negate;
+  return Op;
+}
+
+enum {
+  BUILTIN_DOT,
+  BUILTIN_LENGTH,
+  BUILTIN_DISTANCE,
+  BUILTIN_NORMALIZE,
+  BUILTIN_REFLECT,
+  BUILTIN_INVERSESQRT,
+  BUILTIN_SQRT,
+  BUILTIN_EXP2,
+  BUILTIN_LOG2,
+  BUILTIN_EXP,
+  BUILTIN_LOG,
+  BUILTIN_POW,
+  BUILTIN_MIN,
+  BUILTIN_MAX,
+  BUILTIN_CLAMP,
+  BUILTIN_MIX,
+  BUILTIN_STEP,
+  BUILTIN_FLOOR,
+  BUILTIN_FRACT,
+  BUILTIN_ABS,
+  BUILTIN_EMIT,
+  BUILTIN_VERTEX_INPUT,
+};
+
+struct builtin_function {
+  const char *Name;
+  int Id;
+  int Arguments;
+  bool Scalar;
+};
+
+static const builtin_function Builtins[] = {
+    {"dot", BUILTIN_DOT, 2, true},
+    {"length", BUILTIN_LENGTH, 1, true},
+    {"distance", BUILTIN_DISTANCE, 2, true},
+    {"normalize", BUILTIN_NORMALIZE, 1, false},
+    {"reflect", BUILTIN_REFLECT, 2, false},
+    {"inversesqrt", BUILTIN_INVERSESQRT, 1, false},
+    {"sqrt", BUILTIN_SQRT, 1, false},
+    {"exp2", BUILTIN_EXP2, 1, false},
+    {"log2", BUILTIN_LOG2, 1, false},
+    {"exp", BUILTIN_EXP, 1, false},
+    {"log", BUILTIN_LOG, 1, false},
+    {"pow", BUILTIN_POW, 2, false},
+    {"min", BUILTIN_MIN, 2, false},
+    {"max", BUILTIN_MAX, 2, false},
+    {"clamp", BUILTIN_CLAMP, 3, false},
+    {"mix", BUILTIN_MIX, 3, false},
+    {"step", BUILTIN_STEP, 2, false},
+    {"floor", BUILTIN_FLOOR, 1, false},
+    {"fract", BUILTIN_FRACT, 1, false},
+    {"abs", BUILTIN_ABS, 1, false},
+    {"emit", BUILTIN_EMIT, 1, true},
+    {"vertex_input", BUILTIN_VERTEX_INPUT, 2, false},
+};
+
+// A function of the shader's own shadows the builtin of the same name.
+static const builtin_function *FindBuiltin(symtable *S,
+                                           const std::string &Name) {
+  if (S->Lookup(Name)->Definition == ast_node::FUNCTION)
+    return nullptr;
+  for (const builtin_function &B : Builtins) {
+    if (Name.compare(B.Name) == 0)
+      return &B;
+  }
+  return nullptr;
 }
 
 neocode_variable *neocode_function::GetVariable(std::string Name) {
@@ -136,297 +388,1900 @@ neocode_variable *neocode_function::GetVariable(std::string Name) {
   return nullptr;
 }
 
-neocode_instruction cg_neo::BuildInstruction(neocode_function *Function,
-                                             ast_node *ASTNode) {
+ir_operand cg_neo::Emit(int Op, const ir_operand &A, const ir_operand &B,
+                        int Mask, const ir_operand &Prior) {
+  ir_instruction In;
+  In.Op = Op;
+  In.Result = Function->NewValue();
+  In.Mask = Mask;
+  In.Src[0] = A;
+  In.Src[1] = B;
+  if (Mask != 0b1111)
+    In.Prior = Prior;
+  Function->Blocks.back().Instructions.push_back(In);
+  return IRValue(In.Result);
+}
+
+// RCP, RSQ, EX2 and LG2 only read x, so a vector takes one per component.
+ir_operand cg_neo::EmitPerLane(int Op, const ir_operand &X, int Count) {
+  if (Count == 1)
+    return Emit(Op, X, ir_operand(), 0b0001);
+  ir_operand Result;
+  for (int i = 0; i < Count; ++i)
+    Result = Emit(Op, Select(X, std::string(1, "xyzw"[i])), ir_operand(),
+                  1 << i, Result);
+  return Result;
+}
+
+ir_operand cg_neo::EmitDot(const ir_operand &A, const ir_operand &B,
+                           int Count) {
+  switch (Count) {
+  case 1:
+    return Emit(neocode_instruction::MUL, A, B, 0b0001);
+  case 2: {
+    ir_operand Products = Emit(neocode_instruction::MUL, A, B, 0b0011);
+    return Emit(neocode_instruction::ADD, Products, Select(Products, "y"),
+                0b0001);
+  }
+  case 3:
+    return Emit(neocode_instruction::DP3, A, B, 0b0001);
+  }
+  return Emit(neocode_instruction::DP4, A, B, 0b0001);
+}
+
+// Builtins work on the components their arguments have and leave the other
+// lanes undefined; scalar results land in x.
+ir_operand cg_neo::BuildBuiltin(ast_node *ASTNode,
+                                const builtin_function &Builtin) {
+  int Count = 1;
+  for (ast_node &Child : ASTNode->Children)
+    Count = std::max(Count, GetComponentCount(&Child));
+  int Given = ASTNode->Children.size();
+  int Most = Builtin.Id == BUILTIN_EMIT ? 3 : Builtin.Arguments;
+  if (Given < Builtin.Arguments || Given > Most) {
+    if (Most > Builtin.Arguments)
+      Error("%s() needs %d to %d arguments", Builtin.Name,
+            Builtin.Arguments, Most);
+    else
+      Error("%s() needs %d argument%s", Builtin.Name, Builtin.Arguments,
+            Builtin.Arguments == 1 ? "" : "s");
+    return IRConstant(0, 0, 0, 0);
+  }
+  if (Builtin.Id == BUILTIN_EMIT || Builtin.Id == BUILTIN_VERTEX_INPUT)
+    return BuildGeometryBuiltin(ASTNode, Builtin);
+  std::vector<ir_operand> Args;
+  for (ast_node &Child : ASTNode->Children) {
+    ir_operand Op = BuildInstruction(&Child);
+    if (Count > 1 && GetComponentCount(&Child) == 1)
+      Op = Broadcast(Op);
+    Args.push_back(Op);
+  }
+
+  int Mask = (1 << Count) - 1;
+  const ir_operand &A = Args[0];
+  switch (Builtin.Id) {
+  case BUILTIN_DOT:
+    return EmitDot(A, Args[1], Count);
+  case BUILTIN_LENGTH:
+    return EmitPerLane(neocode_instruction::RCP,
+                       EmitPerLane(neocode_instruction::RSQ,
+                                   EmitDot(A, A, Count), 1),
+                       1);
+  case BUILTIN_DISTANCE: {
+    ir_operand D = Emit(neocode_instruction::ADD, A, Negated(Args[1]), Mask);
+    return EmitPerLane(neocode_instruction::RCP,
+                       EmitPerLane(neocode_instruction::RSQ,
+                                   EmitDot(D, D, Count), 1),
+                       1);
+  }
+  case BUILTIN_NORMALIZE: {
+    ir_operand Scale = EmitPerLane(neocode_instruction::RSQ,
+                                   EmitDot(A, A, Count), 1);
+    return Emit(neocode_instruction::MUL, A, Broadcast(Scale), Mask);
+  }
+  case BUILTIN_REFLECT: {
+    ir_operand D = EmitDot(Args[1], A, Count);
+    D = Emit(neocode_instruction::ADD, D, D, 0b0001);
+    ir_operand Offset =
+        Emit(neocode_instruction::MUL, Args[1], Broadcast(D), Mask);
+    return Emit(neocode_instruction::ADD, A, Negated(Offset), Mask);
+  }
+  case BUILTIN_INVERSESQRT:
+    return EmitPerLane(neocode_instruction::RSQ, A, Count);
+  case BUILTIN_SQRT:
+    return EmitPerLane(neocode_instruction::RCP,
+                       EmitPerLane(neocode_instruction::RSQ, A, Count), Count);
+  case BUILTIN_EXP2:
+    return EmitPerLane(neocode_instruction::EX2, A, Count);
+  case BUILTIN_LOG2:
+    return EmitPerLane(neocode_instruction::LG2, A, Count);
+  case BUILTIN_EXP: {
+    float Log2E = 1.44269504f;
+    ir_operand X = Emit(neocode_instruction::MUL, A,
+                        IRConstant(Log2E, Log2E, Log2E, Log2E), Mask);
+    return EmitPerLane(neocode_instruction::EX2, X, Count);
+  }
+  case BUILTIN_LOG: {
+    float Ln2 = 0.693147181f;
+    return Emit(neocode_instruction::MUL,
+                EmitPerLane(neocode_instruction::LG2, A, Count),
+                IRConstant(Ln2, Ln2, Ln2, Ln2), Mask);
+  }
+  case BUILTIN_POW: {
+    ir_operand X =
+        Emit(neocode_instruction::MUL,
+             EmitPerLane(neocode_instruction::LG2, A, Count), Args[1], Mask);
+    return EmitPerLane(neocode_instruction::EX2, X, Count);
+  }
+  case BUILTIN_MIN:
+    return Emit(neocode_instruction::MIN, A, Args[1], Mask);
+  case BUILTIN_MAX:
+    return Emit(neocode_instruction::MAX, A, Args[1], Mask);
+  case BUILTIN_CLAMP:
+    return Emit(neocode_instruction::MIN,
+                Emit(neocode_instruction::MAX, A, Args[1], Mask), Args[2],
+                Mask);
+  case BUILTIN_MIX: {
+    ir_operand D = Emit(neocode_instruction::ADD, Args[1], Negated(A), Mask);
+    return Emit(neocode_instruction::ADD,
+                Emit(neocode_instruction::MUL, Args[2], D, Mask), A, Mask);
+  }
+  case BUILTIN_STEP:
+    return Emit(neocode_instruction::SGE, Args[1], A, Mask);
+  case BUILTIN_FLOOR:
+    return Emit(neocode_instruction::FLR, A, ir_operand(), Mask);
+  case BUILTIN_FRACT: {
+    ir_operand Floor = Emit(neocode_instruction::FLR, A, ir_operand(), Mask);
+    return Emit(neocode_instruction::ADD, A, Negated(Floor), Mask);
+  }
+  case BUILTIN_ABS:
+    return Emit(neocode_instruction::MAX, A, Negated(A), Mask);
+  }
+  return IRConstant(0, 0, 0, 0);
+}
+
+// The geometry shader sees all vertices of a primitive at once, the
+// attributes of each following those of the one before: attribute A of
+// vertex N is in vA + N * Stride, Stride being the registers the attributes
+// take. emit(N[, Primitive[, Inverted]]) stores the outputs to slot N and,
+// when asked, completes a triangle from the slots.
+ir_operand cg_neo::BuildGeometryBuiltin(ast_node *ASTNode,
+                                        const builtin_function &Builtin) {
+  std::vector<ast_node> &Args = ASTNode->Children;
+  if (!Program->Options.Geometry) {
+    Error("%s() needs a geometry shader", Builtin.Name);
+    return IRConstant(0, 0, 0, 0);
+  }
+
+  if (Builtin.Id == BUILTIN_VERTEX_INPUT) {
+    neocode_variable *G = FindGlobal(Program, Args[0].Id);
+    int Stride = 0;
+    for (neocode_variable &V : Program->Globals) {
+      if (V.RegisterType == 0 && V.Register < 0x10)
+        Stride = std::max(Stride, V.Register + 1);
+    }
+    int Vertex = Args[1].Type == ast_node::INT_LITERAL ? Args[1].IntValue : -1;
+    if (!G || G->RegisterType != 0 || G->Register >= 0x10 || Vertex < 0 ||
+        G->Register + Vertex * Stride >= 0x10) {
+      Error("vertex_input() needs an attribute and a vertex number within "
+            "v0-v15");
+      return IRConstant(0, 0, 0, 0);
+    }
+    if (Vertex == 0)
+      return IRGlobal(*G);
+    neocode_variable Input = *G;
+    Input.Name.clear();
+    Input.Register += Vertex * Stride;
+    return IRGlobal(Input);
+  }
+
+  int Flags[3] = {-1, 0, 0};
+  for (size_t i = 0; i < Args.size() && i < 3; ++i) {
+    if (Args[i].Type == ast_node::INT_LITERAL ||
+        Args[i].Type == ast_node::BOOL_LITERAL)
+      Flags[i] = Args[i].IntValue;
+    else
+      Flags[i] = -1;
+  }
+  if (Flags[0] < 0 || Flags[0] > 3 || Flags[1] < 0 || Flags[2] < 0) {
+    Error("emit() needs a constant slot 0-3 and constant flags");
+    return ir_operand();
+  }
+  ir_instruction Set;
+  Set.Op = neocode_instruction::SETEMIT;
+  Set.Dst.Const.Integer.X = Flags[0];
+  Set.Dst.Const.Integer.Y = Flags[1] != 0;
+  Set.Dst.Const.Integer.Z = Flags[2] != 0;
+  Function->Blocks.back().Instructions.push_back(Set);
+  ir_instruction In;
+  In.Op = neocode_instruction::EMIT;
+  Function->Blocks.back().Instructions.push_back(In);
+  return ir_operand();
+}
+
+int cg_neo::GetComponentCount(ast_node *ASTNode) {
+  switch (ASTNode->Type) {
+  case ast_node::VARIABLE:
+    return GetTypeComponentCount(SymbolTable->Lookup(ASTNode->Id)->TypeSpecifier);
+  case ast_node::FIELD_SELECTION:
+    return ASTNode->Id.length();
+  case ast_node::FLOAT_LITERAL:
+  case ast_node::INT_LITERAL:
+  case ast_node::BOOL_LITERAL:
+    return 1;
+  case ast_node::FUNCTION_CALL: {
+    if (const builtin_function *B = FindBuiltin(SymbolTable, ASTNode->Id)) {
+      int Count = 1;
+      for (ast_node &Child : ASTNode->Children)
+        Count = std::max(Count, GetComponentCount(&Child));
+      return B->Scalar ? 1 : Count;
+    }
+    symtable_entry *E = SymbolTable->Lookup(ASTNode->Id);
+    if (parser::IsTypeSpecifier(E->SymbolType))
+      return GetTypeComponentCount(E->SymbolType);
+    return GetTypeComponentCount(E->TypeSpecifier);
+  }
+  case ast_node::NEGATE:
+  case ast_node::ASSIGNMENT:
+  case ast_node::INDEX:
+    return GetComponentCount(&ASTNode->Children[0]);
+  case ast_node::PLUS:
+  case ast_node::MINUS:
+  case ast_node::MULTIPLY:
+  case ast_node::DIVIDE:
+    return std::max(GetComponentCount(&ASTNode->Children[0]),
+                    GetComponentCount(&ASTNode->Children[1]));
+  case ast_node::LESS:
+  case ast_node::GREATER:
+  case ast_node::LESS_EQUAL:
+  case ast_node::GREATER_EQUAL:
+  case ast_node::EQUAL:
+  case ast_node::NOT_EQUAL:
+    return 1;
+  }
+  return 4;
+}
+
+ir_operand cg_neo::BuildAsm(ast_node *ASTNode) {
+  // Operands are [-]name or [-]@N with an optional .swizzle. @0 is the value
+  // the instruction defines, @N the N-th argument of the asm() call. A
+  // destination @N bound to a variable writes that variable.
+  std::map<long, ir_operand> Bound;
+  std::vector<ir_operand> Operands;
+  std::vector<std::string> Names, Swizzles;
+  for (ast_node &Node : ASTNode->Children[0].Children) {
+    ast_node *Operand = &Node;
+    bool Negate = Operand->Type == ast_node::NEGATE;
+    if (Negate)
+      Operand = &Operand->Children[0];
+    std::string Swizzle;
+    if (Operand->Type == ast_node::FIELD_SELECTION) {
+      Swizzle = Operand->Id;
+      Operand = &Operand->Children[0];
+    }
+
+    ir_operand Op;
+    std::string Name;
+    if (Operand->Type == ast_node::ASM_BINDING) {
+      long Index = Operand->IntValue;
+      if (Index > 0 && Index < (long)ASTNode->Children.size()) {
+        ast_node *Argument = &ASTNode->Children[Index];
+        if (!Bound.count(Index))
+          Bound[Index] = BuildInstruction(Argument);
+        Op = Bound[Index];
+        if (Operands.empty() && Argument->Type == ast_node::VARIABLE)
+          Name = Argument->Id;
+      }
+    } else {
+      Name = Operand->Id;
+      if (Locals.count(Name))
+        Op = Locals[Name];
+      else if (neocode_variable *G = FindGlobal(Program, Name))
+        Op = IRGlobal(*G);
+    }
+    Op.Negate = Op.Negate != Negate;
+    Operands.push_back(Op);
+    Names.push_back(Name);
+    Swizzles.push_back(Swizzle);
+  }
 
-  if (IsVariableType(ASTNode->Type) &&
+  ir_instruction In;
+  In.Op = GetInstructionFromIdentifier(ASTNode->Id);
+  for (size_t i = 1; i < Operands.size() && i < 4; ++i)
+    In.Src[i - 1] = Select(Operands[i], Swizzles[i]);
+  if (Operands.empty()) {
+    Function->Blocks.back().Instructions.push_back(In);
+    return ir_operand();
+  }
+
+  const std::string &Name = Names[0];
+  In.Mask = 0;
+  for (char C : Swizzles[0])
+    In.Mask |= 1 << GetComponentFromLetter(C);
+  if (!In.Mask)
+    In.Mask = 0b1111;
+  if (Name.compare("a0") == 0) {
+    In.Dst = (neocode_variable){"", "", 0, 0x80, 0};
+    Function->Blocks.back().Instructions.push_back(In);
+    return ir_operand();
+  }
+
+  In.Result = Function->NewValue();
+  if (In.Mask != 0b1111 && Locals.count(Name))
+    In.Prior = Locals[Name];
+  Function->Blocks.back().Instructions.push_back(In);
+  ir_operand Result = IRValue(In.Result);
+  if (Locals.count(Name))
+    Locals[Name] = Result;
+  else if (neocode_variable *G = FindGlobal(Program, Name))
+    Store(Function, *G, Result, In.Mask);
+  return Result;
+}
+
+ir_operand cg_neo::EmitLoad(const neocode_variable &Array, int Row,
+                            const ir_operand &Index) {
+  ir_instruction In;
+  In.Op = IR_LOAD;
+  In.Result = Function->NewValue();
+  In.Src[0] = Index;
+  In.Dst = Array;
+  In.Dst.Swizzle = Row;
+  Function->Blocks.back().Instructions.push_back(In);
+  return IRValue(In.Result);
+}
+
+// A mat4 that BuildIndex picked by a computed index carries that index in
+// Value, and each of its rows is a load.
+ir_operand cg_neo::MatrixRow(const ir_operand &M, int Row) {
+  if (M.Value >= 0)
+    return EmitLoad(M.Global, Row, IRValue(M.Value));
+  ir_operand R = M;
+  R.Global.Swizzle = Row;
+  return R;
+}
+
+// Element Index of a uniform array, read through the address register. The
+// counter of the LOOP around it is read through aL.
+ir_operand cg_neo::IndexArray(const neocode_variable &Array,
+                              const ir_operand &Index) {
+  if (Array.TypeName.compare("mat4") != 0) {
+    if (Index.Kind == ir_operand::VALUE && Index.Value == LoopCounter &&
+        !Index.Negate && IRSwizzleSelector(Index, 0) == 0)
+      return EmitLoad(Array, 0, IRValue(LoopAddress));
+    return EmitLoad(Array, 0, Index);
+  }
+  ir_operand M = IRGlobal(Array);
+  M.Value = Emit(neocode_instruction::MUL, Index, IRConstant(4, 4, 4, 4),
+                 0b0001)
+                .Value;
+  return M;
+}
+
+// The x component of the instance id attribute.
+ir_operand cg_neo::InstanceIndex() {
+  neocode_variable *Id = FindGlobal(Program, Program->Options.InstanceId);
+  if (!Id || Id->RegisterType != 0 || Id->Register >= 0x10) {
+    Error("no attribute %s to take the instance from",
+          Program->Options.InstanceId.c_str());
+    return IRConstant(0, 0, 0, 0);
+  }
+  return Broadcast(IRGlobal(*Id));
+}
+
+// Uniform arrays lie element after element, four registers to a mat4. A
+// literal index names its element directly, any other one is read through
+// the address register.
+ir_operand cg_neo::BuildIndex(ast_node *ASTNode) {
+  ast_node *Array = &ASTNode->Children[0];
+  neocode_variable *G = Array->Type == ast_node::VARIABLE
+                            ? FindGlobal(Program, Array->Id)
+                            : nullptr;
+  if (!G || !G->Count) {
+    Error("only uniform arrays can be indexed");
+    return IRConstant(0, 0, 0, 0);
+  }
+  int Rows = G->TypeName.compare("mat4") == 0 ? 4 : 1;
+  ast_node *Index = &ASTNode->Children[1];
+  if (IsLiteral(*Index)) {
+    int Element = (int)LiteralValue(*Index);
+    if (Element < 0 || Element >= G->Count) {
+      Error("index %d out of the bounds of %s", Element, G->Name.c_str());
+      return IRConstant(0, 0, 0, 0);
+    }
+    return IRGlobal(IRArrayElement(*G, Element * Rows));
+  }
+
+  return IndexArray(*G, BuildInstruction(Index));
+}
+
+ir_operand cg_neo::BuildAssignment(ast_node *ASTNode) {
+  ast_node *Target = &ASTNode->Children[0];
+  ir_operand Old;
+  if (ASTNode->Modifiers & ast_node::POSTFIX)
+    Old = BuildInstruction(Target);
+  ir_operand Src = BuildInstruction(&ASTNode->Children[1]);
+  int Count = GetComponentCount(&ASTNode->Children[1]);
+  std::vector<int> Lanes = {0, 1, 2, 3};
+  if (Target->Type == ast_node::FIELD_SELECTION) {
+    Lanes.clear();
+    for (char C : Target->Id)
+      Lanes.push_back(GetComponentFromLetter(C));
+    Target = &Target->Children[0];
+  }
+  int Mask = LaneMask(Lanes);
+  ir_operand Value = AlignToLanes(Src, Count, Lanes);
+
+  if (Locals.count(Target->Id)) {
+    ir_operand &Local = Locals[Target->Id];
+    if (Mask == 0b1111)
+      Local = Value;
+    else
+      Local = Emit(neocode_instruction::MOV, Value, ir_operand(), Mask, Local);
+  } else if (neocode_variable *G = FindGlobal(Program, Target->Id)) {
+    Store(Function, *G, Value, Mask);
+  }
+  return (ASTNode->Modifiers & ast_node::POSTFIX) ? Old : Src;
+}
+
+// Arithmetic is selected from a table of tree patterns. A pattern matches a
+// node and possibly some of the nodes below it, costs the cycles of what it
+// emits and leaves the subtrees it does not cover to be selected on their
+// own. Every node takes the pattern with the cheapest cover of its whole
+// subtree, found bottom up as BURS does; earlier entries win ties, so the
+// specific idioms go first.
+struct select_pattern {
+  int Cost;
+  bool (*Match)(cg_neo &CG, ast_node *Node, std::vector<ast_node *> &Leaves);
+  ir_operand (*Reduce)(cg_neo &CG, ast_node *Node,
+                       const std::vector<ast_node *> &Leaves);
+};
+
+static bool IsMatrix(cg_neo &CG, ast_node *Node) {
+  if (Node->Type == ast_node::INDEX)
+    Node = &Node->Children[0];
+  if (Node->Type != ast_node::VARIABLE)
+    return false;
+  auto It = CG.Locals.find(Node->Id);
+  if (It != CG.Locals.end() && It->second.Kind != ir_operand::NONE)
+    return It->second.Kind == ir_operand::GLOBAL &&
+           It->second.Global.TypeName.compare("mat4") == 0;
+  neocode_variable *G = FindGlobal(CG.Program, Node->Id);
+  return G && G->TypeName.compare("mat4") == 0;
+}
+
+// Whether Node ends up read straight from the float uniforms: a literal, a
+// uniform, or a local that holds one of those.
+static bool IsConstantOperand(cg_neo &CG, ast_node *Node) {
+  while (Node->Type == ast_node::NEGATE ||
+         Node->Type == ast_node::FIELD_SELECTION)
+    Node = &Node->Children[0];
+  if (IsLiteral(*Node))
+    return true;
+  if (Node->Type != ast_node::VARIABLE)
+    return false;
+  ir_operand Op;
+  auto It = CG.Locals.find(Node->Id);
+  if (It != CG.Locals.end() && It->second.Kind != ir_operand::NONE)
+    Op = It->second;
+  else if (neocode_variable *G = FindGlobal(CG.Program, Node->Id))
+    Op = IRGlobal(*G);
+  return Op.Kind == ir_operand::CONSTANT ||
+         (Op.Kind == ir_operand::GLOBAL && Op.Global.RegisterType <= 0 &&
+          Op.Global.Register >= 0x20 && Op.Global.Register < 0x80);
+}
+
+// vec4(v.xyz, W) with a literal W.
+static bool IsHomogeneous(cg_neo &CG, ast_node *Node, float W) {
+  return Node->Type == ast_node::FUNCTION_CALL &&
+         Node->Id.compare("vec4") == 0 && Node->Children.size() == 2 &&
+         IsLiteral(Node->Children[1]) &&
+         LiteralValue(Node->Children[1]) == W &&
+         CG.GetComponentCount(&Node->Children[0]) == 3;
+}
+
+static bool IsOne(ast_node *Node) {
+  return IsLiteral(*Node) && LiteralValue(*Node) == 1.0f;
+}
+
+// Build the two operands of a componentwise instruction, broadcasting a
+// scalar that meets a vector.
+static void BuildPair(cg_neo &CG, ast_node *X, ast_node *Y, ir_operand &A,
+                      ir_operand &B) {
+  A = CG.BuildInstruction(X);
+  B = CG.BuildInstruction(Y);
+  int CountA = CG.GetComponentCount(X), CountB = CG.GetComponentCount(Y);
+  if (CountA == 1 && CountB > 1)
+    A = Broadcast(A);
+  if (CountB == 1 && CountA > 1)
+    B = Broadcast(B);
+}
+
+// mat4 * vec4(v.xyz, 1.0) and mat4 * vec4(v.xyz, 0.0) never need the vector
+// assembled: DPH supplies the homogeneous 1.0 itself and DP3 simply leaves w
+// out of the sum.
+static bool MatchMatrixDPH(cg_neo &CG, ast_node *Node,
+                           std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::MULTIPLY || !IsMatrix(CG, &Node->Children[0]) ||
+      !IsHomogeneous(CG, &Node->Children[1], 1.0f))
+    return false;
+  Leaves = {&Node->Children[0], &Node->Children[1].Children[0]};
+  return true;
+}
+
+static bool MatchMatrixDP3(cg_neo &CG, ast_node *Node,
+                           std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::MULTIPLY || !IsMatrix(CG, &Node->Children[0]) ||
+      !IsHomogeneous(CG, &Node->Children[1], 0.0f))
+    return false;
+  Leaves = {&Node->Children[0], &Node->Children[1].Children[0]};
+  return true;
+}
+
+static bool MatchMatrix(cg_neo &CG, ast_node *Node,
+                        std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::MULTIPLY || !IsMatrix(CG, &Node->Children[0]))
+    return false;
+  Leaves = {&Node->Children[0], &Node->Children[1]};
+  return true;
+}
+
+static ir_operand EmitRows(cg_neo &CG, int Op,
+                           const std::vector<ast_node *> &Leaves) {
+  ir_operand A = CG.BuildInstruction(Leaves[0]);
+  ir_operand Vector = CG.BuildInstruction(Leaves[1]);
+  ir_operand Result;
+  for (int Row = 0; Row < 4; ++Row) {
+    ir_operand M = CG.MatrixRow(A, Row);
+    if (Op == neocode_instruction::DPH)
+      Result = CG.Emit(Op, Vector, M, 1 << Row, Result);
+    else
+      Result = CG.Emit(Op, M, Vector, 1 << Row, Result);
+  }
+  return Result;
+}
+
+static ir_operand ReduceMatrixDPH(cg_neo &CG, ast_node *Node,
+                                  const std::vector<ast_node *> &Leaves) {
+  return EmitRows(CG, neocode_instruction::DPH, Leaves);
+}
+
+static ir_operand ReduceMatrixDP3(cg_neo &CG, ast_node *Node,
+                                  const std::vector<ast_node *> &Leaves) {
+  return EmitRows(CG, neocode_instruction::DP3, Leaves);
+}
+
+static ir_operand ReduceMatrix(cg_neo &CG, ast_node *Node,
+                               const std::vector<ast_node *> &Leaves) {
+  return EmitRows(CG, neocode_instruction::DP4, Leaves);
+}
+
+// a * b + c, c + a * b, a * b - c and c - a * b. The leaves are kept in
+// source order, the addend first where it comes first. MAD reads at most one
+// float uniform, so a cover that needs two is no cover.
+static bool MatchMultiplyAdd(cg_neo &CG, ast_node *Node,
+                             std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::PLUS && Node->Type != ast_node::MINUS)
+    return false;
+  for (int Side = 0; Side < 2; ++Side) {
+    ast_node *Product = &Node->Children[Side];
+    ast_node *Addend = &Node->Children[1 - Side];
+    if (Product->Type != ast_node::MULTIPLY ||
+        IsMatrix(CG, &Product->Children[0]))
+      continue;
+    ast_node *A = &Product->Children[0], *B = &Product->Children[1];
+    if (IsConstantOperand(CG, A) + IsConstantOperand(CG, B) +
+            IsConstantOperand(CG, Addend) >
+        1)
+      continue;
+    if (Side == 0)
+      Leaves = {A, B, Addend};
+    else
+      Leaves = {Addend, A, B};
+    return true;
+  }
+  return false;
+}
+
+static ir_operand ReduceMultiplyAdd(cg_neo &CG, ast_node *Node,
+                                    const std::vector<ast_node *> &Leaves) {
+  bool AddendFirst = Leaves[0] == &Node->Children[0];
+  ast_node *X = Leaves[AddendFirst ? 1 : 0], *Y = Leaves[AddendFirst ? 2 : 1];
+  ast_node *Z = Leaves[AddendFirst ? 0 : 2];
+  ir_operand A, B, C;
+  if (AddendFirst)
+    C = CG.BuildInstruction(Z);
+  BuildPair(CG, X, Y, A, B);
+  if (!AddendFirst)
+    C = CG.BuildInstruction(Z);
+
+  int Product = std::max(CG.GetComponentCount(X), CG.GetComponentCount(Y));
+  int Count = CG.GetComponentCount(Z);
+  if (Product == 1 && Count > 1) {
+    A = Broadcast(A);
+    B = Broadcast(B);
+  }
+  if (Count == 1 && Product > 1)
+    C = Broadcast(C);
+  if (Node->Type == ast_node::MINUS && AddendFirst)
+    A.Negate = !A.Negate;
+  else if (Node->Type == ast_node::MINUS)
+    C.Negate = !C.Negate;
+
+  ir_instruction In;
+  In.Op = neocode_instruction::MAD;
+  In.Result = CG.Function->NewValue();
+  In.Src[0] = A;
+  In.Src[1] = B;
+  In.Src[2] = C;
+  CG.Function->Blocks.back().Instructions.push_back(In);
+  return IRValue(In.Result);
+}
+
+static bool MatchBinary(ast_node *Node, int Type,
+                        std::vector<ast_node *> &Leaves) {
+  if (Node->Type != Type)
+    return false;
+  Leaves = {&Node->Children[0], &Node->Children[1]};
+  return true;
+}
+
+static bool MatchMultiply(cg_neo &CG, ast_node *Node,
+                          std::vector<ast_node *> &Leaves) {
+  return MatchBinary(Node, ast_node::MULTIPLY, Leaves) &&
+         !IsMatrix(CG, Leaves[0]);
+}
+
+static ir_operand ReduceMultiply(cg_neo &CG, ast_node *Node,
+                                 const std::vector<ast_node *> &Leaves) {
+  ir_operand A, B;
+  BuildPair(CG, Leaves[0], Leaves[1], A, B);
+  return CG.Emit(neocode_instruction::MUL, A, B);
+}
+
+static bool MatchAdd(cg_neo &CG, ast_node *Node,
+                     std::vector<ast_node *> &Leaves) {
+  return MatchBinary(Node, ast_node::PLUS, Leaves) ||
+         MatchBinary(Node, ast_node::MINUS, Leaves);
+}
+
+static ir_operand ReduceAdd(cg_neo &CG, ast_node *Node,
+                            const std::vector<ast_node *> &Leaves) {
+  ir_operand A, B;
+  BuildPair(CG, Leaves[0], Leaves[1], A, B);
+  if (Node->Type == ast_node::MINUS)
+    B.Negate = !B.Negate;
+  return CG.Emit(neocode_instruction::ADD, A, B);
+}
+
+// 1.0 / sqrt(x) is RSQ on its own.
+static bool MatchInverseRoot(cg_neo &CG, ast_node *Node,
+                             std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::DIVIDE || !IsOne(&Node->Children[0]))
+    return false;
+  ast_node *Root = &Node->Children[1];
+  const builtin_function *B =
+      Root->Type == ast_node::FUNCTION_CALL
+          ? FindBuiltin(CG.SymbolTable, Root->Id)
+          : nullptr;
+  if (!B || B->Id != BUILTIN_SQRT || Root->Children.size() != 1)
+    return false;
+  Leaves = {&Root->Children[0]};
+  return true;
+}
+
+static ir_operand ReduceInverseRoot(cg_neo &CG, ast_node *Node,
+                                    const std::vector<ast_node *> &Leaves) {
+  return CG.EmitPerLane(neocode_instruction::RSQ,
+                        CG.BuildInstruction(Leaves[0]),
+                        CG.GetComponentCount(Leaves[0]));
+}
+
+static bool MatchReciprocal(cg_neo &CG, ast_node *Node,
+                            std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::DIVIDE || !IsOne(&Node->Children[0]))
+    return false;
+  Leaves = {&Node->Children[1]};
+  return true;
+}
+
+static ir_operand ReduceReciprocal(cg_neo &CG, ast_node *Node,
+                                   const std::vector<ast_node *> &Leaves) {
+  return CG.EmitPerLane(neocode_instruction::RCP,
+                        CG.BuildInstruction(Leaves[0]),
+                        CG.GetComponentCount(Leaves[0]));
+}
+
+static bool MatchDivide(cg_neo &CG, ast_node *Node,
+                        std::vector<ast_node *> &Leaves) {
+  return MatchBinary(Node, ast_node::DIVIDE, Leaves);
+}
+
+static ir_operand ReduceDivide(cg_neo &CG, ast_node *Node,
+                               const std::vector<ast_node *> &Leaves) {
+  int CountA = CG.GetComponentCount(Leaves[0]);
+  int CountB = CG.GetComponentCount(Leaves[1]);
+  ir_operand Reciprocal = CG.EmitPerLane(
+      neocode_instruction::RCP, CG.BuildInstruction(Leaves[1]), CountB);
+  ir_operand A = CG.BuildInstruction(Leaves[0]);
+  if (CountA == 1 && CountB > 1)
+    A = Broadcast(A);
+  if (CountB == 1 && CountA > 1)
+    Reciprocal = Broadcast(Reciprocal);
+  return CG.Emit(neocode_instruction::MUL, A, Reciprocal);
+}
+
+// Negation is a source modifier and costs nothing.
+static bool MatchNegate(cg_neo &CG, ast_node *Node,
+                        std::vector<ast_node *> &Leaves) {
+  if (Node->Type != ast_node::NEGATE)
+    return false;
+  Leaves = {&Node->Children[0]};
+  return true;
+}
+
+static ir_operand ReduceNegate(cg_neo &CG, ast_node *Node,
+                               const std::vector<ast_node *> &Leaves) {
+  return Negated(CG.BuildInstruction(Leaves[0]));
+}
+
+static const select_pattern Patterns[] = {
+    {4, MatchMatrixDPH, ReduceMatrixDPH},
+    {4, MatchMatrixDP3, ReduceMatrixDP3},
+    {4, MatchMatrix, ReduceMatrix},
+    {1, MatchMultiplyAdd, ReduceMultiplyAdd},
+    {1, MatchMultiply, ReduceMultiply},
+    {1, MatchAdd, ReduceAdd},
+    {1, MatchInverseRoot, ReduceInverseRoot},
+    {1, MatchReciprocal, ReduceReciprocal},
+    {2, MatchDivide, ReduceDivide},
+    {0, MatchNegate, ReduceNegate},
+};
+
+enum { NO_COVER = 1 << 20 };
+
+// The cheapest cover of Node, with the pattern that starts it in Choice.
+// Nodes no pattern matches cost what they build themselves: a MOV for every
+// piece of an assembled vector and one instruction for a builtin, on top of
+// their operands.
+int cg_neo::ExpressionCost(ast_node *Node, std::map<ast_node *, int> &Costs,
+                           int *Choice) {
+  auto It = Costs.find(Node);
+  if (It != Costs.end() && !Choice)
+    return It->second;
+  int Best = NO_COVER;
+  std::vector<ast_node *> Leaves;
+  for (size_t p = 0; p < sizeof(Patterns) / sizeof(Patterns[0]); ++p) {
+    if (!Patterns[p].Match(*this, Node, Leaves))
+      continue;
+    int Cost = Patterns[p].Cost;
+    for (ast_node *Leaf : Leaves)
+      Cost += ExpressionCost(Leaf, Costs);
+    if (Cost < Best) {
+      Best = Cost;
+      if (Choice)
+        *Choice = p;
+    }
+  }
+  if (Best == NO_COVER) {
+    Best = 0;
+    bool AllLiteral = true;
+    for (ast_node &Child : Node->Children) {
+      AllLiteral &= IsLiteral(Child);
+      Best += ExpressionCost(&Child, Costs);
+    }
+    if (Node->Type == ast_node::FUNCTION_CALL &&
+        FindBuiltin(SymbolTable, Node->Id))
+      Best += 1;
+    else if (Node->Type == ast_node::FUNCTION_CALL && !AllLiteral &&
+             Node->Children.size() > 1)
+      Best += Node->Children.size();
+  }
+  Costs[Node] = Best;
+  return Best;
+}
+
+ir_operand cg_neo::BuildExpression(ast_node *Node) {
+  std::map<ast_node *, int> Costs;
+  int Choice = -1;
+  ExpressionCost(Node, Costs, &Choice);
+  if (Choice < 0)
+    return ir_operand();
+  std::vector<ast_node *> Leaves;
+  Patterns[Choice].Match(*this, Node, Leaves);
+  return Patterns[Choice].Reduce(*this, Node, Leaves);
+}
+
+ir_operand cg_neo::BuildInstruction(ast_node *ASTNode) {
+  if (ASTNode->Type == ast_node::VARIABLE &&
       (ASTNode->Modifiers & ast_node::DECLARE)) {
-    neocode_variable Var;
-    Var.Swizzle = 0;
-    Var.Name = Function->Name + "_" + ASTNode->Id;
-    Var.Type = ASTNode->Type;
-    Var.Register = Function->Program->Registers.AllocTemp();
-    Var.RegisterType = 0;
-    Function->Variables.push_back(Var);
-    neocode_instruction In;
-    In.Type = neocode_instruction::EMPTY;
-    In.Dst = Var;
-    Function->Instructions.push_back(In);
-    return In;
-  }
-
-  if (ASTNode->Type == ast_node::FLOAT_LITERAL) {
-    neocode_variable Constant;
-    Constant.Type = ast_node::FLOAT_LITERAL;
-    Constant.RegisterType = 0;
-    Constant.Register = Function->Program->Registers.AllocConstant();
-    Constant.Name =
-        std::string("Anonymous_float") + "_" + RegisterName(Constant.Register);
-    Constant.Const.Float.X = ASTNode->FloatValue;
-    Constant.Const.Float.Y = ASTNode->FloatValue;
-    Constant.Const.Float.Z = ASTNode->FloatValue;
-    Constant.Const.Float.W = ASTNode->FloatValue;
-    Constant.Swizzle = 0;
-    Function->Program->Globals.push_back(Constant);
-    neocode_instruction In;
-    In.Type = neocode_instruction::EMPTY;
-    In.Dst = Constant;
-    Function->Instructions.push_back(In);
-    return In;
+    ir_operand Init;
+    if (ASTNode->Children.size() && ASTNode->Children[0].Children.size()) {
+      ast_node *Node = &ASTNode->Children[0].Children[0];
+      Init = BuildInstruction(Node);
+      if (GetComponentCount(Node) == 1)
+        Init = Broadcast(Init);
+    }
+    Locals[ASTNode->Id] = Init;
+    return Init;
+  }
+
+  if (IsLiteral(*ASTNode)) {
+    float V = LiteralValue(*ASTNode);
+    return IRConstant(V, V, V, V);
   }
 
   if (ASTNode->Type == ast_node::VARIABLE) {
-    neocode_instruction In;
-    In.Type = neocode_instruction::EMPTY;
-    In.Dst = *Function->GetVariable(ASTNode->Id);
-    Function->Instructions.push_back(In);
-    return In;
+    if (Locals.count(ASTNode->Id) &&
+        Locals[ASTNode->Id].Kind != ir_operand::NONE)
+      return Locals[ASTNode->Id];
+    if (neocode_variable *G = FindGlobal(Program, ASTNode->Id)) {
+      if (IsPerInstance(Program->Options, G->Name))
+        return IndexArray(*G, InstanceIndex());
+      return IRGlobal(*G);
+    }
+    if (!Locals.count(ASTNode->Id))
+      Error("undefined identifier %s",
+            SymbolTable->Lookup(ASTNode->Id)->Name.c_str());
+    return IRConstant(0, 0, 0, 0);
   }
 
+  if (ASTNode->Type == ast_node::FIELD_SELECTION)
+    return Select(BuildInstruction(&ASTNode->Children[0]), ASTNode->Id);
+
+  if (ASTNode->Type == ast_node::INDEX)
+    return BuildIndex(ASTNode);
+
+  if (ASTNode->Type == ast_node::INLINE_ASM)
+    return BuildAsm(ASTNode);
+
   if (ASTNode->Type == ast_node::FUNCTION_CALL) {
-    if (ASTNode->Id.compare("asm") == 0) {
-      lexer_state LexerState;
-      std::vector<neocode_variable> CachedVars;
-      auto GetNextFromTokenSpecifier = [&LexerState, &Function, &ASTNode,
-                                        &CachedVars, this]() {
-        token Token = LexerGetToken(&LexerState);
-        if (Token.Type == ',')
-          Token = LexerGetToken(&LexerState);
-
-        if (Token.Type == '@') {
-          Token = LexerGetToken(&LexerState);
-          if (Token.IntValue == 0) {
-            return (neocode_variable){"", "", ast_node::STRUCT,
-                                      Function->Program->Registers.AllocTemp(),
-                                      0};
-          }
-          if (Token.IntValue > CachedVars.size()) {
-            CachedVars.resize(Token.IntValue);
-            CachedVars[Token.IntValue - 1] =
-                BuildInstruction(Function, &ASTNode->Children[Token.IntValue])
-                    .Dst;
-          }
-          return CachedVars[Token.IntValue - 1];
-        }
-        if (Token.Type == token::END) {
-          return neocode_variable();
-        }
+    if (const builtin_function *B = FindBuiltin(SymbolTable, ASTNode->Id))
+      return BuildBuiltin(ASTNode, *B);
 
-        return *Function->GetVariable(Token.Id);
-      };
-
-      char *Source = (char *)ASTNode->Children[0].Id.c_str();
-      symtable SymTable;
-      LexerInit(&LexerState, Source, Source + strlen(Source) + 1, &SymTable);
-      token Token = LexerGetToken(&LexerState);
-      neocode_instruction In;
-      In.Type = GetInstructionFromIdentifier(Token.Id);
-      In.Dst = GetNextFromTokenSpecifier();
-      In.Src1 = GetNextFromTokenSpecifier();
-      In.Src2 = GetNextFromTokenSpecifier();
-      Function->Instructions.push_back(In);
-      return In;
-    } else if (parser::IsTypeSpecifier(SymbolTable->Lookup(ASTNode->Id)->SymbolType)) {
-      symtable_entry *Type = SymbolTable->Lookup(ASTNode->Id);
-      // generate constant
-      neocode_variable Constant;
-      Constant.Type = Type->SymbolType;
-      Constant.RegisterType = 0;
-      Constant.Register = Function->Program->Registers.AllocConstant();
-      Constant.Name = std::string("Anonymous_") + ASTNode->Id + "_" +
-                      RegisterName(Constant.Register);
-      Constant.Swizzle = 0;
-      Constant.Const.Float.X = ASTNode->Children[0].FloatValue;
-      Constant.Const.Float.Y = ASTNode->Children[1].FloatValue;
-      Constant.Const.Float.Z = ASTNode->Children[2].FloatValue;
-      Constant.Const.Float.W = ASTNode->Children[3].FloatValue;
-      Function->Program->Globals.push_back(Constant);
-      neocode_instruction In;
-      In.Type = neocode_instruction::EMPTY;
-      In.Dst = Constant;
-      Function->Instructions.push_back(In);
-      return In;
-    } else {
-      symtable_entry *FuncDef = SymbolTable->Lookup(ASTNode->Id);
-      if (FuncDef->SymbolType == 0)
-        return neocode_instruction();
-      std::vector<neocode_variable> Params;
-      for (size_t i = 0; i < ASTNode->Children.size(); ++i) {
-        Params.push_back(BuildInstruction(Function, &ASTNode->Children[i]).Dst);
+    symtable_entry *E = SymbolTable->Lookup(ASTNode->Id);
+    if (parser::IsTypeSpecifier(E->SymbolType)) {
+      std::vector<ast_node> &Children = ASTNode->Children;
+      bool AllLiteral = Children.size() > 0;
+      for (ast_node &Child : Children)
+        AllLiteral &= IsLiteral(Child);
+      if (AllLiteral) {
+        float V[4];
+        for (size_t i = 0; i < 4; ++i)
+          V[i] = LiteralValue(Children[std::min(i, Children.size() - 1)]);
+        return IRConstant(V[0], V[1], V[2], V[3]);
       }
-      neocode_variable TempRet =
-          (neocode_variable){"",
-                             "",
-                             ast_node::STRUCT,
-                             Function->Program->Registers.AllocTemp(),
-                             0,
-                             {0},
-                             0};
-      // neocode_function Callee = BuildFunction(Function->Program, FuncDef);
-      // for (size_t i = 0; i < FuncDef->Children[0].Children.size(); ++i) {
-      //   neocode_variable &CP = Callee.Variables[i];
-      //   for (neocode_instruction &In : Callee.Instructions) {
-      //     if (In.Dst.Name.compare(CP.Name) == 0) {
-      //       In.Dst = neocode_variable(Params[i]);
-      //     } else if (In.Src1.Name.compare(CP.Name) == 0) {
-      //       In.Src1 = neocode_variable(Params[i]);
-      //     } else if (In.Src2.Name.compare(CP.Name) == 0) {
-      //       In.Src2 = neocode_variable(Params[i]);
-      //     }
-      //
-      //     if (In.Dst.Register == ReturnReg.Register) {
-      //       In.Dst = TempRet;
-      //     } else if (In.Src1.Register == ReturnReg.Register) {
-      //       In.Src1 = TempRet;
-      //     } else if (In.Src2.Register == ReturnReg.Register) {
-      //       In.Src2 = TempRet;
-      //     }
-      //   }
-      // }
-      //
-      // for (neocode_instruction &In : Callee.Instructions) {
-      //   Function->Instructions.push_back(In);
-      // }
-
-      return Function->Instructions.back();
+      if (Children.size() == 1) {
+        ir_operand Op = BuildInstruction(&Children[0]);
+        return GetComponentCount(&Children[0]) == 1 ? Broadcast(Op) : Op;
+      }
+
+      // Assemble the vector from consecutive pieces, one masked MOV each.
+      ir_operand Result;
+      int Lane = 0;
+      for (ast_node &Child : Children) {
+        int Count = std::min(GetComponentCount(&Child), 4 - Lane);
+        if (Count <= 0)
+          break;
+        std::vector<int> Lanes;
+        for (int i = 0; i < Count; ++i)
+          Lanes.push_back(Lane + i);
+        ir_operand Part = AlignToLanes(BuildInstruction(&Child), Count, Lanes);
+        Result = Emit(neocode_instruction::MOV, Part, ir_operand(),
+                      LaneMask(Lanes), Result);
+        Lane += Count;
+      }
+      return Result;
     }
+
+    if (E->SymbolType == 0)
+      return IRConstant(0, 0, 0, 0);
+    ir_instruction In;
+    In.Op = neocode_instruction::INVOKE;
+    In.Name = ASTNode->Id;
+    for (ast_node &Child : ASTNode->Children)
+      In.Args.push_back(BuildInstruction(&Child));
+    In.Result = Function->NewValue();
+    Function->Blocks.back().Instructions.push_back(In);
+    return IRValue(In.Result);
   }
 
-  if (ASTNode->Type == ast_node::MULTIPLY) {
-    neocode_instruction In;
-    In.Dst = (neocode_variable){"", "", ast_node::STRUCT,
-                                Function->Program->Registers.AllocTemp(), 0};
-    In.Src1 = BuildInstruction(Function, &ASTNode->Children[0]).Dst;
-    In.Src2 = BuildInstruction(Function, &ASTNode->Children[1]).Dst;
-    if (In.Src1.TypeName.compare("mat4") == 0) {
-      In.Type = neocode_instruction::DP4;
-
-      In.Dst.Swizzle = GetSwizzleFromIdentifier("x");
-      In.Src1.Swizzle = 0;
-      Function->Instructions.push_back(In);
-      In.Dst.Swizzle = GetSwizzleFromIdentifier("y");
-      In.Src1.Swizzle = 1;
-      Function->Instructions.push_back(In);
-      In.Dst.Swizzle = GetSwizzleFromIdentifier("z");
-      In.Src1.Swizzle = 2;
-      Function->Instructions.push_back(In);
-      In.Dst.Swizzle = GetSwizzleFromIdentifier("w");
-      In.Src1.Swizzle = 3;
-      Function->Instructions.push_back(In);
-      In.Dst.Swizzle = 0;
-      return In;
-    } else {
-      In.Type = neocode_instruction::MUL;
-      Function->Instructions.push_back(In);
+  if (ASTNode->Type == ast_node::MULTIPLY ||
+      ASTNode->Type == ast_node::PLUS || ASTNode->Type == ast_node::MINUS ||
+      ASTNode->Type == ast_node::DIVIDE || ASTNode->Type == ast_node::NEGATE)
+    return BuildExpression(ASTNode);
+
+  if (ASTNode->Type == ast_node::ASSIGNMENT)
+    return BuildAssignment(ASTNode);
+
+  if (ASTNode->Type == ast_node::RETURN) {
+    ir_operand Value = BuildInstruction(&ASTNode->Children[0]);
+    if (GetComponentCount(&ASTNode->Children[0]) == 1)
+      Value = Broadcast(Value);
+    Store(Function, ReturnReg, Value, 0b1111);
+    return Value;
+  }
+
+  return ir_operand();
+}
+
+// A loop that runs a fixed number of times: Counter starts out as Start and
+// moves by Step at the end of every iteration.
+struct counted_loop {
+  std::string Counter;
+  float Start;
+  float Step;
+  int Count;
+};
+
+// The hardware runs a LOOP at most 256 times and nests four of them.
+enum { MAX_LOOP_COUNT = 256, MAX_LOOP_DEPTH = 4, UNROLL_BUDGET = 64 };
+
+static bool IsComparison(int Type) {
+  return Type >= ast_node::LESS && Type <= ast_node::NOT_EQUAL;
+}
+
+static bool Compare(int Type, float A, float B) {
+  switch (Type) {
+  case ast_node::LESS:
+    return A < B;
+  case ast_node::GREATER:
+    return A > B;
+  case ast_node::LESS_EQUAL:
+    return A <= B;
+  case ast_node::GREATER_EQUAL:
+    return A >= B;
+  case ast_node::EQUAL:
+    return A == B;
+  case ast_node::NOT_EQUAL:
+    return A != B;
+  }
+  return false;
+}
+
+// The comparison with its operands swapped: K < i is i > K.
+static int Mirror(int Type) {
+  switch (Type) {
+  case ast_node::LESS:
+    return ast_node::GREATER;
+  case ast_node::GREATER:
+    return ast_node::LESS;
+  case ast_node::LESS_EQUAL:
+    return ast_node::GREATER_EQUAL;
+  case ast_node::GREATER_EQUAL:
+    return ast_node::LESS_EQUAL;
+  }
+  return Type;
+}
+
+static bool ConstantValue(const ast_node &Node, float &Value) {
+  if (Node.Type == ast_node::NEGATE && ConstantValue(Node.Children[0], Value)) {
+    Value = -Value;
+    return true;
+  }
+  if (!IsLiteral(Node))
+    return false;
+  Value = LiteralValue(Node);
+  return true;
+}
+
+// The x component of Op if it is a constant.
+static bool ScalarConstant(const ir_operand &Op, float &Value) {
+  if (Op.Kind != ir_operand::CONSTANT)
+    return false;
+  Value = Op.Constant[IRSwizzleSelector(Op, 0)];
+  if (Op.Negate)
+    Value = -Value;
+  return true;
+}
+
+// Whether Node or anything in it writes the variable Name.
+static bool Assigns(const ast_node &Node, const std::string &Name) {
+  const ast_node *Target = nullptr;
+  if (Node.Type == ast_node::ASSIGNMENT)
+    Target = &Node.Children[0];
+  else if (Node.Type == ast_node::INLINE_ASM && Node.Children[0].Children.size())
+    Target = &Node.Children[0].Children[0];
+  else if (Node.Type == ast_node::VARIABLE &&
+           (Node.Modifiers & ast_node::DECLARE))
+    Target = &Node;
+  while (Target && (Target->Type == ast_node::FIELD_SELECTION ||
+                    Target->Type == ast_node::NEGATE))
+    Target = &Target->Children[0];
+  if (Target && Target->Type == ast_node::VARIABLE &&
+      Target->Id.compare(Name) == 0)
+    return true;
+  for (const ast_node &Child : Node.Children) {
+    if (Assigns(Child, Name))
+      return true;
+  }
+  return false;
+}
+
+// Name = Name + K, Name = K + Name or Name = Name - K, which is also what
+// Name++ and Name += K come out as.
+static bool IsCounterStep(const ast_node &Node, const std::string &Name,
+                          float &Step) {
+  if (Node.Type != ast_node::ASSIGNMENT ||
+      Node.Children[0].Type != ast_node::VARIABLE ||
+      Node.Children[0].Id.compare(Name) != 0)
+    return false;
+  const ast_node &Value = Node.Children[1];
+  if (Value.Type != ast_node::PLUS && Value.Type != ast_node::MINUS)
+    return false;
+  for (int i = 0; i < 2; ++i) {
+    const ast_node &Operand = Value.Children[i];
+    if (Operand.Type != ast_node::VARIABLE || Operand.Id.compare(Name) != 0 ||
+        !ConstantValue(Value.Children[1 - i], Step))
+      continue;
+    if (Value.Type == ast_node::MINUS) {
+      if (i != 0)
+        return false;
+      Step = -Step;
     }
-    return In;
-  }
-
-  if (ASTNode->Type == ast_node::DIVIDE) {
-    neocode_instruction In;
-    In.Type = neocode_instruction::RCP;
-    In.Dst = (neocode_variable){
-        "",  "", ast_node::STRUCT, Function->Program->Registers.AllocTemp(), 0,
-        {0}, 0};
-    In.Src1 = BuildInstruction(Function, &ASTNode->Children[1]).Dst;
-    Function->Instructions.push_back(In);
-    if (ASTNode->Children[0].Type == ast_node::FLOAT_LITERAL &&
-        ASTNode->Children[0].FloatValue != 1.0) {
-      In.Type = neocode_instruction::MUL;
-      In.Src1 = In.Dst;
-      In.Src2 = BuildInstruction(Function, &ASTNode->Children[0]).Dst;
-      Function->Instructions.push_back(In);
+    return true;
+  }
+  return false;
+}
+
+// GLSL ES only has to support loops whose trip count is known when compiling
+// (appendix A), and those are what LOOP runs: the condition compares a
+// counter with a constant, and the counter starts out constant and changes
+// by a constant step once every iteration.
+bool cg_neo::AnalyzeLoop(ast_node *ASTNode, counted_loop &Loop) {
+  ast_node &Condition = ASTNode->Children[1];
+  ast_node &Next = ASTNode->Children[2];
+  ast_node &Body = ASTNode->Children[3];
+  if (!IsComparison(Condition.Type))
+    return false;
+  int Op = Condition.Type;
+  ast_node *Counter = &Condition.Children[0];
+  float Bound;
+  if (!ConstantValue(Condition.Children[1], Bound)) {
+    Counter = &Condition.Children[1];
+    Op = Mirror(Op);
+    if (!ConstantValue(Condition.Children[0], Bound))
+      return false;
+  }
+  if (Counter->Type != ast_node::VARIABLE || !Locals.count(Counter->Id))
+    return false;
+  Loop.Counter = Counter->Id;
+  if (!ScalarConstant(Locals[Loop.Counter], Loop.Start))
+    return false;
+
+  // The step is the one of a for, or the statement of a while body that
+  // changes the counter; nothing else may.
+  int Steps = 0;
+  if (Next.Type != ast_node::NONE) {
+    if (!IsCounterStep(Next, Loop.Counter, Loop.Step))
+      return false;
+    ++Steps;
+  }
+  for (ast_node &Statement : Body.Children) {
+    if (!Assigns(Statement, Loop.Counter))
+      continue;
+    if (!IsCounterStep(Statement, Loop.Counter, Loop.Step))
+      return false;
+    ++Steps;
+  }
+  if (Steps != 1)
+    return false;
+
+  float Value = Loop.Start;
+  Loop.Count = 0;
+  if (ASTNode->Modifiers & ast_node::POST_TEST) {
+    ++Loop.Count;
+    Value += Loop.Step;
+  }
+  while (Compare(Op, Value, Bound)) {
+    if (++Loop.Count > MAX_LOOP_COUNT)
+      return false;
+    Value += Loop.Step;
+  }
+  return true;
+}
+
+void cg_neo::BuildIteration(ast_node *ASTNode) {
+  BuildStatement(&ASTNode->Children[3]);
+  BuildStatement(&ASTNode->Children[2]);
+}
+
+// The number of instructions building First and then Second adds, found by
+// building them and throwing them away again.
+int cg_neo::Measure(ast_node *First, ast_node *Second) {
+  std::map<std::string, ir_operand> SavedLocals = Locals;
+  std::vector<ir_block> SavedBlocks = Function->Blocks;
+  int SavedValueCount = Function->ValueCount;
+  bool WasMeasuring = Measuring;
+  Measuring = true;
+  BuildStatement(First);
+  if (Second)
+    BuildStatement(Second);
+  Measuring = WasMeasuring;
+
+  int Size = 0;
+  for (ir_block &B : Function->Blocks)
+    Size += B.Instructions.size();
+  for (ir_block &B : SavedBlocks)
+    Size -= B.Instructions.size();
+  Locals = SavedLocals;
+  Function->Blocks = SavedBlocks;
+  Function->ValueCount = SavedValueCount;
+  return Size;
+}
+
+static bool IsByte(float Value) {
+  return Value >= 0.0f && Value <= 255.0f && Value == (int)Value;
+}
+
+// The body gets blocks of its own, ending in the latch that branches back to
+// the header. Every local the loop changes enters the header as a phi of its
+// value before the loop and its value at the end of an iteration. aL counts
+// along with the counter where that fits the integer uniform, and then
+// indexes the vec4 arrays the counter does.
+void cg_neo::BuildHardwareLoop(ast_node *ASTNode, const counted_loop &Loop) {
+  std::vector<ir_block> &Blocks = Function->Blocks;
+  ir_instruction Start;
+  Start.Op = neocode_instruction::LOOP;
+  Start.Dst.Const.Type = neocode_constant::INT;
+  Start.Dst.Const.Integer.X = Loop.Count - 1;
+  Start.Dst.Const.Integer.Z = 1;
+  bool Tracks = IsByte(Loop.Start) && IsByte(Loop.Step);
+  if (Tracks) {
+    Start.Dst.Const.Integer.Y = (int)Loop.Start;
+    Start.Dst.Const.Integer.Z = (int)Loop.Step;
+  }
+  Blocks.back().Instructions.push_back(Start);
+  int Header = Blocks.size();
+  Blocks.back().Successors.push_back(Header);
+  Blocks.push_back(ir_block());
+
+  std::vector<std::string> Carried;
+  for (auto &Entry : Locals) {
+    if (Assigns(ASTNode->Children[2], Entry.first) ||
+        Assigns(ASTNode->Children[3], Entry.first))
+      Carried.push_back(Entry.first);
+  }
+  for (const std::string &Name : Carried) {
+    ir_instruction Phi;
+    Phi.Op = IR_PHI;
+    Phi.Result = Function->NewValue();
+    Phi.Src[0] = Locals[Name];
+    if (Phi.Src[0].Kind == ir_operand::NONE)
+      Phi.Src[0] = IRConstant(0, 0, 0, 0);
+    Blocks.back().Instructions.push_back(Phi);
+    Locals[Name] = IRValue(Phi.Result);
+  }
+
+  int OuterCounter = LoopCounter, OuterAddress = LoopAddress;
+  LoopCounter = LoopAddress = -1;
+  if (Tracks && Locals[Loop.Counter].Kind == ir_operand::VALUE) {
+    ir_instruction Counter;
+    Counter.Op = IR_COUNTER;
+    Counter.Result = Function->NewValue();
+    Counter.Mask = 0b0001;
+    Blocks.back().Instructions.push_back(Counter);
+    LoopCounter = Locals[Loop.Counter].Value;
+    LoopAddress = Counter.Result;
+  }
+
+  ++LoopDepth;
+  BuildIteration(ASTNode);
+  --LoopDepth;
+  LoopCounter = OuterCounter;
+  LoopAddress = OuterAddress;
+
+  for (size_t i = 0; i < Carried.size(); ++i)
+    Blocks[Header].Instructions[i].Src[1] = Locals[Carried[i]];
+  int Latch = Blocks.size() - 1;
+  Blocks[Latch].Successors.push_back(Header);
+  Blocks[Latch].Successors.push_back(Latch + 1);
+  Blocks.push_back(ir_block());
+}
+
+// Small loops are unrolled, with the counter a constant in every copy of the
+// body. The counter ends up with its final value either way. Building for
+// size shrinks the budget, down to unrolling only where that is no larger
+// than the LOOP.
+void cg_neo::BuildLoop(ast_node *ASTNode) {
+  BuildStatement(&ASTNode->Children[0]);
+  counted_loop Loop;
+  if (!AnalyzeLoop(ASTNode, Loop)) {
+    Error("loop needs a constant number of iterations");
+    return;
+  }
+
+  bool Unroll = Loop.Count <= 1 || LoopDepth >= MAX_LOOP_DEPTH;
+  if (!Unroll && Program->Options.OptLevel >= 1) {
+    int Size = Measure(&ASTNode->Children[3], &ASTNode->Children[2]);
+    int Budget = UNROLL_BUDGET >> (Program->Options.SizeLevel & ~1);
+    if (Program->Options.SizeLevel >= 4)
+      Budget = Size + 1;
+    Unroll = Loop.Count * Size <= Budget;
+  }
+  if (!Unroll) {
+    BuildHardwareLoop(ASTNode, Loop);
+    return;
+  }
+  float Value = Loop.Start;
+  for (int i = 0; i < Loop.Count; ++i) {
+    Locals[Loop.Counter] = IRConstant(Value, Value, Value, Value);
+    BuildIteration(ASTNode);
+    Value += Loop.Step;
+  }
+  Locals[Loop.Counter] = IRConstant(Value, Value, Value, Value);
+}
+
+// The shader unit loses a few cycles on every flow control instruction it
+// takes, on top of the instructions themselves.
+enum { BRANCH_PENALTY = 3 };
+
+static int CompareOp(int Type) {
+  switch (Type) {
+  case ast_node::LESS:
+    return CMP_LT;
+  case ast_node::GREATER:
+    return CMP_GT;
+  case ast_node::LESS_EQUAL:
+    return CMP_LE;
+  case ast_node::GREATER_EQUAL:
+    return CMP_GE;
+  case ast_node::EQUAL:
+    return CMP_EQ;
+  }
+  return CMP_NE;
+}
+
+// Whether Node writes anything but locals: an output, the return value or
+// whatever inline asm binds.
+static bool WritesGlobals(neocode_program *Program, const ast_node &Node,
+                          const std::map<std::string, ir_operand> &Locals) {
+  if (Node.Type == ast_node::RETURN || Node.Type == ast_node::INLINE_ASM)
+    return true;
+  if (Node.Type == ast_node::ASSIGNMENT) {
+    const ast_node *Target = &Node.Children[0];
+    while (Target->Type == ast_node::FIELD_SELECTION)
+      Target = &Target->Children[0];
+    if (!Locals.count(Target->Id) && FindGlobal(Program, Target->Id))
+      return true;
+  }
+  for (const ast_node &Child : Node.Children) {
+    if (WritesGlobals(Program, Child, Locals))
+      return true;
+  }
+  return false;
+}
+
+// 1.0 in every lane where A compares to B as Compare says, else 0.0. A and B
+// are broadcast scalars.
+ir_operand cg_neo::BuildCondition(int Compare, const ir_operand &A,
+                                  const ir_operand &B) {
+  switch (Compare) {
+  case CMP_LT:
+    return Emit(neocode_instruction::SLT, A, B);
+  case CMP_GE:
+    return Emit(neocode_instruction::SGE, A, B);
+  case CMP_GT:
+    return Emit(neocode_instruction::SLT, B, A);
+  case CMP_LE:
+    return Emit(neocode_instruction::SGE, B, A);
+  case CMP_EQ:
+    return Emit(neocode_instruction::MUL, Emit(neocode_instruction::SGE, A, B),
+                Emit(neocode_instruction::SGE, B, A));
+  }
+  return Emit(neocode_instruction::ADD, Emit(neocode_instruction::SLT, A, B),
+              Emit(neocode_instruction::SLT, B, A));
+}
+
+// Both parts run, one after the other, and every local they leave different
+// is blended from the two by the condition as mix() would, with an ADD and a
+// MAD. A part that leaves a local infinite or NaN spoils the blend, as it
+// would mix().
+void cg_neo::BuildFlattenedSelection(ast_node *ASTNode, int Compare,
+                                     const ir_operand &A,
+                                     const ir_operand &B) {
+  std::map<std::string, ir_operand> Before = Locals;
+  BuildStatement(&ASTNode->Children[1]);
+  std::map<std::string, ir_operand> Then = Locals;
+  Locals = Before;
+  BuildStatement(&ASTNode->Children[2]);
+  std::map<std::string, ir_operand> Else = Locals;
+
+  Locals = Before;
+  ir_operand Condition;
+  for (auto &Entry : Locals) {
+    ir_operand T = Then[Entry.first], E = Else[Entry.first];
+    if (IRSameOperand(T, E)) {
+      Entry.second = T;
+      continue;
     }
-    return In;
+    if (T.Kind == ir_operand::NONE)
+      T = IRConstant(0, 0, 0, 0);
+    if (E.Kind == ir_operand::NONE)
+      E = IRConstant(0, 0, 0, 0);
+    if (Condition.Kind == ir_operand::NONE)
+      Condition = BuildCondition(Compare, A, B);
+    ir_instruction In;
+    In.Op = neocode_instruction::MAD;
+    In.Result = Function->NewValue();
+    In.Src[0] = Condition;
+    In.Src[1] = Emit(neocode_instruction::ADD, T, Negated(E));
+    In.Src[2] = E;
+    Function->Blocks.back().Instructions.push_back(In);
+    Entry.second = IRValue(In.Result);
   }
+}
 
-  if (ASTNode->Type == ast_node::ASSIGNMENT) {
-    neocode_instruction In;
-    In.Type = neocode_instruction::MOV;
-    In.Dst = BuildInstruction(Function, &ASTNode->Children[0]).Dst;
-    In.Src1 = BuildInstruction(Function, &ASTNode->Children[1]).Dst;
-    // if (Function->Instructions.back().Type != neocode_instruction::EMPTY &&
-    //     Function->Instructions.back().Type != neocode_instruction::MOV) {
-    //   Function->Instructions.back().Dst = In.Dst;
-    // } else {
-    Function->Instructions.push_back(In);
-    // }
-    return In;
+// The branch ends the current block. Each part gets blocks of its own, and
+// the locals they leave different meet in phis at the start of the join
+// block.
+void cg_neo::BuildBranchedSelection(ast_node *ASTNode,
+                                    const ir_instruction &Branch) {
+  std::vector<ir_block> &Blocks = Function->Blocks;
+  Blocks.back().Instructions.push_back(Branch);
+  int Head = Blocks.size() - 1;
+  Blocks[Head].Successors.push_back(Head + 1);
+  Blocks.push_back(ir_block());
+
+  std::map<std::string, ir_operand> Before = Locals;
+  BuildStatement(&ASTNode->Children[1]);
+  std::map<std::string, ir_operand> Then = Locals;
+  int ThenEnd = Blocks.size() - 1;
+  int ElseEnd = Head;
+  if (ASTNode->Children[2].Children.size()) {
+    Locals = Before;
+    Blocks[Head].Successors.push_back(Blocks.size());
+    Blocks.push_back(ir_block());
+    BuildStatement(&ASTNode->Children[2]);
+    ElseEnd = Blocks.size() - 1;
   }
+  std::map<std::string, ir_operand> Else = Locals;
+  if (ElseEnd == Head)
+    Else = Before;
+  int Join = Blocks.size();
+  Blocks[ThenEnd].Successors.push_back(Join);
+  Blocks[ElseEnd].Successors.push_back(Join);
+  Blocks.push_back(ir_block());
 
-  if (ASTNode->Type == ast_node::RETURN) {
-    neocode_instruction In;
-    In.Type = neocode_instruction::MOV;
-    In.Dst = ReturnReg;
-    In.Src1 = BuildInstruction(Function, &ASTNode->Children[0].Children[0]).Dst;
-    if (Function->Instructions.back().Type != neocode_instruction::EMPTY) {
-      Function->Instructions.back().Dst = ReturnReg;
-    } else {
-      Function->Instructions.push_back(In);
+  // Without an else part the join is entered from the IFC's block first.
+  std::map<std::string, ir_operand> &First = ElseEnd == Head ? Else : Then;
+  std::map<std::string, ir_operand> &Second = ElseEnd == Head ? Then : Else;
+  Locals = Before;
+  for (auto &Entry : Locals) {
+    ir_operand F = First[Entry.first], S = Second[Entry.first];
+    if (IRSameOperand(F, S)) {
+      Entry.second = F;
+      continue;
     }
-    return In;
+    ir_instruction Phi;
+    Phi.Op = IR_PHI;
+    Phi.Result = Function->NewValue();
+    Phi.Src[0] = F.Kind == ir_operand::NONE ? IRConstant(0, 0, 0, 0) : F;
+    Phi.Src[1] = S.Kind == ir_operand::NONE ? IRConstant(0, 0, 0, 0) : S;
+    Blocks.back().Instructions.push_back(Phi);
+    Entry.second = IRValue(Phi.Result);
   }
+}
 
-  return neocode_instruction();
+// An if on a bool uniform, or on its negation, takes the same part for every
+// vertex of a draw, so it always branches with an IFU and never costs more
+// than the part it runs. A bool literal picks its part right away.
+bool cg_neo::BuildStaticSelection(ast_node *ASTNode) {
+  ast_node *Condition = &ASTNode->Children[0];
+  bool Negated = false;
+  while (Condition->Type == ast_node::NOT) {
+    Condition = &Condition->Children[0];
+    Negated = !Negated;
+  }
+  if (Condition->Type == ast_node::BOOL_LITERAL) {
+    bool Taken = (Condition->IntValue != 0) != Negated;
+    BuildStatement(&ASTNode->Children[Taken ? 1 : 2]);
+    return true;
+  }
+  neocode_variable *G = nullptr;
+  if (Condition->Type == ast_node::VARIABLE && !Locals.count(Condition->Id))
+    G = FindGlobal(Program, Condition->Id);
+  if (!G || G->Register < 0xA0)
+    return false;
+
+  ast_node Selection = *ASTNode;
+  if (Negated)
+    std::swap(Selection.Children[1], Selection.Children[2]);
+  ir_instruction Branch;
+  Branch.Op = neocode_instruction::IFU;
+  Branch.Src[0] = IRGlobal(*G);
+  BuildBranchedSelection(&Selection, Branch);
+  return true;
 }
 
-void cg_neo::BuildStatement(neocode_function *Function, ast_node *ASTNode) {
-  BuildInstruction(Function, ASTNode);
-  for (neocode_instruction &In : Function->Instructions) {
-    if (In.Dst.Name.compare("") == 0) {
-      Function->Program->Registers.Free(In.Dst.Register);
+// An if on a comparison, or on a value that is compared with 0. Where both
+// parts only change locals and together cost less than branching around
+// them, they are flattened; otherwise the if branches, so that a vertex
+// only runs the part it needs. A condition that is known while compiling
+// picks its part right away.
+void cg_neo::BuildSelection(ast_node *ASTNode) {
+  if (BuildStaticSelection(ASTNode))
+    return;
+  ast_node Selection = *ASTNode;
+  ast_node *Condition = &Selection.Children[0];
+  while (Condition->Type == ast_node::NOT) {
+    Condition = &Condition->Children[0];
+    std::swap(Selection.Children[1], Selection.Children[2]);
+  }
+  ASTNode = &Selection;
+
+  // Any other condition is a bool held as 0 or 1, true unless it is 0.
+  int Type = ast_node::NOT_EQUAL;
+  ir_operand A, B = IRConstant(0, 0, 0, 0);
+  if (IsComparison(Condition->Type)) {
+    Type = Condition->Type;
+    A = Broadcast(BuildInstruction(&Condition->Children[0]));
+    B = Broadcast(BuildInstruction(&Condition->Children[1]));
+  } else {
+    A = Broadcast(BuildInstruction(Condition));
+  }
+  int Op = CompareOp(Type);
+  float X, Y;
+  if (ScalarConstant(A, X) && ScalarConstant(B, Y)) {
+    BuildStatement(&ASTNode->Children[Compare(Type, X, Y) ? 1 : 2]);
+    return;
+  }
+
+  ast_node &Then = ASTNode->Children[1], &Else = ASTNode->Children[2];
+  bool Flatten = false;
+  if (Program->Options.OptLevel >= 1 &&
+      !WritesGlobals(Program, Then, Locals) &&
+      !WritesGlobals(Program, Else, Locals)) {
+    int ThenSize = Measure(&Then), ElseSize = Measure(&Else);
+    int Merged = 0;
+    for (auto &Entry : Locals)
+      Merged += Assigns(Then, Entry.first) || Assigns(Else, Entry.first);
+    int Blend = (Op == CMP_EQ || Op == CMP_NE ? 3 : 1) + 2 * Merged;
+    Flatten = ThenSize + ElseSize + Blend <=
+              2 + std::max(ThenSize, ElseSize) + BRANCH_PENALTY;
+  }
+  if (Flatten) {
+    BuildFlattenedSelection(ASTNode, Op, A, B);
+    return;
+  }
+  ir_instruction Branch;
+  Branch.Op = neocode_instruction::IFC;
+  Branch.Src[0] = A;
+  Branch.Src[1] = B;
+  Branch.Dst.Const.Integer.X = Op;
+  BuildBranchedSelection(ASTNode, Branch);
+}
+
+void cg_neo::BuildStatement(ast_node *ASTNode) {
+  if (ASTNode->Type == ast_node::NONE) {
+    for (ast_node &Child : ASTNode->Children)
+      BuildStatement(&Child);
+  } else if (ASTNode->Type == ast_node::LOOP) {
+    BuildLoop(ASTNode);
+  } else if (ASTNode->Type == ast_node::SELECTION) {
+    BuildSelection(ASTNode);
+  } else {
+    BuildInstruction(ASTNode);
+  }
+}
+
+ir_function cg_neo::BuildFunction(neocode_program *Program, ast_node *ASTNode) {
+  ir_function F(Program);
+  F.Name = ASTNode->Id;
+  F.Blocks.push_back(ir_block());
+  this->Program = Program;
+  Function = &F;
+  Locals.clear();
+  for (ast_node &Param : ASTNode->Children[1].Children) {
+    ir_instruction In;
+    In.Op = IR_PARAM;
+    In.Result = F.NewValue();
+    In.Name = Param.Id;
+    F.Blocks.back().Instructions.push_back(In);
+    F.Parameters.push_back(In.Result);
+    Locals[Param.Id] = IRValue(In.Result);
+  }
+  BuildStatement(&ASTNode->Children[0]);
+  if (F.Name.compare("main") == 0) {
+    ir_instruction In;
+    In.Op = neocode_instruction::END;
+    F.Blocks.back().Instructions.push_back(In);
+  }
+  Function = nullptr;
+  return F;
+}
+
+
+struct output_builtin {
+  const char *Name;
+  const char *TypeName;
+  int Semantic;
+  int Count;
+};
+
+// Widest first, so that the narrow ones fill the gaps.
+static const output_builtin OutputBuiltins[] = {
+    {"gl_Position", "vec4", neocode_variable::OUTPUT_POSITION, 4},
+    {"gl_FrontColor", "vec4", neocode_variable::OUTPUT_COLOR, 4},
+    {"gl_Quaternion", "vec4", neocode_variable::OUTPUT_QUATERNION, 4},
+    {"gl_View", "vec3", neocode_variable::OUTPUT_VIEW, 3},
+    {"gl_TexCoord0", "vec2", neocode_variable::OUTPUT_TEXCOORD0, 2},
+    {"gl_TexCoord1", "vec2", neocode_variable::OUTPUT_TEXCOORD1, 2},
+    {"gl_TexCoord2", "vec2", neocode_variable::OUTPUT_TEXCOORD2, 2},
+    {"gl_TexCoord0W", "float", neocode_variable::OUTPUT_TEXCOORD0W, 1},
+};
+
+static bool References(const ast_node &Node, const std::string &Name) {
+  if (Node.Id.compare(Name) == 0)
+    return true;
+  for (const ast_node &Child : Node.Children) {
+    if (References(Child, Name))
+      return true;
+  }
+  return false;
+}
+
+// Registers whose components are handed out first fit, as pairs of register
+// and lanes taken.
+typedef std::vector<std::pair<int, int>> lane_pool;
+
+// Find Count adjacent free lanes, opening a new register if none has room.
+// Returns the register; Base is set to the first lane.
+static int PackLanes(neocode_register_file &Registers,
+                     int (neocode_register_file::*Alloc)(), lane_pool &Pool,
+                     int Count, int &Base) {
+  size_t r = 0;
+  while (r < Pool.size() && 4 - Pool[r].second < Count)
+    ++r;
+  if (r == Pool.size())
+    Pool.push_back(std::make_pair((Registers.*Alloc)(), 0));
+  Base = Pool[r].second;
+  Pool[r].second += Count;
+  return Pool[r].first;
+}
+
+// Position and color always get a register of their own. The other outputs
+// only exist if the shader mentions them, and share registers where their
+// components fit.
+static void AllocOutputs(neocode_program *Program, ast_node *ASTNode) {
+  lane_pool Pool;
+  for (const output_builtin &B : OutputBuiltins) {
+    if (B.Semantic != neocode_variable::OUTPUT_POSITION &&
+        B.Semantic != neocode_variable::OUTPUT_COLOR &&
+        !References(*ASTNode, B.Name))
+      continue;
+    int Base;
+    int Register = PackLanes(Program->Registers,
+                             &neocode_register_file::AllocOutput, Pool,
+                             B.Count, Base);
+    neocode_variable V = {B.Name, B.TypeName, ast_node::STRUCT,
+                          Register, B.Semantic, {0}, 0};
+    if (B.Count < 4 || Base) {
+      for (int i = 0; i < B.Count; ++i)
+        V.Swizzle |= (Base + i + 1) << (i * 4);
     }
-    if (In.Src1.Name.compare("") == 0) {
-      Function->Program->Registers.Free(In.Dst.Register);
+    Program->Globals.push_back(V);
+  }
+}
+
+// Narrow attributes share input registers. One placed past lane x is read
+// through its Swizzle, which repeats the last component as Select does.
+// The inputs of a geometry shader are the outputs of the vertex shader in
+// front of it, one register each in the order they are declared.
+typedef std::vector<std::pair<int, neocode_variable>> attribute_list;
+
+static void PackAttributes(neocode_register_file &Registers,
+                           attribute_list &Attributes, bool Geometry,
+                           std::vector<neocode_variable> &Globals) {
+  if (!Geometry)
+    std::stable_sort(Attributes.begin(), Attributes.end(),
+                     [](const std::pair<int, neocode_variable> &A,
+                        const std::pair<int, neocode_variable> &B) {
+                       return A.first > B.first;
+                     });
+
+  lane_pool Pool;
+  for (auto &A : Attributes) {
+    neocode_variable V = A.second;
+    int Base;
+    V.Register = PackLanes(Registers, &neocode_register_file::AllocVertex,
+                           Pool, Geometry ? 4 : A.first, Base);
+    for (int i = 0; Base && i < 4; ++i)
+      V.Swizzle |= (Base + std::min(i, A.first - 1) + 1) << (i * 4);
+    Globals.push_back(V);
+  }
+}
+
+static bool IsPackedAttribute(symtable_entry *E) {
+  return E->Qualifier == token::ATTRIBUTE && E->TypeSpecifier != token::MAT4;
+}
+
+static neocode_variable DeclaredGlobal(ast_node &Node, symtable *S) {
+  symtable_entry *E = S->Lookup(Node.Id);
+  neocode_variable V = {};
+  V.Type = E->SymbolType;
+  V.Name = Node.Id;
+  V.TypeName = S->FindFirstOfType(E->TypeSpecifier)->Name;
+  return V;
+}
+
+static const neocode_variable *FindShared(const neocode_options &Options,
+                                          const std::string &Name) {
+  for (const neocode_variable &V : Options.SharedGlobals) {
+    if (V.Name.compare(Name) == 0)
+      return &V;
+  }
+  return nullptr;
+}
+
+// The attributes of a program in a shader set are where the set put them.
+static void AllocAttributes(neocode_program *Program, ast_node *ASTNode,
+                            symtable *S) {
+  const neocode_options &Options = Program->Options;
+  bool Shared = Options.SharedGlobals.size() && !Options.Geometry;
+  attribute_list Attributes;
+  for (ast_node &Node : ASTNode->Children) {
+    if (Node.Type != ast_node::VARIABLE ||
+        !IsPackedAttribute(S->Lookup(Node.Id)))
+      continue;
+    const neocode_variable *V = FindShared(Options, Node.Id);
+    if (Shared && V) {
+      Program->Registers.Vertex[V->Register] = 1;
+      Program->Globals.push_back(*V);
+      continue;
     }
-    if (In.Src2.Name.compare("") == 0) {
-      Function->Program->Registers.Free(In.Dst.Register);
+    Attributes.push_back(std::make_pair(
+        GetTypeComponentCount(S->Lookup(Node.Id)->TypeSpecifier),
+        DeclaredGlobal(Node, S)));
+  }
+  PackAttributes(Program->Registers, Attributes, Options.Geometry,
+                 Program->Globals);
+}
+
+// Float uniforms take RegisterCount adjacent registers. False when they do
+// not fit.
+static bool AllocUniform(neocode_register_file &Registers,
+                         neocode_variable &V) {
+  if (V.TypeName.compare("bool") == 0) {
+    V.Count = 0;
+    V.Register = Registers.AllocBoolean();
+    if (V.Register < 0) {
+      V.Register = 0xA0;
+      return false;
     }
+    return true;
+  }
+  V.Register = Registers.AllocConstant();
+  if (V.Register < 0) {
+    V.Register = 0x20;
+    return false;
+  }
+  for (int i = 1; i < V.RegisterCount(); ++i) {
+    if (Registers.AllocConstant() != V.Register + i)
+      return false;
   }
+  return true;
 }
 
-neocode_function cg_neo::BuildFunction(neocode_program *Program, ast_node *ASTNode) {
-  neocode_function Function = neocode_function(Program);
-  Function.Name = ASTNode->Id;
-  for (size_t i = 0; i < ASTNode->Children[0].Children.size(); ++i) {
-    if (ASTNode->Children[0].Children[i].Children.size()) {
-      BuildStatement(&Function, &ASTNode->Children[0].Children[i]);
+static const char *RegisterFileName(const neocode_variable &V) {
+  return V.TypeName.compare("bool") == 0 ? "bool" : "float";
+}
+
+// Every uniform of a shader set gets one register for all programs, and each
+// program keeps the registers of the others' uniforms free as well, so that
+// a value uploaded once stays valid across program switches. Attributes of
+// the same name share a register too, except in geometry shaders. Errors
+// are printed and added to ErrorCount, as there is no program yet.
+std::vector<neocode_variable>
+CGNeoLayoutShaderSet(const std::vector<ast_node *> &Roots,
+                     const std::vector<symtable *> &Tables,
+                     const std::vector<bool> &Geometry,
+                     const neocode_options &Options, int &ErrorCount) {
+  neocode_register_file Registers = {};
+  Registers.AllocConstant();
+  Registers.AllocConstant();
+  Registers.AllocConstant();
+  std::vector<neocode_variable> Globals;
+  attribute_list Attributes;
+  for (size_t p = 0; p < Roots.size(); ++p) {
+    for (ast_node &Node : Roots[p]->Children) {
+      if (Node.Type != ast_node::VARIABLE)
+        continue;
+      symtable_entry *E = Tables[p]->Lookup(Node.Id);
+      bool Attribute = IsPackedAttribute(E) && !Geometry[p];
+      if (E->Qualifier != token::UNIFORM && !Attribute)
+        continue;
+      neocode_variable V = DeclaredGlobal(Node, Tables[p]);
+      V.Count = (int)Node.IntValue;
+      const neocode_variable *Seen = nullptr;
+      for (const neocode_variable &G : Globals)
+        Seen = G.Name.compare(V.Name) == 0 ? &G : Seen;
+      for (const auto &A : Attributes)
+        Seen = A.second.Name.compare(V.Name) == 0 ? &A.second : Seen;
+      if (Seen) {
+        if (Seen->TypeName.compare(V.TypeName) != 0 ||
+            Seen->Count != V.Count) {
+          CGNeoReport(Options,
+                      "%s is declared differently within the shader set",
+                      V.Name.c_str());
+          ++ErrorCount;
+        }
+        continue;
+      }
+      if (Attribute) {
+        Attributes.push_back(
+            std::make_pair(GetTypeComponentCount(E->TypeSpecifier), V));
+        continue;
+      }
+      V.RegisterType = neocode_variable::INPUT_UNIFORM;
+      if (!AllocUniform(Registers, V)) {
+        CGNeoReport(Options, "out of %s registers for %s", RegisterFileName(V),
+                    V.Name.c_str());
+        ++ErrorCount;
+      }
+      Globals.push_back(V);
     }
   }
-  return Function;
+  PackAttributes(Registers, Attributes, false, Globals);
+  return Globals;
+}
+
+// The attributes and the uniforms that the program reads.
+static void PrintAttributeLayout(neocode_program *Program, symtable *S) {
+  for (neocode_variable &V : Program->Globals) {
+    if (V.RegisterType == neocode_variable::INPUT_UNIFORM) {
+      std::cout << "uniform " << V.Name << " " << RegisterName(V.Register);
+      int Last = V.Register + V.RegisterCount() - 1;
+      if (Last > V.Register)
+        std::cout << " - " << RegisterName(Last);
+      std::cout << std::endl;
+      continue;
+    }
+    if (V.RegisterType != 0 || V.Register >= 0x10)
+      continue;
+    int Count = GetTypeComponentCount(S->Lookup(V.TypeName)->SymbolType);
+    int Base = V.Swizzle ? (V.Swizzle & 0b1111) - 1 : 0;
+    std::cout << "attribute " << V.Name << " v" << V.Register << "."
+              << std::string("xyzw").substr(Base, Count) << std::endl;
+  }
+}
+
+// The most instructions Ins[Begin, End) runs with the bool uniforms in
+// Bools set: a LOOP counts its body for every iteration, an IFC its longer
+// part and a call the whole callee. Every jump taken, into a callee and
+// back, into the else part or back to the top of a loop, adds Penalty.
+static int PathSize(neocode_program *Program, neocode_function *Function,
+                    size_t Begin, size_t End, const std::set<int> &Bools,
+                    int Penalty = 0) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  int Size = 0;
+  for (size_t i = Begin; i < End; ++i) {
+    neocode_instruction &In = Ins[i];
+    if (OptIsMarker(In))
+      continue;
+    ++Size;
+    bool Set = Bools.count(In.Src1.Register) != 0;
+    neocode_function *Callee = nullptr;
+    if (In.Type == neocode_instruction::CALL ||
+        (In.Type == neocode_instruction::CALLU && Set))
+      Callee = OptFindFunction(Program, In.ExtraData);
+    if (Callee)
+      Size += PathSize(Program, Callee, 0, Callee->Instructions.size(), Bools,
+                       Penalty) +
+              2 * Penalty;
+    if (In.Type != neocode_instruction::LOOP &&
+        In.Type != neocode_instruction::IFC &&
+        In.Type != neocode_instruction::IFU &&
+        In.Type != neocode_instruction::JMPU)
+      continue;
+
+    size_t Else = 0, Close = i + 1;
+    for (int Depth = 0; Close < End; ++Close) {
+      int Type = Ins[Close].Type;
+      if (Type == neocode_instruction::LOOP ||
+          Type == neocode_instruction::IFC ||
+          Type == neocode_instruction::IFU || Type == neocode_instruction::JMPU)
+        ++Depth;
+      else if (Type == neocode_instruction::ELSE && Depth == 0)
+        Else = Close;
+      else if ((Type == neocode_instruction::ENDLOOP ||
+                Type == neocode_instruction::ENDIF) &&
+               Depth-- == 0)
+        break;
+    }
+    size_t ThenEnd = Else ? Else : Close;
+    int Then = PathSize(Program, Function, i + 1, ThenEnd, Bools, Penalty);
+    int Other = Else ? PathSize(Program, Function, Else + 1, Close, Bools,
+                                Penalty) +
+                           Penalty
+                     : 0;
+    if (In.Type == neocode_instruction::LOOP)
+      Size += (In.Src1.Const.Integer.X + 1) * (Then + Penalty);
+    else if (In.Type == neocode_instruction::IFC)
+      Size += std::max(Then, Other);
+    else if (In.Type == neocode_instruction::IFU)
+      Size += Set ? Then : Other;
+    else if (!Set)
+      Size += Then;
+    i = Close;
+  }
+  return Size;
+}
+
+// One line for every setting of the bool uniforms the program branches on.
+static void PrintPathSizes(neocode_program *Program) {
+  std::vector<neocode_variable> Bools;
+  for (neocode_variable &V : Program->Globals) {
+    if (V.Register >= 0xA0)
+      Bools.push_back(V);
+  }
+  neocode_function *Main = OptFindFunction(Program, "main");
+  if (!Main)
+    return;
+  for (int Setting = 0; Setting < (1 << Bools.size()); ++Setting) {
+    std::set<int> Set;
+    std::cout << "path";
+    for (size_t b = 0; b < Bools.size(); ++b) {
+      std::cout << " " << Bools[b].Name << "=" << ((Setting >> b) & 1);
+      if ((Setting >> b) & 1)
+        Set.insert(Bools[b].Register);
+    }
+    std::cout << ": "
+              << PathSize(Program, Main, 0, Main->Instructions.size(), Set)
+              << " instructions" << std::endl;
+  }
+}
+
+// The registers an instance takes up in all per-instance uniforms together,
+// and in the largest of them.
+static void MeasureInstance(ast_node *ASTNode, symtable *S,
+                            const neocode_options &Options, int &Stride,
+                            int &Rows) {
+  Stride = Rows = 0;
+  for (ast_node &Node : ASTNode->Children) {
+    if (Node.Type != ast_node::VARIABLE || !IsPerInstance(Options, Node.Id))
+      continue;
+    symtable_entry *E = S->Lookup(Node.Id);
+    if (E->Qualifier != token::UNIFORM)
+      continue;
+    int R = E->TypeSpecifier == token::MAT4 ? 4 : 1;
+    Stride += R;
+    Rows = std::max(Rows, R);
+  }
 }
 
-neocode_program CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S) {
+static neocode_program BuildProgram(ast_node *ASTNode, symtable *S,
+                                    const neocode_options &Options) {
   neocode_program Program;
   cg_neo CGNeo;
   CGNeo.SymbolTable = S;
   Program.Registers = {};
-  Program.Globals.push_back(
-      (neocode_variable){"gl_Position",
-                         "vec4",
-                         ast_node::STRUCT,
-                         Program.Registers.AllocOutput(),
-                         neocode_variable::OUTPUT_POSITION,
-                         {0},
-                         0});
-  Program.Globals.push_back((neocode_variable){"gl_FrontColor",
-                                               "vec4",
-                                               ast_node::STRUCT,
-                                               Program.Registers.AllocOutput(),
-                                               neocode_variable::OUTPUT_COLOR,
-                                               {0},
-                                               0});
+  Program.Options = Options;
+  AllocOutputs(&Program, ASTNode);
+  AllocAttributes(&Program, ASTNode, S);
   Program.Registers.AllocConstant();
   Program.Registers.AllocConstant();
   Program.Registers.AllocConstant();
+  for (const neocode_variable &V : Options.SharedGlobals) {
+    if (V.RegisterType != neocode_variable::INPUT_UNIFORM)
+      continue;
+    if (V.Register >= 0xA0)
+      Program.Registers.Booleans[V.Register - 0xA0] = 1;
+    for (int i = 0; V.Register < 0xA0 && i < V.RegisterCount(); ++i)
+      Program.Registers.Constants[V.Register - 0x20 + i] = 1;
+  }
   for (auto Node : ASTNode->Children) {
     if (Node.Type == ast_node::FUNCTION) {
-      Program.Functions.push_back(CGNeo.BuildFunction(&Program, &Node));
-      Program.Registers.FreeAllTemp();
+      ir_function IR = CGNeo.BuildFunction(&Program, &Node);
+      IRRunPasses(&IR, Options);
+      if (Options.PrintIR)
+        IRPrintFunction(&IR, std::cout);
+      neocode_function Function(&Program);
+      IRLowerFunction(&IR, &Function);
+      Program.Functions.push_back(Function);
     } else if (Node.Type == ast_node::VARIABLE) {
       symtable_entry *E = S->Lookup(Node.Id);
       if (E->Qualifier == token::CONST && E->TypeSpecifier == token::VEC4) {
-        neocode_variable Constant;
+        neocode_variable Constant = {};
         Constant.Type = E->SymbolType;
         Constant.RegisterType = 0;
         Constant.Register = Program.Registers.AllocConstant();
@@ -440,22 +2295,27 @@ neocode_program CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S) {
         Constant.Const.Float.W = AN.Children[3].FloatValue;
         Program.Globals.push_back(Constant);
       } else if (E->Qualifier == token::UNIFORM) {
-        neocode_variable Constant;
-        Constant.Type = E->SymbolType;
+        if (const neocode_variable *Shared = FindShared(Options, Node.Id)) {
+          Program.Globals.push_back(*Shared);
+          continue;
+        }
+        neocode_variable Constant = DeclaredGlobal(Node, S);
         Constant.RegisterType = neocode_variable::INPUT_UNIFORM;
-        Constant.Register = Program.Registers.AllocConstant();
-        if (E->TypeSpecifier == token::MAT4) {
-          Program.Registers.AllocConstant();
-          Program.Registers.AllocConstant();
-          Program.Registers.AllocConstant();
+        Constant.Count = (int)Node.IntValue;
+        if (IsPerInstance(Options, Node.Id)) {
+          if (Constant.Count)
+            CGNeoError(&Program, "per-instance uniform %s is an array "
+                                 "already",
+                       Node.Id.c_str());
+          Constant.Count = Options.InstanceCount;
         }
-        Constant.Name = Node.Id;
-        Constant.TypeName = S->FindFirstOfType(E->TypeSpecifier)->Name;
-
-        Constant.Swizzle = 0;
+        if (!AllocUniform(Program.Registers, Constant))
+          CGNeoError(&Program, "out of %s registers for %s",
+                     RegisterFileName(Constant), Constant.Name.c_str());
         Program.Globals.push_back(Constant);
-      } else if (E->Qualifier == token::ATTRIBUTE) {
-        neocode_variable Constant;
+      } else if (E->Qualifier == token::ATTRIBUTE &&
+                 !FindGlobal(&Program, Node.Id)) {
+        neocode_variable Constant = {};
         Constant.Type = E->SymbolType;
         Constant.RegisterType = 0;
         Constant.Register = Program.Registers.AllocVertex();
@@ -472,6 +2332,91 @@ neocode_program CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S) {
       }
     }
   }
+  OptRunPasses(&Program);
+  return Program;
+}
+
+// Every way of building the program is tried, from the fastest to the
+// smallest, and the one estimated to run fastest wins among those that fit
+// the instruction memory and the operand descriptors. Failing that, the
+// smallest is the best there is. IR is printed again for the winner only.
+static neocode_program FitProgram(ast_node *ASTNode, symtable *S,
+                                  const neocode_options &Options) {
+  if (!Options.OptimizeSize)
+    return BuildProgram(ASTNode, S, Options);
+  neocode_options Trial = Options;
+  Trial.PrintIR = false;
+  neocode_program Best;
+  int BestCycles = 0, BestSize = 0;
+  bool BestFits = false;
+  for (int Level = 0; Level < 6; ++Level) {
+    Trial.SizeLevel = Level;
+    neocode_program Program = BuildProgram(ASTNode, S, Trial);
+    if (Program.ErrorCount)
+      return Program;
+    int Size = OptProgramSize(&Program);
+    bool Fits =
+        Size <= OPT_MAX_PROGRAM_SIZE && CGShbinFitsOpDescs(&Program);
+    int Cycles = 0;
+    if (neocode_function *Main = OptFindFunction(&Program, "main"))
+      Cycles = PathSize(&Program, Main, 0, Main->Instructions.size(),
+                        std::set<int>(), BRANCH_PENALTY);
+    if (Level == 0 || (Fits && (!BestFits || Cycles < BestCycles)) ||
+        (!Fits && !BestFits && Size < BestSize)) {
+      Best = Program;
+      BestCycles = Cycles;
+      BestSize = Size;
+      BestFits = Fits;
+    }
+  }
+  if (Options.PrintIR) {
+    Trial = Options;
+    Trial.SizeLevel = Best.Options.SizeLevel;
+    return BuildProgram(ASTNode, S, Trial);
+  }
+  return Best;
+}
+
+static void PrintReports(neocode_program *Program, symtable *S) {
+  const neocode_options &Options = Program->Options;
+  if (Options.PrintLayout)
+    PrintAttributeLayout(Program, S);
+  if (Options.PrintLayout && Options.InstanceCount)
+    std::cout << "instances " << Options.InstanceCount << std::endl;
+  if (Options.PrintPaths)
+    PrintPathSizes(Program);
+}
+
+// An instanced program is built twice: once with a single instance to see
+// how many float registers everything else takes, then with as many
+// instances as fit in the rest, short of c95. The index MOVA produces only
+// reaches 127, which bounds the instances of a mat4 to 32.
+neocode_program CGNeoBuildProgramInstance(ast_node *ASTNode, symtable *S,
+                                          const neocode_options &Options) {
+  neocode_options Fitted = Options;
+  int Stride, Rows;
+  MeasureInstance(ASTNode, S, Options, Stride, Rows);
+  if (!Options.InstanceId.empty() && !Options.InstanceCount && !Stride) {
+    neocode_program Program;
+    Program.Options = Options;
+    CGNeoError(&Program, "no per-instance uniforms");
+    return Program;
+  }
+  if (!Options.InstanceId.empty() && !Options.InstanceCount) {
+    neocode_options Single = Options;
+    Single.InstanceCount = 1;
+    Single.PrintIR = false;
+    neocode_program Program = FitProgram(ASTNode, S, Single);
+    if (Program.ErrorCount)
+      return Program;
+    int Used = 0;
+    for (int i = 0; i < 96; ++i)
+      Used += Program.Registers.Constants[i];
+    Fitted.InstanceCount = std::min(1 + std::max(95 - Used, 0) / Stride,
+                                    127 / Rows + 1);
+  }
+  neocode_program Program = FitProgram(ASTNode, S, Fitted);
+  PrintReports(&Program, S);
   return Program;
 }
 
@@ -487,18 +2432,34 @@ void CGNeoGenerateInstruction(neocode_instruction *Instruction,
        << RegisterName(Instruction->Src1) << std::endl;
     break;
 
+  case neocode_instruction::ADD:
   case neocode_instruction::MUL:
-    os << " "
-       << "mul " << RegisterName(Instruction->Dst) << ", "
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+    os << " " << GetInstructionMnemonic(Instruction->Type) << " "
+       << RegisterName(Instruction->Dst) << ", "
        << RegisterName(Instruction->Src1) << ", "
        << RegisterName(Instruction->Src2) << std::endl;
     break;
 
-  case neocode_instruction::DP4:
+  case neocode_instruction::FLR:
+  case neocode_instruction::MOVA:
+    os << " " << GetInstructionMnemonic(Instruction->Type) << " "
+       << RegisterName(Instruction->Dst) << ", "
+       << RegisterName(Instruction->Src1) << std::endl;
+    break;
+
+  case neocode_instruction::MAD:
     os << " "
-       << "dp4 " << RegisterName(Instruction->Dst) << ", "
+       << "mad " << RegisterName(Instruction->Dst) << ", "
        << RegisterName(Instruction->Src1) << ", "
-       << RegisterName(Instruction->Src2) << std::endl;
+       << RegisterName(Instruction->Src2) << ", "
+       << RegisterName(Instruction->Src3) << std::endl;
     break;
 
   case neocode_instruction::RSQ:
@@ -523,6 +2484,40 @@ void CGNeoGenerateInstruction(neocode_instruction *Instruction,
        << "end" << std::endl;
     break;
 
+  case neocode_instruction::CALL:
+    os << " "
+       << "call " << Instruction->ExtraData << ", " << Instruction->ExtraData
+       << "_end" << std::endl;
+    break;
+
+  case neocode_instruction::CALLU:
+    os << " "
+       << "callu " << RegisterName(Instruction->Src1) << ", "
+       << Instruction->ExtraData << ", " << Instruction->ExtraData << "_end"
+       << std::endl;
+    break;
+
+  case neocode_instruction::SETEMIT:
+    os << " "
+       << "setemit " << Instruction->Dst.Const.Integer.X
+       << (Instruction->Dst.Const.Integer.Y ? ", prim" : "")
+       << (Instruction->Dst.Const.Integer.Z ? ", inv" : "") << std::endl;
+    break;
+
+  case neocode_instruction::EMIT:
+    os << " "
+       << "emit" << std::endl;
+    break;
+
+  case neocode_instruction::CMP: {
+    const char *Names[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+    const char *Name = Names[Instruction->Dst.Const.Integer.X];
+    os << " "
+       << "cmp " << RegisterName(Instruction->Src1) << ", " << Name << ", "
+       << Name << ", " << RegisterName(Instruction->Src2) << std::endl;
+    break;
+  }
+
   case neocode_instruction::EX2:
     os << " "
        << "exp " << RegisterName(Instruction->Dst) << ", "
@@ -541,10 +2536,60 @@ void CGNeoGenerateInstruction(neocode_instruction *Instruction,
   }
 }
 
+// Like a call, a loop names the label just past the end of its body. An if
+// names where its else part starts, which is its end when it has none, and
+// a jmpu only its end.
 void CGNeoGenerateFunction(neocode_function *Function, std::ostream &os) {
   os << Function->Name << ":" << std::endl;
+  std::vector<int> Open, OpenIfs, ElseSeen;
+  int Loops = 0, Ifs = 0;
   for (neocode_instruction &Instruction : Function->Instructions) {
-    CGNeoGenerateInstruction(&Instruction, os);
+    if (Instruction.Type == neocode_instruction::LOOP) {
+      os << " "
+         << "loop " << RegisterName(Instruction.Src1) << ", "
+         << Function->Name << "_loop" << Loops << "_end" << std::endl;
+      Open.push_back(Loops++);
+    } else if (Instruction.Type == neocode_instruction::ENDLOOP) {
+      if (Open.size()) {
+        os << Function->Name << "_loop" << Open.back() << "_end:" << std::endl;
+        Open.pop_back();
+      }
+    } else if (Instruction.Type == neocode_instruction::IFC ||
+               Instruction.Type == neocode_instruction::IFU) {
+      if (Instruction.Type == neocode_instruction::IFC)
+        os << " "
+           << "ifc cmp.x, ";
+      else
+        os << " "
+           << "ifu " << RegisterName(Instruction.Src1) << ", ";
+      os << Function->Name << "_if" << Ifs << "_else, " << Function->Name
+         << "_if" << Ifs << "_end" << std::endl;
+      OpenIfs.push_back(Ifs++);
+      ElseSeen.push_back(0);
+    } else if (Instruction.Type == neocode_instruction::JMPU) {
+      os << " "
+         << "jmpu " << RegisterName(Instruction.Src1) << ", " << Function->Name
+         << "_if" << Ifs << "_end" << std::endl;
+      OpenIfs.push_back(Ifs++);
+      ElseSeen.push_back(1);
+    } else if (Instruction.Type == neocode_instruction::ELSE) {
+      if (OpenIfs.size()) {
+        os << Function->Name << "_if" << OpenIfs.back() << "_else:"
+           << std::endl;
+        ElseSeen.back() = 1;
+      }
+    } else if (Instruction.Type == neocode_instruction::ENDIF) {
+      if (OpenIfs.size()) {
+        if (!ElseSeen.back())
+          os << Function->Name << "_if" << OpenIfs.back() << "_else:"
+             << std::endl;
+        os << Function->Name << "_if" << OpenIfs.back() << "_end:" << std::endl;
+        OpenIfs.pop_back();
+        ElseSeen.pop_back();
+      }
+    } else {
+      CGNeoGenerateInstruction(&Instruction, os);
+    }
   }
   os << Function->Name << "_end:" << std::endl;
 }
@@ -564,6 +2609,11 @@ static void WriteVarible(neocode_variable &V, std::ostream &os) {
        << OutputName(V.RegisterType) << std::endl;
   } else if (V.Register < 0x20) {
     os << ".alias " << V.Name << " " << RegisterName(V, 1) << std::endl;
+  } else if (V.RegisterType == 0 && V.Register >= 0x90) {
+    neocode_constant Const = V.Const;
+    os << ".alias " << V.Name << " " << RegisterName(V, 1) << " as ("
+       << Const.Integer.X << "," << Const.Integer.Y << "," << Const.Integer.Z
+       << "," << Const.Integer.W << ")" << std::endl;
   } else if (V.RegisterType == 0) {
     neocode_constant Const = V.Const;
     os << ".alias " << V.Name << " " << RegisterName(V, 1) << " as ("
@@ -571,14 +2621,26 @@ static void WriteVarible(neocode_variable &V, std::ostream &os) {
        << Const.Float.W << ")" << std::endl;
   } else {
     os << ".alias " << V.Name << " " << RegisterName(V.Register);
-    if (V.TypeName.compare("mat4") == 0)
-      os << " - " << RegisterName(V.Register + 3);
+    if (V.RegisterCount() > 1)
+      os << " - " << RegisterName(V.Register + V.RegisterCount() - 1);
     os << std::endl;
   }
 }
 
+// The preshader is a C function over the float uniform file, indexed by
+// register, to be run whenever the uniforms it reads change.
+void CGNeoGeneratePreshader(neocode_program *Program, std::ostream &os) {
+  os << "#include <math.h>" << std::endl << std::endl;
+  os << "void SelenaPreshader(float c[96][4]) {" << std::endl;
+  os << Program->Preshader;
+  os << "}" << std::endl;
+}
+
 void CGNeoGenerateCode(neocode_program *Program, std::ostream &os) {
   os << ".alias SelenaCCVersion c95 as (0.0, 0.0, 0.0, 0.1)" << std::endl;
+  if (Program->Options.InstanceCount)
+    os << "; " << Program->Options.InstanceCount << " instances per draw"
+       << std::endl;
   for (neocode_variable &V : Program->Globals) {
     WriteVarible(V, os);
   }
@@ -1,11 +1,17 @@
 #include "codegen_shbin.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <unordered_map>
 
 enum { SHADER_TYPE_VERTEX = 0, SHADER_TYPE_GEO = 1 };
 
+// Followed by the file offset of every DVLE.
 struct __attribute__((packed)) dvlb {
   int Magic = 'D' | 'V' << 8 | 'L' << 16 | 'B' << 24;
   int DVLECount;
-  int DVLEOffset;
 };
 
 struct __attribute__((packed)) dvlp {
@@ -21,12 +27,17 @@ struct __attribute__((packed)) dvlp {
 struct __attribute__((packed)) dvle {
   int Magic = 'D' | 'V' << 8 | 'L' << 16 | 'E' << 24;
   short Pad2 = 0;
-  char ShaderType;
+  char ShaderType; // 0 vertex, 1 geometry
   char Unk = 0;
   int ExecEntryOffset;
   int ExecEntryEndOffset;
   int Pad0 = 0;
-  int Pad1 = 0;
+  // A geometry shader runs in point mode: it gets every primitive's inputs
+  // in v0-v15 at once.
+  char GeoShaderMode = 0;
+  char GeoFixedStart = 0;
+  char GeoVariableCount = 0;
+  char GeoFixedCount = 0;
   int ConstantTableOffset;
   int ConstantCount;
   int LabelTableOffset;
@@ -71,6 +82,19 @@ struct __attribute__((packed)) op_desc_entry {
   int Pad;
 };
 
+// The hardware holds 128 operand descriptors, and MAD only addresses the
+// first 32 of them.
+enum { OP_DESC_LIMIT = 128, OP_DESC_MAD_LIMIT = 32 };
+
+// Care marks the descriptor bits the instruction actually depends on: the
+// destination mask and, for every source it reads, the negate flag and the
+// selectors of the lanes it reads. Everything else is left as a plain
+// identity read, so that equivalent descriptors hash alike.
+struct op_desc {
+  int Value;
+  int Care;
+};
+
 struct __attribute__((packed)) output_entry {
   char Type;
   char Pad0 = 0;
@@ -79,27 +103,55 @@ struct __attribute__((packed)) output_entry {
   int Mask;
 };
 
-struct shbin_gen {
-  std::vector<std::string> SymbolTable;
+// One entry point: a program's own DVLE with the tables that describe it.
+// Functions maps each of its function names to the shared copy in the blob.
+struct shbin_entry {
+  neocode_program *Program;
+  std::string SymbolTable;
+  std::unordered_map<std::string, int> SymbolOffsets;
   std::vector<label_entry> LabelTable;
   std::vector<uniform_entry> UniformTable;
   std::vector<const_entry> ConstTable;
-  std::vector<op_desc_entry> OpDescTable;
   std::vector<output_entry> OutputTable;
-  std::vector<unsigned int> Blob;
-  dvlp DVLP;
-  dvlb DVLB;
+  std::map<std::string, int> Functions;
   dvle DVLE;
-  neocode_program *Program;
 
-  void GenBlob();
   void GenSymbolTable();
-  void WriteShbin(std::ostream &os);
-  int GenInstruction(neocode_instruction *Instruction);
   int GetSymbolOffset(const std::string &s);
   void GenConstTable();
   void GenUniformTable();
   void GenOutputTable();
+  int Size();
+  void Write(std::ostream &os);
+};
+
+// All entry points share one DVLP: a single blob holding every distinct
+// function once, and one operand descriptor table.
+struct shbin_gen {
+  std::vector<shbin_entry> Entries;
+  std::vector<neocode_function> Functions;
+  std::vector<int> FunctionEntries;
+  std::map<std::string, int> FunctionIndices;
+  std::vector<int> FunctionOffsets;
+  std::vector<int> FunctionSizes;
+  std::vector<op_desc_entry> OpDescTable;
+  std::vector<unsigned int> Blob;
+  std::map<neocode_instruction *, int> LoopEnds;
+  std::map<neocode_instruction *, int> ElseStarts;
+  std::map<neocode_instruction *, int> IfEnds;
+  std::unordered_map<int, int> OpDescIndices;
+  bool OpDescOverflow = false;
+  dvlp DVLP;
+  dvlb DVLB;
+
+  void AddFunctions(int Entry);
+  void GenBlob();
+  void GenLabels(shbin_entry &Entry);
+  void WriteShbin(std::ostream &os);
+  int GenInstruction(neocode_instruction *Instruction, int OpDescIndex,
+                     shbin_entry &Entry);
+  int AddOpDesc(const op_desc &Desc, int Limit);
+  int AssignOpDesc(neocode_instruction *Instruction);
 };
 
 #define OP_DESC(dst, src1, src2, src3)                                         \
@@ -115,86 +167,279 @@ struct shbin_gen {
   ((desc & 0b1111111) | ((src1 & 0b1111111) << 0xC) | ((idx & 0b11) << 0x13) | \
    ((dst & 0b11111) << 0x15) | ((op & 0b111111) << 0x1A))
 
-int shbin_gen::GenInstruction(neocode_instruction *Instruction) {
-  if (Instruction->Type == neocode_instruction::EMPTY)
-    return -1;
-  int DstMask = 0;
-  int Src1Comp = 0;
-  int Src2Comp = 0;
-  if (Instruction->Src1.TypeName.compare("mat4") == 0) {
-    Src1Comp = 0b000110110;
-  } else {
-    int Swizz = Instruction->Src1.Swizzle;
-    if (Swizz == 0) {
-      Src1Comp = 0b000110110;
-    } else {
-      for (int i = 0; i < 4; ++i) {
-        int V = ((Swizz >> (i * 4)) & 0b1111) - 1;
-        if (V < 0)
-          continue;
-        Src1Comp |= (V << ((0x6 - (i * 2)) + 1));
-      }
-    }
+#define INSTR_1C(op, desc, src1, src2, idx, cmpy, cmpx)                        \
+  ((desc & 0b1111111) | ((src2 & 0b11111) << 0x7) |                            \
+   ((src1 & 0b1111111) << 0xC) | ((idx & 0b11) << 0x13) |                      \
+   ((cmpy & 0b111) << 0x15) | ((cmpx & 0b111) << 0x18) |                       \
+   ((op & 0b11111) << 0x1B))
+
+#define INSTR_2(op, dst, num, condop, refy, refx)                              \
+  ((num & 0b11111111) | ((dst & 0b111111111111) << 0xA) |                      \
+   ((condop & 0b11) << 0x16) | ((refy & 0b1) << 0x18) |                        \
+   ((refx & 0b1) << 0x19) | ((op & 0b111111) << 0x1A))
+
+#define INSTR_3(op, dst, num, id)                                               \
+  ((num & 0b11111111) | ((dst & 0b111111111111) << 0xA) |                      \
+   ((id & 0b1111) << 0x16) | ((op & 0b111111) << 0x1A))
+
+#define INSTR_SETEMIT(op, vtx, prim, winding)                                   \
+  (((winding & 0b1) << 0x16) | ((prim & 0b1) << 0x17) |                        \
+   ((vtx & 0b11) << 0x18) | ((op & 0b111111) << 0x1A))
+
+#define INSTR_1I(op, desc, dst, src1, src2, idx)                               \
+  ((desc & 0b1111111) | ((src2 & 0b1111111) << 0x7) |                          \
+   ((src1 & 0b11111) << 0xE) | ((idx & 0b11) << 0x13) |                        \
+   ((dst & 0b11111) << 0x15) | ((op & 0b111111) << 0x1A))
+
+#define INSTR_5(op, desc, dst, src1, src2, src3, idx)                          \
+  ((desc & 0b11111) | ((src3 & 0b11111) << 0x5) |                              \
+   ((src2 & 0b1111111) << 0xA) | ((src1 & 0b11111) << 0x11) |                  \
+   ((idx & 0b11) << 0x16) | ((dst & 0b11111) << 0x18) |                        \
+   ((op & 0b111) << 0x1D))
+
+#define INSTR_5I(op, desc, dst, src1, src2, src3, idx)                         \
+  ((desc & 0b11111) | ((src3 & 0b1111111) << 0x5) |                            \
+   ((src2 & 0b11111) << 0xC) | ((src1 & 0b11111) << 0x11) |                    \
+   ((idx & 0b11) << 0x16) | ((dst & 0b11111) << 0x18) |                        \
+   ((op & 0b111) << 0x1D))
+
+static int GetDstLanes(int Swizzle) {
+  if (Swizzle == 0)
+    return 0b1111;
+  int Lanes = 0;
+  for (int i = 0; i < 4; ++i) {
+    int V = ((Swizzle >> (i * 4)) & 0b1111) - 1;
+    if (V >= 0)
+      Lanes |= 1 << V;
   }
-  {
-    int Swizz = Instruction->Src2.Swizzle;
-    if (Swizz == 0) {
-      Src2Comp = 0b000110110;
-    } else {
-      for (int i = 0; i < 4; ++i) {
-        int V = ((Swizz >> (i * 4)) & 0b1111) - 1;
-        if (V < 0)
-          continue;
-        Src2Comp |= (V << ((0x6 - (i * 2)) + 1));
-      }
-    }
+  return Lanes;
+}
+
+static int GetSourceRegister(neocode_variable &V) {
+  return V.Register + (V.TypeName.compare("mat4") == 0 ? V.Swizzle : 0);
+}
+
+static int GetSourceSelector(neocode_variable &V, int Lane) {
+  if (V.TypeName.compare("mat4") == 0 || V.Swizzle == 0)
+    return Lane;
+  int C = ((V.Swizzle >> (Lane * 4)) & 0b1111) - 1;
+  return C < 0 ? 0 : C;
+}
+
+static bool HasOpDesc(int Type) {
+  switch (Type) {
+  case neocode_instruction::EMPTY:
+  case neocode_instruction::NOP:
+  case neocode_instruction::END:
+  case neocode_instruction::CALL:
+  case neocode_instruction::CALLU:
+  case neocode_instruction::LOOP:
+  case neocode_instruction::ENDLOOP:
+  case neocode_instruction::IFC:
+  case neocode_instruction::IFU:
+  case neocode_instruction::JMPU:
+  case neocode_instruction::ELSE:
+  case neocode_instruction::ENDIF:
+  case neocode_instruction::SETEMIT:
+  case neocode_instruction::EMIT:
+    return false;
+  }
+  return true;
+}
+
+// ENDLOOP, ELSE and ENDIF only mark places that other instructions name.
+static bool IsMarker(int Type) {
+  switch (Type) {
+  case neocode_instruction::EMPTY:
+  case neocode_instruction::ENDLOOP:
+  case neocode_instruction::ELSE:
+  case neocode_instruction::ENDIF:
+    return true;
   }
-  int DstSwizz = Instruction->Dst.Swizzle;
-  if (DstSwizz == 0) {
-    DstMask = 0b1111;
-  } else {
+  return false;
+}
+
+static int GetSourceCount(int Type) {
+  switch (Type) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::FLR:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::RCP:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+    return 1;
+  case neocode_instruction::MAD:
+    return 3;
+  }
+  return 2;
+}
+
+// The lanes of source Index the instruction reads, bit i for lane i.
+static int GetReadLanes(int Type, int Index, int DstLanes) {
+  switch (Type) {
+  case neocode_instruction::DP3:
+    return 0b0111;
+  case neocode_instruction::DP4:
+    return 0b1111;
+  case neocode_instruction::DPH:
+    return Index == 0 ? 0b0111 : 0b1111;
+  case neocode_instruction::RSQ:
+  case neocode_instruction::RCP:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::CMP:
+    return 0b0001;
+  }
+  return DstLanes;
+}
+
+static op_desc GetOpDesc(neocode_instruction *Instruction) {
+  int DstLanes = GetDstLanes(Instruction->Dst.Swizzle);
+
+  int DstMask = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (DstLanes & (1 << i))
+      DstMask |= 1 << (3 - i);
+  }
+  neocode_variable *Sources[3] = {&Instruction->Src1, &Instruction->Src2,
+                                  &Instruction->Src3};
+  int Comp[3], Care[3];
+  for (int s = 0; s < 3; ++s) {
+    bool Used = s < GetSourceCount(Instruction->Type);
+    int Lanes = Used ? GetReadLanes(Instruction->Type, s, DstLanes) : 0;
+    Comp[s] = Used && Sources[s]->Negate ? 1 : 0;
+    Care[s] = Used ? 1 : 0;
     for (int i = 0; i < 4; ++i) {
-      int V = ((DstSwizz >> (i * 4)) & 0b1111) - 1;
-      if (V < 0)
-        continue;
-      DstMask |= (1 << (3 - V));
+      int Shift = 0x7 - i * 2;
+      bool Read = Lanes & (1 << i);
+      Comp[s] |= (Read ? GetSourceSelector(*Sources[s], i) : i) << Shift;
+      if (Read)
+        Care[s] |= 0b11 << Shift;
     }
   }
+  op_desc Desc = {OP_DESC(DstMask, Comp[0], Comp[1], Comp[2]),
+                  OP_DESC(0b1111, Care[0], Care[1], Care[2])};
+  return Desc;
+}
 
-  int OpDesc = OP_DESC(DstMask, Src1Comp, Src2Comp, 0);
-  int OpDescIndex = -1;
-  for (int i = 0; i < OpDescTable.size(); ++i) {
-    op_desc_entry &e = OpDescTable[i];
-    if (e.Swizzle == OpDesc) {
-      OpDescIndex = i;
-      break;
-    }
+int shbin_gen::AddOpDesc(const op_desc &Desc, int Limit) {
+  auto It = OpDescIndices.find(Desc.Value);
+  if (It != OpDescIndices.end() && It->second < Limit)
+    return It->second;
+  if ((int)OpDescTable.size() < Limit) {
+    OpDescTable.push_back((op_desc_entry){Desc.Value, 0});
+    OpDescIndices[Desc.Value] = OpDescTable.size() - 1;
+    return OpDescTable.size() - 1;
   }
-  if (OpDescIndex < 0) {
-    OpDescTable.push_back((op_desc_entry){OpDesc, 0});
-    OpDescIndex = OpDescTable.size() - 1;
+
+  // Out of room: any entry that agrees on every bit this instruction
+  // depends on will do.
+  for (int i = 0; i < Limit; ++i) {
+    if (((OpDescTable[i].Swizzle ^ Desc.Value) & Desc.Care) == 0)
+      return i;
   }
-  int Src1Reg = Instruction->Src1.Register +
-                (Instruction->Src1.TypeName.compare("mat4") == 0
-                     ? Instruction->Src1.Swizzle
-                     : 0);
+  return -1;
+}
+
+int shbin_gen::AssignOpDesc(neocode_instruction *Instruction) {
+  int Limit = Instruction->Type == neocode_instruction::MAD ? OP_DESC_MAD_LIMIT
+                                                            : OP_DESC_LIMIT;
+  int Index = AddOpDesc(GetOpDesc(Instruction), Limit);
+  if (Index >= 0)
+    return Index;
+
+  // A commutative instruction may still match with its sources swapped, as
+  // long as src1 fits the narrow src2 field.
+  switch (Instruction->Type) {
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+    if (GetSourceRegister(Instruction->Src1) < 0x20) {
+      std::swap(Instruction->Src1, Instruction->Src2);
+      Index = AddOpDesc(GetOpDesc(Instruction), Limit);
+      if (Index >= 0)
+        return Index;
+      std::swap(Instruction->Src1, Instruction->Src2);
+    }
+    break;
+  }
+  return -1;
+}
+
+int shbin_gen::GenInstruction(neocode_instruction *Instruction,
+                              int OpDescIndex, shbin_entry &Entry) {
+  if (Instruction->Type == neocode_instruction::EMPTY)
+    return -1;
+  int DstReg = Instruction->Dst.Register;
+  int Src1Reg = GetSourceRegister(Instruction->Src1);
+  int Src2Reg = GetSourceRegister(Instruction->Src2);
+  int Src3Reg = GetSourceRegister(Instruction->Src3);
+
+  // Only one source of the two-operand formats can reach the constant file.
+  // The inverted opcodes move that wide field over to src2.
+  bool Inverted = Src2Reg >= 0x20;
+  // That field is also the only one that can be read relative to a0 or aL.
+  int Index = Instruction->Src1.Relative | Instruction->Src2.Relative |
+              Instruction->Src3.Relative;
   switch (Instruction->Type) {
   case neocode_instruction::MOV:
-    return INSTR_1U(0x13, OpDescIndex, Instruction->Dst.Register, Src1Reg, 0);
+    return INSTR_1U(0x13, OpDescIndex, DstReg, Src1Reg, Index);
+
+  case neocode_instruction::ADD:
+    return INSTR_1(0x00, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::DP3:
+    return INSTR_1(0x01, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
 
   case neocode_instruction::DP4:
-    return INSTR_1(0x02, OpDescIndex, Instruction->Dst.Register,
-                   Src1Reg, Instruction->Src2.Register, 0);
+    return INSTR_1(0x02, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::DPH:
+    if (Inverted)
+      return INSTR_1I(0x18, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+    return INSTR_1(0x03, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
 
   case neocode_instruction::MUL:
-    return INSTR_1(0x08, OpDescIndex, Instruction->Dst.Register, Src1Reg,
-                   Instruction->Src2.Register, 0);
+    return INSTR_1(0x08, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::SGE:
+    if (Inverted)
+      return INSTR_1I(0x1A, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+    return INSTR_1(0x09, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::SLT:
+    if (Inverted)
+      return INSTR_1I(0x1B, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+    return INSTR_1(0x0A, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::FLR:
+    return INSTR_1U(0x0B, OpDescIndex, DstReg, Src1Reg, Index);
+
+  case neocode_instruction::MAX:
+    return INSTR_1(0x0C, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::MIN:
+    return INSTR_1(0x0D, OpDescIndex, DstReg, Src1Reg, Src2Reg, Index);
+
+  case neocode_instruction::MOVA:
+    return INSTR_1U(0x12, OpDescIndex, 0, Src1Reg, Index);
+
+  case neocode_instruction::MAD:
+    if (Src3Reg >= 0x20)
+      return INSTR_5I(0x6, OpDescIndex, DstReg, Src1Reg, Src2Reg, Src3Reg,
+                      Index);
+    return INSTR_5(0x7, OpDescIndex, DstReg, Src1Reg, Src2Reg, Src3Reg,
+                   Index);
 
   case neocode_instruction::RSQ:
-    return INSTR_1U(0x0F, OpDescIndex, Instruction->Dst.Register, Src1Reg, 0);
+    return INSTR_1U(0x0F, OpDescIndex, DstReg, Src1Reg, Index);
 
   case neocode_instruction::RCP:
-    return INSTR_1U(0x0E, OpDescIndex, Instruction->Dst.Register, Src1Reg, 0);
+    return INSTR_1U(0x0E, OpDescIndex, DstReg, Src1Reg, Index);
 
   case neocode_instruction::NOP:
     return 0x21 << 0x1A;
@@ -202,89 +447,306 @@ int shbin_gen::GenInstruction(neocode_instruction *Instruction) {
   case neocode_instruction::END:
     return 0x22 << 0x1A;
 
+  case neocode_instruction::CALL: {
+    int Callee = Entry.Functions[Instruction->ExtraData];
+    return INSTR_2(0x24, FunctionOffsets[Callee], FunctionSizes[Callee], 0, 0,
+                   0);
+  }
+
+  case neocode_instruction::LOOP: {
+    int Integer = Instruction->Src1.Register - 0x90;
+    return INSTR_2(0x29, LoopEnds[Instruction], 0, Integer, 0, 0);
+  }
+
+  case neocode_instruction::CMP: {
+    int Compare = Instruction->Dst.Const.Integer.X;
+    return INSTR_1C(0x17, OpDescIndex, Src1Reg, Src2Reg, Index, Compare,
+                    Compare);
+  }
+
+  case neocode_instruction::IFC: {
+    int Else = ElseStarts[Instruction];
+    int Length = IfEnds[Instruction] - Else;
+    return INSTR_2(0x28, Else, Length, 2, 0, 1);
+  }
+
+  case neocode_instruction::IFU: {
+    int Else = ElseStarts[Instruction];
+    int Length = IfEnds[Instruction] - Else;
+    int Bool = Src1Reg - 0xA0;
+    return INSTR_3(0x27, Else, Length, Bool);
+  }
+
+  case neocode_instruction::JMPU: {
+    int Bool = Src1Reg - 0xA0;
+    return INSTR_3(0x2D, IfEnds[Instruction], 0, Bool);
+  }
+
+  case neocode_instruction::CALLU: {
+    int Callee = Entry.Functions[Instruction->ExtraData];
+    int Bool = Src1Reg - 0xA0;
+    return INSTR_3(0x26, FunctionOffsets[Callee], FunctionSizes[Callee], Bool);
+  }
+
+  case neocode_instruction::SETEMIT: {
+    const neocode_constant &C = Instruction->Dst.Const;
+    return INSTR_SETEMIT(0x2B, C.Integer.X, C.Integer.Y, C.Integer.Z);
+  }
+
+  case neocode_instruction::EMIT:
+    return 0x2A << 0x1A;
+
   case neocode_instruction::EX2:
-    return INSTR_1U(0x05, OpDescIndex, Instruction->Dst.Register, Src1Reg, 0);
+    return INSTR_1U(0x05, OpDescIndex, DstReg, Src1Reg, Index);
 
   case neocode_instruction::LG2:
-    return INSTR_1U(0x06, OpDescIndex, Instruction->Dst.Register, Src1Reg, 0);
+    return INSTR_1U(0x06, OpDescIndex, DstReg, Src1Reg, Index);
 
   default:
     return -1;
   }
 }
 
-int shbin_gen::GetSymbolOffset(const std::string &s) {
-  int Off = 0;
-  for (std::string &str : SymbolTable) {
-    if (str.compare(s) == 0) {
-      return Off;
+int shbin_entry::GetSymbolOffset(const std::string &s) {
+  auto It = SymbolOffsets.find(s);
+  return It != SymbolOffsets.end() ? It->second : 0;
+}
+
+static void AppendVariable(std::string &Key, const neocode_variable &V) {
+  Key += std::to_string(V.Register) + "," + std::to_string(V.RegisterType) +
+         "," + std::to_string(V.Swizzle) + "," + std::to_string(V.Negate) +
+         "," + std::to_string(V.Relative) +
+         (V.TypeName.compare("mat4") == 0 ? "m " : " ");
+}
+
+// Everything the encoding of Function depends on. A call stands for its
+// callee's own key, so that helpers compiled alike in different programs
+// compare equal along with their callers.
+static std::string FunctionKey(neocode_program *Program,
+                               const neocode_function &Function,
+                               std::map<std::string, std::string> &Keys) {
+  auto It = Keys.find(Function.Name);
+  if (It != Keys.end())
+    return It->second;
+  std::string Key;
+  for (const neocode_instruction &In : Function.Instructions) {
+    Key += std::to_string(In.Type) + ":";
+    AppendVariable(Key, In.Dst);
+    AppendVariable(Key, In.Src1);
+    AppendVariable(Key, In.Src2);
+    AppendVariable(Key, In.Src3);
+    if (In.Type == neocode_instruction::CMP ||
+        In.Type == neocode_instruction::SETEMIT)
+      Key += std::to_string(In.Dst.Const.Integer.X) + "," +
+             std::to_string(In.Dst.Const.Integer.Y) + "," +
+             std::to_string(In.Dst.Const.Integer.Z);
+    for (const neocode_function &F : Program->Functions) {
+      if ((In.Type == neocode_instruction::CALL ||
+           In.Type == neocode_instruction::CALLU) &&
+          F.Name.compare(In.ExtraData) == 0)
+        Key += "{" + FunctionKey(Program, F, Keys) + "}";
     }
-    Off += str.length() + 1;
+    Key += ";";
   }
+  Keys[Function.Name] = Key;
+  return Key;
+}
 
-  return 0;
+// A function already in the blob, from this program or an earlier one, is
+// used again rather than copied.
+void shbin_gen::AddFunctions(int Entry) {
+  neocode_program *Program = Entries[Entry].Program;
+  std::map<std::string, std::string> Keys;
+  for (neocode_function &F : Program->Functions) {
+    std::string Key = FunctionKey(Program, F, Keys);
+    auto It = FunctionIndices.find(Key);
+    if (It == FunctionIndices.end()) {
+      It = FunctionIndices.insert({Key, (int)Functions.size()}).first;
+      Functions.push_back(F);
+      FunctionEntries.push_back(Entry);
+    }
+    Entries[Entry].Functions[F.Name] = It->second;
+  }
 }
 
 void shbin_gen::GenBlob() {
-  for (neocode_function &F : Program->Functions) {
-    if (F.Name.compare("main") == 0) {
-      DVLE.ExecEntryOffset = Blob.size();
+  int Offset = 0;
+  for (neocode_function &F : Functions) {
+    int Size = 0;
+    for (neocode_instruction &Instruction : F.Instructions) {
+      if (!IsMarker(Instruction.Type))
+        ++Size;
     }
-    label_entry E;
-    E.Id = 0;
-    // E.Id = LabelTable.size();
-    E.BlobOffset = Blob.size();
-    E.SymbolOffset = GetSymbolOffset(F.Name);
-    LabelTable.push_back(E);
+    FunctionOffsets.push_back(Offset);
+    FunctionSizes.push_back(Size);
+    Offset += Size;
+  }
+
+  // Descriptors are assigned up front, MAD first so that its entries land
+  // within its reach.
+  std::map<neocode_instruction *, int> OpDescs;
+  for (int Mad = 1; Mad >= 0; --Mad) {
+    for (neocode_function &F : Functions) {
+      for (neocode_instruction &Instruction : F.Instructions) {
+        if (!HasOpDesc(Instruction.Type) ||
+            (Instruction.Type == neocode_instruction::MAD) != (Mad == 1))
+          continue;
+        int Index = AssignOpDesc(&Instruction);
+        OpDescOverflow |= Index < 0;
+        OpDescs[&Instruction] = std::max(Index, 0);
+      }
+    }
+  }
+
+  // A LOOP names the last instruction of its body, the one in front of the
+  // matching ENDLOOP. An IFC or IFU names where its else part starts and how
+  // long that part is; without one the else part is empty and starts at the
+  // end. A JMPU names the end.
+  int Address = 0;
+  for (neocode_function &F : Functions) {
+    std::vector<neocode_instruction *> Loops, Ifs;
     for (neocode_instruction &Instruction : F.Instructions) {
-      int Instr = GenInstruction(&Instruction);
+      switch (Instruction.Type) {
+      case neocode_instruction::LOOP:
+        Loops.push_back(&Instruction);
+        break;
+      case neocode_instruction::ENDLOOP:
+        if (Loops.size()) {
+          LoopEnds[Loops.back()] = Address - 1;
+          Loops.pop_back();
+        }
+        break;
+      case neocode_instruction::IFC:
+      case neocode_instruction::IFU:
+      case neocode_instruction::JMPU:
+        Ifs.push_back(&Instruction);
+        break;
+      case neocode_instruction::ELSE:
+        if (Ifs.size())
+          ElseStarts[Ifs.back()] = Address;
+        break;
+      case neocode_instruction::ENDIF:
+        if (Ifs.size()) {
+          if (!ElseStarts.count(Ifs.back()))
+            ElseStarts[Ifs.back()] = Address;
+          IfEnds[Ifs.back()] = Address;
+          Ifs.pop_back();
+        }
+        break;
+      }
+      if (!IsMarker(Instruction.Type))
+        ++Address;
+    }
+  }
+
+  for (size_t u = 0; u < Functions.size(); ++u) {
+    for (neocode_instruction &Instruction : Functions[u].Instructions) {
+      int Instr = GenInstruction(&Instruction, OpDescs[&Instruction],
+                                 Entries[FunctionEntries[u]]);
       if (Instr != -1)
         Blob.push_back(Instr);
     }
-    // E.Id = LabelTable.size();
-    E.BlobOffset = Blob.size();
-    E.SymbolOffset = GetSymbolOffset(F.Name + "_end");
-    LabelTable.push_back(E);
+  }
+}
+
+void shbin_gen::GenLabels(shbin_entry &Entry) {
+  for (neocode_function &F : Entry.Program->Functions) {
+    int Index = Entry.Functions[F.Name];
+    int Offset = FunctionOffsets[Index];
+    int End = Offset + FunctionSizes[Index];
     if (F.Name.compare("main") == 0) {
-      // DVLE.ExecEntryEndOffset = Blob.size();
+      Entry.DVLE.ExecEntryOffset = Offset;
+      Entry.DVLE.ExecEntryEndOffset = End;
     }
+    label_entry E;
+    E.Id = 0;
+    // E.Id = LabelTable.size();
+    E.BlobOffset = Offset;
+    E.SymbolOffset = Entry.GetSymbolOffset(F.Name);
+    Entry.LabelTable.push_back(E);
+    // E.Id = LabelTable.size();
+    E.BlobOffset = End;
+    E.SymbolOffset = Entry.GetSymbolOffset(F.Name + "_end");
+    Entry.LabelTable.push_back(E);
   }
 }
 
-void shbin_gen::GenSymbolTable() {
+static bool IsUniformSymbol(const neocode_variable &V) {
+  return (V.Register < 0x20 && V.RegisterType <= 0) || (V.RegisterType < 0);
+}
+
+static std::string Reversed(const std::string &s) {
+  return std::string(s.rbegin(), s.rend());
+}
+
+// Every name is stored once. Names are laid out by their reversed spelling,
+// longest first within a shared ending, so a name that ends another one can
+// point into it and share its terminator.
+void shbin_entry::GenSymbolTable() {
+  std::vector<std::string> Names;
   for (neocode_function &F : Program->Functions) {
-    SymbolTable.push_back(F.Name);
-    SymbolTable.push_back(F.Name + "_end");
+    Names.push_back(Reversed(F.Name));
+    Names.push_back(Reversed(F.Name + "_end"));
   }
-
   for (neocode_variable &V : Program->Globals) {
-    if ((V.Register < 0x20 && V.RegisterType <= 0) || (V.RegisterType < 0))
-      SymbolTable.push_back(V.Name);
+    if (IsUniformSymbol(V))
+      Names.push_back(Reversed(V.Name));
+  }
+  std::sort(Names.begin(), Names.end(), std::greater<std::string>());
+  Names.erase(std::unique(Names.begin(), Names.end()), Names.end());
+
+  std::string Last;
+  int LastOffset = 0;
+  for (std::string &Name : Names) {
+    std::string Forward = Reversed(Name);
+    if (Last.compare(0, Name.length(), Name) == 0) {
+      SymbolOffsets[Forward] = LastOffset + Last.length() - Name.length();
+      continue;
+    }
+    Last = Name;
+    LastOffset = SymbolTable.size();
+    SymbolOffsets[Forward] = LastOffset;
+    SymbolTable.append(Forward);
+    SymbolTable.push_back('\0');
   }
 }
 
-void shbin_gen::GenOutputTable() {
+// Only the components the program writes are passed on, and an output it
+// never writes is left out.
+void shbin_entry::GenOutputTable() {
+  int Written[0x10] = {0};
+  for (neocode_function &F : Program->Functions) {
+    for (neocode_instruction &Instruction : F.Instructions) {
+      neocode_variable &Dst = Instruction.Dst;
+      if (Instruction.Type != neocode_instruction::EMPTY &&
+          Dst.RegisterType > 0 && Dst.Register < 0x10)
+        Written[Dst.Register] |= GetDstLanes(Dst.Swizzle);
+    }
+  }
+
   for (neocode_variable &V : Program->Globals) {
     if (V.RegisterType > 0) {
       output_entry E;
       E.Type = V.RegisterType - 1;
       E.Register = V.Register;
-      E.Mask = 0b1111;
-      OutputTable.push_back(E);
+      E.Mask = GetDstLanes(V.Swizzle) & Written[V.Register];
+      if (E.Mask)
+        OutputTable.push_back(E);
     }
   }
 }
 
-void shbin_gen::GenUniformTable() {
+// The table numbers the float uniforms from 0x10 and the bool ones from 0x78.
+void shbin_entry::GenUniformTable() {
   for (neocode_variable &V : Program->Globals) {
-    if ((V.Register < 0x20 && V.RegisterType <= 0) || (V.RegisterType < 0)) {
+    if (IsUniformSymbol(V)) {
       uniform_entry E;
       E.SymbolOffset = GetSymbolOffset(V.Name);
       E.StartReg = E.EndReg =
           (V.Register >= 0x20 ? V.Register - 0x10 : V.Register);
-      if (V.TypeName.compare("mat4") == 0) {
-        E.EndReg = E.StartReg + 3;
-      }
+      if (V.Register >= 0xA0)
+        E.StartReg = E.EndReg = V.Register - 0xA0 + 0x78;
+      E.EndReg = E.StartReg + V.RegisterCount() - 1;
       UniformTable.push_back(E);
     }
   }
@@ -307,10 +769,10 @@ static unsigned int f32tof24(float f) {
   return sign << 23 | exponent << 16 | mantissa;
 }
 
-void shbin_gen::GenConstTable() {
+void shbin_entry::GenConstTable() {
   {
     const_entry E;
-    E.Type = 2;
+    E.Type = CONST_TYPE_VEC4;
     E.Id = 95;
     E.X = f32tof24(0.0);
     E.Y = f32tof24(0.0);
@@ -319,10 +781,17 @@ void shbin_gen::GenConstTable() {
     ConstTable.push_back(E);
   }
   for (neocode_variable &V : Program->Globals) {
-    if (V.RegisterType == 0 && V.Register >= 0x20) {
+    if (V.RegisterType == 0 && V.Register >= 0x90) {
       const_entry E;
-      // TODO bool, ivec4
-      E.Type = 2;
+      E.Type = CONST_TYPE_IVEC4;
+      E.Id = V.Register - 0x90;
+      E.X = (V.Const.Integer.X & 0xFF) | (V.Const.Integer.Y & 0xFF) << 8 |
+            (V.Const.Integer.Z & 0xFF) << 16 | (V.Const.Integer.W & 0xFF) << 24;
+      E.Y = E.Z = E.W = 0;
+      ConstTable.push_back(E);
+    } else if (V.RegisterType == 0 && V.Register >= 0x20) {
+      const_entry E;
+      E.Type = CONST_TYPE_VEC4;
       E.Id = V.Register - 0x20;
       E.X = f32tof24(V.Const.Float.X);
       E.Y = f32tof24(V.Const.Float.Y);
@@ -333,20 +802,32 @@ void shbin_gen::GenConstTable() {
   }
 }
 
-void shbin_gen::WriteShbin(std::ostream &os) {
-  os.write((char *)&DVLB, sizeof(dvlb));
-  os.write((char *)&DVLP, sizeof(dvlp));
+// The tables follow the DVLE header in this order; their offsets count from
+// the header.
+int shbin_entry::Size() {
+  int Offset = sizeof(dvle);
+  DVLE.OutputRegTableOffset = Offset;
+  DVLE.OutputRegCount = OutputTable.size();
+  Offset += OutputTable.size() * sizeof(output_entry);
+  DVLE.ConstantTableOffset = Offset;
+  DVLE.ConstantCount = ConstTable.size();
+  Offset += ConstTable.size() * sizeof(const_entry);
+  DVLE.UniformRegTableOffset = Offset;
+  DVLE.UniformRegCount = UniformTable.size();
+  Offset += UniformTable.size() * sizeof(uniform_entry);
+  DVLE.LabelTableOffset = Offset;
+  DVLE.LabelCount = LabelTable.size();
+  Offset += LabelTable.size() * sizeof(label_entry);
+  DVLE.SymbolTableOffset = Offset;
+  DVLE.SymbolTableSize = SymbolTable.size();
+  return Offset + SymbolTable.size();
+}
+
+void shbin_entry::Write(std::ostream &os) {
   os.write((char *)&DVLE, sizeof(dvle));
-  for (int i : Blob) {
-    os.write((char *)&i, sizeof(i));
-  }
-  for (op_desc_entry &e : OpDescTable) {
-    os.write((char *)&e, sizeof(op_desc_entry));
-  }
   for (output_entry &e : OutputTable) {
     os.write((char *)&e, sizeof(output_entry));
   }
-
   for (const_entry &e : ConstTable) {
     os.write((char *)&e, sizeof(const_entry));
   }
@@ -356,61 +837,84 @@ void shbin_gen::WriteShbin(std::ostream &os) {
   for (label_entry &e : LabelTable) {
     os.write((char *)&e, sizeof(label_entry));
   }
-  for (std::string &s : SymbolTable) {
-    os.write(s.c_str(), s.length() + 1);
+  os.write(SymbolTable.data(), SymbolTable.size());
+}
+
+void shbin_gen::WriteShbin(std::ostream &os) {
+  DVLB.DVLECount = Entries.size();
+  DVLP.ShaderBlobOffset = sizeof(dvlp);
+  DVLP.ShaderBlobSize = Blob.size();
+  DVLP.ShaderInstructionExtTableOffset = sizeof(dvlp) + Blob.size() * 4;
+  DVLP.ShaderInstructionExtCount = OpDescTable.size();
+  DVLP.SymbolTableOffset = 0;
+
+  os.write((char *)&DVLB, sizeof(dvlb));
+  int Offset = sizeof(dvlb) + Entries.size() * 4 + sizeof(dvlp) +
+               Blob.size() * 4 + OpDescTable.size() * sizeof(op_desc_entry);
+  for (shbin_entry &Entry : Entries) {
+    os.write((char *)&Offset, sizeof(Offset));
+    Offset += Entry.Size();
+  }
+  os.write((char *)&DVLP, sizeof(dvlp));
+  for (int i : Blob) {
+    os.write((char *)&i, sizeof(i));
+  }
+  for (op_desc_entry &e : OpDescTable) {
+    os.write((char *)&e, sizeof(op_desc_entry));
+  }
+  for (shbin_entry &Entry : Entries) {
+    Entry.Write(os);
   }
 }
 
-void CGShbinGenerateCode(neocode_program *Program, std::ostream &os) {
+// Nothing is written when the blob does not fit the shader unit: a
+// descriptor table overflow would leave instructions with the swizzles and
+// masks of another.
+bool CGShbinGenerateCode(const std::vector<neocode_program *> &Programs,
+                         std::ostream &os) {
   shbin_gen Shbin;
-  Shbin.Program = Program;
-  Shbin.GenSymbolTable();
-  Shbin.GenConstTable();
-  Shbin.GenUniformTable();
-  Shbin.GenOutputTable();
-  Shbin.GenBlob();
-  Shbin.DVLB.DVLECount = 1;
-  Shbin.DVLB.DVLEOffset = sizeof(dvlb) + sizeof(dvlp);
-  Shbin.DVLP.ShaderBlobOffset = sizeof(dvlp) + sizeof(dvle);
-  Shbin.DVLP.ShaderBlobSize = Shbin.Blob.size();
-  Shbin.DVLP.ShaderInstructionExtTableOffset =
-      sizeof(dvlp) + sizeof(dvle) + Shbin.Blob.size() * 4;
-  Shbin.DVLP.ShaderInstructionExtCount = Shbin.OpDescTable.size();
-  Shbin.DVLP.SymbolTableOffset = 0;
-
-  Shbin.DVLE.ShaderType = 0;
-  Shbin.DVLE.ConstantTableOffset =
-      sizeof(dvle) + Shbin.Blob.size() * 4 +
-      Shbin.OpDescTable.size() * sizeof(op_desc_entry) +
-      Shbin.OutputTable.size() * sizeof(output_entry);
-  Shbin.DVLE.ConstantCount = Shbin.ConstTable.size();
-  Shbin.DVLE.LabelTableOffset =
-      sizeof(dvle) + Shbin.Blob.size() * 4 +
-      Shbin.OpDescTable.size() * sizeof(op_desc_entry) +
-      Shbin.OutputTable.size() * sizeof(output_entry) +
-      Shbin.ConstTable.size() * sizeof(const_entry) +
-      Shbin.UniformTable.size() * sizeof(uniform_entry);
-  Shbin.DVLE.LabelCount = Shbin.LabelTable.size();
-  Shbin.DVLE.OutputRegTableOffset =
-      sizeof(dvle) + Shbin.Blob.size() * 4 +
-      Shbin.OpDescTable.size() * sizeof(op_desc_entry);
-  Shbin.DVLE.OutputRegCount = Shbin.OutputTable.size();
-  Shbin.DVLE.UniformRegTableOffset =
-      sizeof(dvle) + Shbin.Blob.size() * 4 +
-      Shbin.OpDescTable.size() * sizeof(op_desc_entry) +
-      Shbin.OutputTable.size() * sizeof(output_entry) +
-      Shbin.ConstTable.size() * sizeof(const_entry);
-  Shbin.DVLE.UniformRegCount = Shbin.UniformTable.size();
-  Shbin.DVLE.SymbolTableOffset =
-      sizeof(dvle) + Shbin.Blob.size() * 4 +
-      Shbin.OpDescTable.size() * sizeof(op_desc_entry) +
-      Shbin.OutputTable.size() * sizeof(output_entry) +
-      Shbin.ConstTable.size() * sizeof(const_entry) +
-      Shbin.UniformTable.size() * sizeof(uniform_entry) +
-      Shbin.LabelTable.size() * sizeof(label_entry);
-  Shbin.DVLE.SymbolTableSize = 0;
-  for (std::string &s : Shbin.SymbolTable) {
-    Shbin.DVLE.SymbolTableSize += s.length() + 1;
+  for (neocode_program *Program : Programs) {
+    shbin_entry Entry;
+    Entry.Program = Program;
+    Entry.DVLE.ShaderType = Program->Options.Geometry ? 1 : 0;
+    Entry.GenSymbolTable();
+    Entry.GenConstTable();
+    Entry.GenUniformTable();
+    Entry.GenOutputTable();
+    Shbin.Entries.push_back(Entry);
+    Shbin.AddFunctions(Shbin.Entries.size() - 1);
   }
+  Shbin.GenBlob();
+  const neocode_options &Options = Programs[0]->Options;
+  if (Shbin.OpDescOverflow)
+    CGNeoReport(Options, "operand descriptor table overflow");
+  if (Shbin.Blob.size() > OPT_MAX_PROGRAM_SIZE)
+    CGNeoReport(Options,
+                "the program takes %d instructions, the shader unit holds %d",
+                (int)Shbin.Blob.size(), OPT_MAX_PROGRAM_SIZE);
+  if (Shbin.OpDescOverflow || Shbin.Blob.size() > OPT_MAX_PROGRAM_SIZE)
+    return false;
+  for (shbin_entry &Entry : Shbin.Entries)
+    Shbin.GenLabels(Entry);
   Shbin.WriteShbin(os);
+  return true;
+}
+
+bool CGShbinGenerateCode(neocode_program *Program, std::ostream &os) {
+  return CGShbinGenerateCode(std::vector<neocode_program *>(1, Program), os);
+}
+
+bool CGShbinFitsOpDescs(neocode_program *Program) {
+  shbin_gen Shbin;
+  for (int Mad = 1; Mad >= 0; --Mad) {
+    for (neocode_function &F : Program->Functions) {
+      for (neocode_instruction Instruction : F.Instructions) {
+        if (HasOpDesc(Instruction.Type) &&
+            (Instruction.Type == neocode_instruction::MAD) == (Mad == 1) &&
+            Shbin.AssignOpDesc(&Instruction) < 0)
+          return false;
+      }
+    }
+  }
+  return true;
 }
@@ -6,6 +6,7 @@
 #include <cstdlib>
 
 static void (*UserErrorHandler)(const char *Msg) = nullptr;
+static neocode_options UserOptions;
 
 static void ErrorCallback(const std::string &ErrMsg,
                           const std::string &OffendingLine, int LineNumber,
@@ -14,12 +15,21 @@ static void ErrorCallback(const std::string &ErrMsg,
   if (UserErrorHandler) UserErrorHandler(Msg.c_str());
 }
 
+static void CodegenErrorCallback(const std::string &ErrMsg) {
+  std::string Msg = "error: " + ErrMsg + "\n";
+  if (UserErrorHandler) UserErrorHandler(Msg.c_str());
+}
+
 extern "C" {
 
 void SelenaSetErrorHandler(void (*ErrorFunc)(const char *)) {
   UserErrorHandler = ErrorFunc;
 }
 
+void SelenaSetOptimizationLevel(int Level) {
+  UserOptions.OptLevel = Level;
+}
+
 char *SelenaCompileShaderSource(const char *Src, int *BinSize) {
   symtable SymbolTable;
   lexer_state Lexer;
@@ -29,9 +39,19 @@ char *SelenaCompileShaderSource(const char *Src, int *BinSize) {
   parse_node RootNode = Parser.ParseTranslationUnit();
 
   ast_node ASTRoot = ast::BuildTranslationUnit(RootNode, &SymbolTable);
-  neocode_program Program = CGNeoBuildProgramInstance(&ASTRoot, &SymbolTable);
+  neocode_options Options = UserOptions;
+  Options.ErrorFunc = CodegenErrorCallback;
+  neocode_program Program =
+      CGNeoBuildProgramInstance(&ASTRoot, &SymbolTable, Options);
+  if (Program.ErrorCount) {
+    *BinSize = 0;
+    return nullptr;
+  }
   std::stringstream ss;
-  CGShbinGenerateCode(&Program, ss);
+  if (!CGShbinGenerateCode(&Program, ss)) {
+    *BinSize = 0;
+    return nullptr;
+  }
   char *Shbin = (char *)malloc(ss.str().length() + 1);
   memcpy(Shbin, ss.str().c_str(), ss.str().length());
   *BinSize = ss.str().length();
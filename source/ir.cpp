@@ -0,0 +1,461 @@
+#include "ir.h"
+
+ir_operand IRValue(int Value) {
+  ir_operand Op;
+  Op.Kind = ir_operand::VALUE;
+  Op.Value = Value;
+  return Op;
+}
+
+// A global that shares its register, such as a packed attribute, is read
+// through its Swizzle.
+ir_operand IRGlobal(const neocode_variable &V) {
+  ir_operand Op;
+  Op.Kind = ir_operand::GLOBAL;
+  Op.Global = V;
+  if (V.Swizzle && V.TypeName.compare("mat4") != 0) {
+    Op.Swizzle = V.Swizzle;
+    Op.Global.Swizzle = 0;
+    Op.Global.Name.clear();
+  }
+  return Op;
+}
+
+ir_operand IRConstant(float X, float Y, float Z, float W) {
+  ir_operand Op;
+  Op.Kind = ir_operand::CONSTANT;
+  Op.Constant[0] = X;
+  Op.Constant[1] = Y;
+  Op.Constant[2] = Z;
+  Op.Constant[3] = W;
+  return Op;
+}
+
+// The register Offset past the start of a uniform array, on its own.
+neocode_variable IRArrayElement(const neocode_variable &Array, int Offset) {
+  neocode_variable V = Array;
+  V.Register += Offset;
+  V.Count = 0;
+  V.Swizzle = 0;
+  if (Offset)
+    V.Name.clear();
+  return V;
+}
+
+int IRSwizzleSelector(const ir_operand &Op, int Lane) {
+  if (Op.Swizzle == 0)
+    return Lane;
+  int Index = ((Op.Swizzle >> (Lane * 4)) & 0b1111) - 1;
+  return Index < 0 ? 0 : Index;
+}
+
+int IRSourceCount(const ir_instruction &In) {
+  switch (In.Op) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::RCP:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::FLR:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::IFU:
+  case IR_STORE:
+  case IR_LOAD:
+    return 1;
+
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::IFC:
+  case IR_PHI:
+    return 2;
+
+  case neocode_instruction::MAD:
+    return 3;
+  }
+  return 0;
+}
+
+bool IRHasSideEffects(const ir_instruction &In) {
+  switch (In.Op) {
+  case neocode_instruction::NOP:
+  case neocode_instruction::END:
+  case neocode_instruction::CALL:
+  case neocode_instruction::INVOKE:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::LOOP:
+  case neocode_instruction::IFC:
+  case neocode_instruction::IFU:
+  case neocode_instruction::SETEMIT:
+  case neocode_instruction::EMIT:
+  case IR_PARAM:
+  case IR_STORE:
+    return true;
+  }
+  return false;
+}
+
+// An IFC or IFU, which ends its block and splits it into two parts.
+bool IRIsBranch(const ir_instruction &In) {
+  return In.Op == neocode_instruction::IFC || In.Op == neocode_instruction::IFU;
+}
+
+bool IRIsCommutative(int Op) {
+  switch (Op) {
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+    return true;
+  }
+  return false;
+}
+
+bool IRIsComponentwise(int Op) {
+  switch (Op) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::MAD:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::FLR:
+    return true;
+  }
+  return false;
+}
+
+// The lanes of source Index that In reads, before its swizzle is applied.
+int IRReadLanes(const ir_instruction &In, int Index) {
+  switch (In.Op) {
+  case neocode_instruction::DP3:
+    return 0b0111;
+  case neocode_instruction::DP4:
+    return 0b1111;
+  case neocode_instruction::DPH:
+    return Index == 0 ? 0b0111 : 0b1111;
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::IFC:
+  case neocode_instruction::IFU:
+  case IR_LOAD:
+    return 0b0001;
+  }
+  return In.Mask;
+}
+
+// The components of Op's source that reading it in Lanes touches.
+int IROperandComponents(const ir_operand &Op, int Lanes) {
+  int Components = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (Lanes & (1 << i))
+      Components |= 1 << IRSwizzleSelector(Op, i);
+  }
+  return Components;
+}
+
+bool IRSameOperand(const ir_operand &A, const ir_operand &B) {
+  if (A.Kind != B.Kind || A.Swizzle != B.Swizzle || A.Negate != B.Negate)
+    return false;
+  switch (A.Kind) {
+  case ir_operand::NONE:
+    return true;
+  case ir_operand::VALUE:
+    return A.Value == B.Value;
+  case ir_operand::GLOBAL:
+    return A.Global.RegisterType == B.Global.RegisterType &&
+           A.Global.Register == B.Global.Register &&
+           A.Global.Swizzle == B.Global.Swizzle;
+  case ir_operand::CONSTANT:
+    for (int i = 0; i < 4; ++i) {
+      if (A.Constant[i] != B.Constant[i])
+        return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+std::vector<ir_operand *> IROperands(ir_instruction &In) {
+  std::vector<ir_operand *> Operands;
+  for (int i = 0; i < IRSourceCount(In); ++i)
+    Operands.push_back(&In.Src[i]);
+  if (In.Prior.Kind != ir_operand::NONE)
+    Operands.push_back(&In.Prior);
+  for (ir_operand &Arg : In.Args)
+    Operands.push_back(&Arg);
+  return Operands;
+}
+
+// The operand Use reads a value that turned out to be Def: read Def instead,
+// with both swizzles and negations applied.
+ir_operand IRCompose(const ir_operand &Use, const ir_operand &Def) {
+  ir_operand Op = Def;
+  Op.Negate = Use.Negate != Def.Negate;
+  if (Use.Swizzle == 0 && Def.Swizzle == 0)
+    return Op;
+  Op.Swizzle = 0;
+  for (int i = 0; i < 4; ++i)
+    Op.Swizzle |= (IRSwizzleSelector(Def, IRSwizzleSelector(Use, i)) + 1)
+                  << (i * 4);
+  if (Op.Swizzle == 0x4321)
+    Op.Swizzle = 0;
+  return Op;
+}
+
+void IRReplaceValue(ir_function *Function, int Value, const ir_operand &With) {
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      for (ir_operand *Op : IROperands(In)) {
+        if (Op->Kind == ir_operand::VALUE && Op->Value == Value)
+          *Op = IRCompose(*Op, With);
+      }
+    }
+  }
+}
+
+void IRCountUses(ir_function *Function, std::vector<int> &Uses) {
+  Uses.assign(Function->ValueCount, 0);
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      for (ir_operand *Op : IROperands(In)) {
+        if (Op->Kind == ir_operand::VALUE)
+          ++Uses[Op->Value];
+      }
+    }
+  }
+}
+
+// Loops are found by their back edges, which are the only edges to a block
+// that is not further down.
+void IRFindLoops(ir_function *Function, std::vector<ir_loop> &Loops) {
+  Loops.clear();
+  for (size_t b = 0; b < Function->Blocks.size(); ++b) {
+    for (int Successor : Function->Blocks[b].Successors) {
+      if (Successor <= (int)b)
+        Loops.push_back({Successor - 1, Successor, (int)b});
+    }
+  }
+}
+
+// Predecessors of every block in block order, back edges included.
+void IRFindPredecessors(ir_function *Function,
+                        std::vector<std::vector<int>> &Predecessors) {
+  Predecessors.assign(Function->Blocks.size(), std::vector<int>());
+  for (size_t b = 0; b < Function->Blocks.size(); ++b) {
+    for (int Successor : Function->Blocks[b].Successors)
+      Predecessors[Successor].push_back(b);
+  }
+}
+
+static const char *OpName(int Op) {
+  switch (Op) {
+  case neocode_instruction::MOV:
+    return "mov";
+  case neocode_instruction::MUL:
+    return "mul";
+  case neocode_instruction::RSQ:
+    return "rsq";
+  case neocode_instruction::RCP:
+    return "rcp";
+  case neocode_instruction::NOP:
+    return "nop";
+  case neocode_instruction::END:
+    return "end";
+  case neocode_instruction::EX2:
+    return "exp";
+  case neocode_instruction::LG2:
+    return "log";
+  case neocode_instruction::DP4:
+    return "dp4";
+  case neocode_instruction::INVOKE:
+    return "invoke";
+  case neocode_instruction::ADD:
+    return "add";
+  case neocode_instruction::DP3:
+    return "dp3";
+  case neocode_instruction::DPH:
+    return "dph";
+  case neocode_instruction::MAD:
+    return "mad";
+  case neocode_instruction::MIN:
+    return "min";
+  case neocode_instruction::MAX:
+    return "max";
+  case neocode_instruction::FLR:
+    return "flr";
+  case neocode_instruction::SLT:
+    return "slt";
+  case neocode_instruction::SGE:
+    return "sge";
+  case neocode_instruction::MOVA:
+    return "mova";
+  case neocode_instruction::LOOP:
+    return "loop";
+  case neocode_instruction::IFC:
+    return "ifc";
+  case neocode_instruction::IFU:
+    return "ifu";
+  case neocode_instruction::SETEMIT:
+    return "setemit";
+  case neocode_instruction::EMIT:
+    return "emit";
+  case IR_PARAM:
+    return "param";
+  case IR_STORE:
+    return "store";
+  case IR_PHI:
+    return "phi";
+  case IR_LOAD:
+    return "load";
+  case IR_COUNTER:
+    return "counter";
+  }
+  return "?";
+}
+
+static std::string MaskString(int Mask) {
+  std::string S;
+  for (int i = 0; i < 4; ++i) {
+    if (Mask & (1 << i))
+      S += "xyzw"[i];
+  }
+  return S;
+}
+
+static std::string OperandString(const ir_operand &Op) {
+  std::string S = Op.Negate ? "-" : "";
+  switch (Op.Kind) {
+  case ir_operand::NONE:
+    return "undef";
+  case ir_operand::VALUE:
+    S += "%" + std::to_string(Op.Value);
+    break;
+  case ir_operand::GLOBAL:
+    if (Op.Global.Name.empty() && Op.Global.Register >= 0x20)
+      S += "c" + std::to_string(Op.Global.Register - 0x20);
+    S += Op.Global.Name;
+    if (Op.Global.TypeName.compare("mat4") == 0)
+      S += "[" + std::to_string(Op.Global.Swizzle) + "]";
+    break;
+  case ir_operand::CONSTANT:
+    S += "(" + std::to_string(Op.Constant[0]) + ", " +
+         std::to_string(Op.Constant[1]) + ", " +
+         std::to_string(Op.Constant[2]) + ", " +
+         std::to_string(Op.Constant[3]) + ")";
+    break;
+  }
+  if (Op.Swizzle) {
+    S += ".";
+    for (int i = 0; i < 4; ++i)
+      S += "xyzw"[IRSwizzleSelector(Op, i)];
+  }
+  return S;
+}
+
+static std::string LocationString(const neocode_variable &V) {
+  if (V.Relative == 3)
+    return "aL";
+  if (V.RegisterType > 0)
+    return V.Name;
+  return "r" + std::to_string(V.Register - 0x10);
+}
+
+void IRPrintFunction(ir_function *Function, std::ostream &os) {
+  os << Function->Name << ":" << std::endl;
+  for (size_t b = 0; b < Function->Blocks.size(); ++b) {
+    ir_block &B = Function->Blocks[b];
+    os << " block" << b << ":";
+    for (int Successor : B.Successors)
+      os << " -> block" << Successor;
+    os << std::endl;
+    for (ir_instruction &In : B.Instructions) {
+      os << "  ";
+      if (In.Result >= 0) {
+        os << "%" << In.Result;
+        if (In.Mask != 0b1111)
+          os << "." << MaskString(In.Mask);
+        os << " = ";
+      }
+      os << OpName(In.Op);
+      if (In.Op == IR_STORE) {
+        os << " " << In.Dst.Name;
+        if (In.Mask != 0b1111)
+          os << "." << MaskString(In.Mask);
+        os << ",";
+      }
+      if (In.Op == IR_LOAD) {
+        os << " " << In.Dst.Name;
+        if (In.Dst.TypeName.compare("mat4") == 0)
+          os << "[" << In.Dst.Swizzle << "]";
+        os << ",";
+      }
+      if (In.Name.size())
+        os << " " << In.Name;
+      if (In.Op == neocode_instruction::LOOP)
+        os << " " << In.Dst.Const.Integer.X + 1 << " times, aL = "
+           << In.Dst.Const.Integer.Y << " + " << In.Dst.Const.Integer.Z;
+      if (In.Op == neocode_instruction::SETEMIT)
+        os << " " << In.Dst.Const.Integer.X
+           << (In.Dst.Const.Integer.Y ? " prim" : "")
+           << (In.Dst.Const.Integer.Z ? " inv" : "");
+      if (In.Op == neocode_instruction::IFC) {
+        static const char *Names[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+        os << " " << Names[In.Dst.Const.Integer.X];
+      }
+      std::vector<ir_operand *> Operands;
+      for (int i = 0; i < IRSourceCount(In); ++i)
+        Operands.push_back(&In.Src[i]);
+      for (ir_operand &Arg : In.Args)
+        Operands.push_back(&Arg);
+      for (size_t i = 0; i < Operands.size(); ++i)
+        os << (i ? ", " : " ") << OperandString(*Operands[i]);
+      if (In.Prior.Kind != ir_operand::NONE)
+        os << " (" << OperandString(In.Prior) << ")";
+      if (In.Result >= 0 && (size_t)In.Result < Function->Locations.size())
+        os << "  ; " << LocationString(Function->Locations[In.Result]);
+      os << std::endl;
+    }
+  }
+}
+
+struct ir_pass {
+  const char *Name;
+  int OptLevel;
+  void (*Run)(ir_function *Function);
+};
+
+// Passes run in order; each one only relies on the IR invariants, so any of
+// them can be dropped or repeated. Legalization and register allocation
+// always run last as lowering depends on them.
+static const ir_pass Passes[] = {
+    {"fold", 1, IRFoldConstants},
+    {"gvn", 1, IREliminateCommonSubexpressions},
+    {"licm", 1, IRHoistLoopInvariants},
+    {"preshader", 1, IRExtractPreshader},
+    {"pack", 1, IRPackLanes},
+    {"gvn", 1, IREliminateCommonSubexpressions},
+    {"dce", 1, IREliminateDeadCode},
+    {"sink", 0, IRSinkLoads},
+    {"legalize", 0, IRLegalizeOperands},
+    {"regalloc", 0, IRAllocateRegisters},
+};
+
+void IRRunPasses(ir_function *Function, const neocode_options &Options) {
+  for (const ir_pass &Pass : Passes) {
+    if (Options.OptLevel >= Pass.OptLevel)
+      Pass.Run(Function);
+  }
+}
@@ -0,0 +1,207 @@
+#include "ir.h"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+// Value numbering works per component: every lane of every value gets the
+// number of the computation that produced it, so a value can be found again
+// even when it was computed as part of a wider vector, in other lanes or with
+// the operands swapped.
+struct gvn_state {
+  std::unordered_map<std::string, int> Numbers;
+  std::vector<std::vector<int>> Lanes;
+
+  int Number(const std::string &Key) {
+    auto It = Numbers.find(Key);
+    if (It != Numbers.end())
+      return It->second;
+    int N = Numbers.size();
+    Numbers[Key] = N;
+    return N;
+  }
+};
+
+typedef std::unordered_map<int, std::vector<std::pair<int, int>>> gvn_table;
+
+static bool IsScalar(int Op) {
+  switch (Op) {
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+    return true;
+  }
+  return false;
+}
+
+static int OperandLane(gvn_state &S, const ir_operand &Op, int Lane) {
+  int Component = IRSwizzleSelector(Op, Lane);
+  int N = -1;
+  switch (Op.Kind) {
+  case ir_operand::VALUE:
+    N = S.Lanes[Op.Value][Component];
+    break;
+  case ir_operand::GLOBAL:
+    N = S.Number("g" + std::to_string(Op.Global.RegisterType) + "/" +
+                 std::to_string(Op.Global.Register) + "/" +
+                 std::to_string(Op.Global.Swizzle) + "." +
+                 std::to_string(Component));
+    break;
+  case ir_operand::CONSTANT: {
+    float V = Op.Negate ? -Op.Constant[Component] : Op.Constant[Component];
+    unsigned int Bits;
+    memcpy(&Bits, &V, sizeof(Bits));
+    return S.Number("k" + std::to_string(Bits));
+  }
+  }
+  if (Op.Negate && N >= 0)
+    N = S.Number("-" + std::to_string(N));
+  return N;
+}
+
+static std::vector<int> Number(gvn_state &S, const ir_instruction &In) {
+  std::vector<int> Lanes(4, -1);
+  int Sources = IRSourceCount(In);
+  for (int i = 0; i < 4; ++i) {
+    if (!(In.Mask & (1 << i))) {
+      if (In.Prior.Kind != ir_operand::NONE)
+        Lanes[i] = OperandLane(S, In.Prior, i);
+      continue;
+    }
+
+    if (IRIsComponentwise(In.Op)) {
+      std::vector<int> Src;
+      for (int s = 0; s < Sources; ++s)
+        Src.push_back(OperandLane(S, In.Src[s], i));
+      if (In.Op == neocode_instruction::MOV) {
+        Lanes[i] = Src[0];
+        continue;
+      }
+      if (IRIsCommutative(In.Op) || In.Op == neocode_instruction::MAD)
+        std::sort(Src.begin(), Src.begin() + 2);
+      std::string Key = std::to_string(In.Op);
+      for (int N : Src)
+        Key += ":" + std::to_string(N);
+      Lanes[i] = S.Number(Key);
+    } else if (IsScalar(In.Op)) {
+      // Every written lane holds the same result.
+      std::vector<std::string> Src;
+      for (int s = 0; s < Sources; ++s) {
+        std::string Read;
+        for (int c = 0; c < 4; ++c)
+          Read += std::to_string(OperandLane(S, In.Src[s], c)) + ",";
+        Src.push_back(Read);
+      }
+      if (IRIsCommutative(In.Op))
+        std::sort(Src.begin(), Src.end());
+      std::string Key = std::to_string(In.Op);
+      for (std::string &Read : Src)
+        Key += ":" + Read;
+      Lanes[i] = S.Number(Key);
+    } else if (In.Op == IR_LOAD) {
+      Lanes[i] = S.Number("l" + std::to_string(In.Dst.Register) + "/" +
+                          std::to_string(In.Dst.Swizzle) + ":" +
+                          std::to_string(OperandLane(S, In.Src[0], 0)) + "." +
+                          std::to_string(i));
+    } else {
+      Lanes[i] = S.Number("v" + std::to_string(In.Result) + "." +
+                          std::to_string(i));
+    }
+  }
+  return Lanes;
+}
+
+// Look for an available value that holds every defined lane of Lanes.
+static bool Find(gvn_state &S, gvn_table &Available,
+                 const std::vector<int> &Lanes, ir_operand &With) {
+  int First = 0;
+  while (First < 4 && Lanes[First] < 0)
+    ++First;
+  if (First == 4 || !Available.count(Lanes[First]))
+    return false;
+  for (const std::pair<int, int> &Candidate : Available[Lanes[First]]) {
+    std::vector<int> &Held = S.Lanes[Candidate.first];
+    ir_operand Op = IRValue(Candidate.first);
+    bool Found = true;
+    for (int i = 0; i < 4 && Found; ++i) {
+      int Component = Lanes[i] < 0 ? i : 0;
+      while (Lanes[i] >= 0 && Component < 4 && Held[Component] != Lanes[i])
+        ++Component;
+      Found = Component < 4;
+      Op.Swizzle |= (Component + 1) << (i * 4);
+    }
+    if (!Found)
+      continue;
+    if (Op.Swizzle == 0x4321)
+      Op.Swizzle = 0;
+    With = Op;
+    return true;
+  }
+  return false;
+}
+
+static void NumberBlock(ir_function *Function, gvn_state &S, int Block,
+                        gvn_table &Available) {
+  std::vector<ir_instruction> &Ins = Function->Blocks[Block].Instructions;
+  for (size_t i = 0; i < Ins.size(); ++i) {
+    ir_instruction &In = Ins[i];
+    if (In.Result < 0)
+      continue;
+    std::vector<int> Lanes = Number(S, In);
+    S.Lanes[In.Result] = Lanes;
+    ir_operand With;
+    if (!IRHasSideEffects(In) && Find(S, Available, Lanes, With)) {
+      int Value = In.Result;
+      Ins.erase(Ins.begin() + i--);
+      IRReplaceValue(Function, Value, With);
+      continue;
+    }
+    for (int l = 0; l < 4; ++l) {
+      if (Lanes[l] >= 0)
+        Available[Lanes[l]].push_back(std::make_pair(In.Result, l));
+    }
+  }
+}
+
+// A block sees everything its immediate dominator saw. Blocks come in program
+// order and every edge but a loop's back edge points down, so the dominator
+// is where the chains of dominators of all forward predecessors meet; that
+// of a loop header is the block entering the loop.
+void IREliminateCommonSubexpressions(ir_function *Function) {
+  gvn_state S;
+  S.Lanes.assign(Function->ValueCount, std::vector<int>(4, -1));
+  size_t Count = Function->Blocks.size();
+  std::vector<std::vector<int>> Predecessors;
+  IRFindPredecessors(Function, Predecessors);
+  std::vector<int> Dominator(Count, -1);
+  for (size_t b = 1; b < Count; ++b) {
+    int D = -1;
+    for (int P : Predecessors[b]) {
+      if (P >= (int)b)
+        continue;
+      if (D < 0) {
+        D = P;
+        continue;
+      }
+      while (D != P) {
+        if (D > P)
+          D = Dominator[D];
+        else
+          P = Dominator[P];
+      }
+    }
+    Dominator[b] = D;
+  }
+
+  std::vector<gvn_table> Exit(Count);
+  for (size_t b = 0; b < Count; ++b) {
+    gvn_table Available;
+    if (Dominator[b] >= 0)
+      Available = Exit[Dominator[b]];
+    NumberBlock(Function, S, b, Available);
+    Exit[b] = Available;
+  }
+}
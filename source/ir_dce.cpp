@@ -0,0 +1,41 @@
+#include "ir.h"
+
+// Everything a side effect depends on is live. Marking from those rather
+// than counting uses also drops the phis of a loop that only feed each other.
+void IREliminateDeadCode(ir_function *Function) {
+  std::vector<ir_instruction *> Definition(Function->ValueCount, nullptr);
+  std::vector<ir_instruction *> Work;
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      if (In.Result >= 0)
+        Definition[In.Result] = &In;
+      if (IRHasSideEffects(In))
+        Work.push_back(&In);
+    }
+  }
+
+  std::vector<int> Live(Function->ValueCount, 0);
+  for (ir_instruction *In : Work) {
+    if (In->Result >= 0)
+      Live[In->Result] = 1;
+  }
+  while (Work.size()) {
+    ir_instruction *In = Work.back();
+    Work.pop_back();
+    for (ir_operand *Op : IROperands(*In)) {
+      if (Op->Kind != ir_operand::VALUE || Live[Op->Value])
+        continue;
+      Live[Op->Value] = 1;
+      if (Definition[Op->Value])
+        Work.push_back(Definition[Op->Value]);
+    }
+  }
+
+  for (ir_block &B : Function->Blocks) {
+    for (size_t i = B.Instructions.size(); i-- > 0;) {
+      ir_instruction &In = B.Instructions[i];
+      if (!IRHasSideEffects(In) && !(In.Result >= 0 && Live[In.Result]))
+        B.Instructions.erase(B.Instructions.begin() + i);
+    }
+  }
+}
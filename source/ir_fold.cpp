@@ -0,0 +1,228 @@
+#include "ir.h"
+#include <cmath>
+
+static float ConstantLane(const ir_operand &Op, int Lane) {
+  float V = Op.Constant[IRSwizzleSelector(Op, Lane)];
+  return Op.Negate ? -V : V;
+}
+
+static bool Evaluate(const ir_instruction &In, float *R) {
+  float A[4], B[4], C[4];
+  for (int i = 0; i < 4; ++i) {
+    A[i] = ConstantLane(In.Src[0], i);
+    B[i] = ConstantLane(In.Src[1], i);
+    C[i] = ConstantLane(In.Src[2], i);
+  }
+
+  float Scalar;
+  switch (In.Op) {
+  case neocode_instruction::MOV:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i];
+    return true;
+  case neocode_instruction::ADD:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] + B[i];
+    return true;
+  case neocode_instruction::MUL:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] * B[i];
+    return true;
+  case neocode_instruction::MAD:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] * B[i] + C[i];
+    return true;
+  case neocode_instruction::MIN:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] < B[i] ? A[i] : B[i];
+    return true;
+  case neocode_instruction::MAX:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] > B[i] ? A[i] : B[i];
+    return true;
+  case neocode_instruction::SLT:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] < B[i] ? 1.0f : 0.0f;
+    return true;
+  case neocode_instruction::SGE:
+    for (int i = 0; i < 4; ++i)
+      R[i] = A[i] >= B[i] ? 1.0f : 0.0f;
+    return true;
+  case neocode_instruction::FLR:
+    for (int i = 0; i < 4; ++i)
+      R[i] = floorf(A[i]);
+    return true;
+
+  case neocode_instruction::DP3:
+    Scalar = A[0] * B[0] + A[1] * B[1] + A[2] * B[2];
+    break;
+  case neocode_instruction::DP4:
+    Scalar = A[0] * B[0] + A[1] * B[1] + A[2] * B[2] + A[3] * B[3];
+    break;
+  case neocode_instruction::DPH:
+    Scalar = A[0] * B[0] + A[1] * B[1] + A[2] * B[2] + B[3];
+    break;
+  case neocode_instruction::RCP:
+    Scalar = 1.0f / A[0];
+    break;
+  case neocode_instruction::RSQ:
+    Scalar = 1.0f / sqrtf(A[0]);
+    break;
+  case neocode_instruction::EX2:
+    Scalar = exp2f(A[0]);
+    break;
+  case neocode_instruction::LG2:
+    Scalar = log2f(A[0]);
+    break;
+
+  default:
+    return false;
+  }
+  R[0] = R[1] = R[2] = R[3] = Scalar;
+  return true;
+}
+
+// True if every component In writes reads Value from the constant Op.
+static bool IsSplat(const ir_instruction &In, const ir_operand &Op,
+                    float Value) {
+  if (Op.Kind != ir_operand::CONSTANT)
+    return false;
+  for (int i = 0; i < 4; ++i) {
+    if ((In.Mask & (1 << i)) && ConstantLane(Op, i) != Value)
+      return false;
+  }
+  return true;
+}
+
+// Find an operand that computes the same components as In. Whole is cleared
+// when In also carries components over from Prior, in which case the result
+// can only replace the computation and not the value itself.
+static bool Simplify(const ir_instruction &In, ir_operand &With,
+                     bool &Whole) {
+  Whole = In.Mask == 0b1111 || In.Prior.Kind == ir_operand::NONE;
+
+  bool AllConstant = true;
+  for (int i = 0; i < IRSourceCount(In); ++i)
+    AllConstant &= In.Src[i].Kind == ir_operand::CONSTANT;
+  float R[4];
+  if (AllConstant && Evaluate(In, R)) {
+    if (!Whole && In.Prior.Kind == ir_operand::CONSTANT) {
+      for (int i = 0; i < 4; ++i) {
+        if (!(In.Mask & (1 << i)))
+          R[i] = ConstantLane(In.Prior, i);
+      }
+      Whole = true;
+    }
+    With = IRConstant(R[0], R[1], R[2], R[3]);
+    return Whole || In.Op != neocode_instruction::MOV;
+  }
+
+  switch (In.Op) {
+  case neocode_instruction::MOV:
+    With = In.Src[0];
+    return Whole;
+
+  // A variable the loop does not actually change, or that both parts of an
+  // if leave the same.
+  case IR_PHI:
+    With = In.Src[0];
+    if (In.Src[1].Kind == ir_operand::VALUE && In.Src[1].Value == In.Result &&
+        In.Src[1].Swizzle == 0 && !In.Src[1].Negate)
+      return true;
+    return IRSameOperand(In.Src[0], In.Src[1]);
+
+  // An index that turned out constant names the element itself. One out of
+  // the bounds of the array is left to the address register.
+  case IR_LOAD: {
+    if (In.Src[0].Kind != ir_operand::CONSTANT)
+      return false;
+    int Offset = (int)ConstantLane(In.Src[0], 0) + In.Dst.Swizzle;
+    if (Offset < 0 || Offset >= In.Dst.RegisterCount())
+      return false;
+    neocode_variable Element = IRArrayElement(In.Dst, Offset);
+    Element.TypeName = "vec4";
+    With = IRGlobal(Element);
+    return true;
+  }
+
+  case neocode_instruction::MUL:
+    for (int i = 0; i < 2; ++i) {
+      if (IsSplat(In, In.Src[i], 1.0f)) {
+        With = In.Src[1 - i];
+        return true;
+      }
+      if (IsSplat(In, In.Src[i], 0.0f)) {
+        With = IRConstant(0, 0, 0, 0);
+        return true;
+      }
+    }
+    return false;
+
+  case neocode_instruction::ADD:
+    for (int i = 0; i < 2; ++i) {
+      if (IsSplat(In, In.Src[i], 0.0f)) {
+        With = In.Src[1 - i];
+        return true;
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+// A MAD with a factor of one or zero, or nothing to add, is the ADD, MOV or
+// MUL it comes down to.
+static bool Reduce(ir_instruction &In) {
+  if (In.Op != neocode_instruction::MAD)
+    return false;
+  for (int i = 0; i < 2; ++i) {
+    if (IsSplat(In, In.Src[i], 1.0f)) {
+      In.Op = neocode_instruction::ADD;
+      In.Src[0] = In.Src[1 - i];
+      In.Src[1] = In.Src[2];
+      In.Src[2] = ir_operand();
+      return true;
+    }
+    if (IsSplat(In, In.Src[i], 0.0f)) {
+      In.Op = neocode_instruction::MOV;
+      In.Src[0] = In.Src[2];
+      In.Src[1] = In.Src[2] = ir_operand();
+      return true;
+    }
+  }
+  if (IsSplat(In, In.Src[2], 0.0f)) {
+    In.Op = neocode_instruction::MUL;
+    In.Src[2] = ir_operand();
+    return true;
+  }
+  return false;
+}
+
+void IRFoldConstants(ir_function *Function) {
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (ir_block &B : Function->Blocks) {
+      for (size_t i = 0; i < B.Instructions.size(); ++i) {
+        ir_instruction &In = B.Instructions[i];
+        ir_operand With;
+        bool Whole;
+        if (In.Result < 0 || IRHasSideEffects(In))
+          continue;
+        Changed |= Reduce(In);
+        if (!Simplify(In, With, Whole))
+          continue;
+        if (Whole) {
+          int Value = In.Result;
+          B.Instructions.erase(B.Instructions.begin() + i--);
+          IRReplaceValue(Function, Value, With);
+        } else {
+          In.Op = neocode_instruction::MOV;
+          In.Src[0] = With;
+          In.Src[1] = In.Src[2] = ir_operand();
+        }
+        Changed = true;
+      }
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#include "ir.h"
+
+static bool IsConstantRead(const ir_operand &Op) {
+  if (Op.Kind == ir_operand::CONSTANT)
+    return true;
+  return Op.Kind == ir_operand::GLOBAL && Op.Global.RegisterType <= 0 &&
+         Op.Global.Register >= 0x20 && Op.Global.Register < 0x80;
+}
+
+struct ir_copy {
+  ir_operand Source;
+  int Components;
+  int Value;
+};
+
+// The outermost loop around Block, whose preheader a copy of a uniform can
+// be made in once, or -1.
+static int OutermostLoop(const std::vector<ir_loop> &Loops, int Block) {
+  int Outer = -1;
+  for (size_t l = 0; l < Loops.size(); ++l) {
+    if (Loops[l].Header <= Block && Block <= Loops[l].Latch &&
+        (Outer < 0 || Loops[l].Header < Loops[Outer].Header))
+      Outer = l;
+  }
+  return Outer;
+}
+
+// Of the sources of an instruction, only one can come from the float
+// uniforms: two-operand formats have a 7-bit field and a 5-bit one, and MAD
+// has one wide field beside a narrow src1. Lowering commutes the uniform
+// into the wide field, mirrors a comparison, or picks DPHI, SGEI, SLTI or
+// MADI for it, which leaves only instructions that read two uniforms or
+// constants. Every one past the first is copied to a value, once per block,
+// or in front of the outermost loop when the instruction is in one.
+void IRLegalizeOperands(ir_function *Function) {
+  std::vector<ir_loop> Loops;
+  IRFindLoops(Function, Loops);
+  std::vector<std::vector<ir_copy>> Copies(Function->Blocks.size());
+  for (size_t b = 0; b < Function->Blocks.size(); ++b) {
+    int Loop = OutermostLoop(Loops, b);
+    int Home = Loop < 0 ? b : Loops[Loop].Preheader;
+    for (size_t i = 0; i < Function->Blocks[b].Instructions.size(); ++i) {
+      ir_instruction &In = Function->Blocks[b].Instructions[i];
+      if (In.Op == IR_PHI || IRSourceCount(In) < 2)
+        continue;
+      std::vector<int> Moved;
+      bool Kept = false;
+      for (int s = 0; s < IRSourceCount(In); ++s) {
+        if (!IsConstantRead(In.Src[s]))
+          continue;
+        if (Kept)
+          Moved.push_back(s);
+        Kept = true;
+      }
+
+      std::vector<ir_instruction> Inserted;
+      for (int s : Moved) {
+        ir_operand Source = In.Src[s];
+        Source.Swizzle = Source.Negate = 0;
+        int Components = IROperandComponents(In.Src[s], IRReadLanes(In, s));
+        int Value = -1;
+        for (ir_copy &C : Copies[Home]) {
+          if (IRSameOperand(C.Source, Source) &&
+              (C.Components & Components) == Components)
+            Value = C.Value;
+        }
+        if (Value < 0) {
+          ir_instruction Copy;
+          Copy.Op = neocode_instruction::MOV;
+          Copy.Result = Value = Function->NewValue();
+          Copy.Mask = Components;
+          Copy.Src[0] = Source;
+          Inserted.push_back(Copy);
+          Copies[Home].push_back({Source, Components, Value});
+        }
+        ir_operand Use = IRValue(Value);
+        Use.Swizzle = In.Src[s].Swizzle;
+        Use.Negate = In.Src[s].Negate;
+        In.Src[s] = Use;
+      }
+
+      if (Inserted.empty())
+        continue;
+      if (Loop >= 0) {
+        std::vector<ir_instruction> &Pre = Function->Blocks[Home].Instructions;
+        Pre.insert(Pre.end() - 1, Inserted.begin(), Inserted.end());
+      } else {
+        std::vector<ir_instruction> &Ins = Function->Blocks[b].Instructions;
+        Ins.insert(Ins.begin() + i, Inserted.begin(), Inserted.end());
+        i += Inserted.size();
+      }
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#include "ir.h"
+
+// A computation in a loop whose operands all come from outside of it gives
+// the same result in every iteration. The body of a LOOP always runs, so it
+// can move in front of the LOOP without making anything more expensive.
+// Inner loops go first, so that what leaves them can leave the outer ones
+// too.
+void IRHoistLoopInvariants(ir_function *Function) {
+  std::vector<ir_loop> Loops;
+  IRFindLoops(Function, Loops);
+  for (ir_loop &L : Loops) {
+    std::vector<int> Inside(Function->ValueCount, 0);
+    for (int b = L.Header; b <= L.Latch; ++b) {
+      for (ir_instruction &In : Function->Blocks[b].Instructions) {
+        if (In.Result >= 0)
+          Inside[In.Result] = 1;
+      }
+    }
+
+    std::vector<ir_instruction> &Preheader =
+        Function->Blocks[L.Preheader].Instructions;
+    for (int b = L.Header; b <= L.Latch; ++b) {
+      std::vector<ir_instruction> &Ins = Function->Blocks[b].Instructions;
+      for (size_t i = 0; i < Ins.size(); ++i) {
+        ir_instruction In = Ins[i];
+        if (In.Result < 0 || In.Op == IR_PHI || In.Op == IR_COUNTER ||
+            IRHasSideEffects(In))
+          continue;
+        bool Invariant = true;
+        for (ir_operand *Op : IROperands(In)) {
+          if (Op->Kind == ir_operand::VALUE && Inside[Op->Value])
+            Invariant = false;
+        }
+        if (!Invariant)
+          continue;
+        Inside[In.Result] = 0;
+        Preheader.insert(Preheader.end() - 1, In);
+        Ins.erase(Ins.begin() + i--);
+      }
+    }
+  }
+}
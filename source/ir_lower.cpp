@@ -0,0 +1,409 @@
+#include "ir.h"
+
+static int MaskSwizzle(int Mask) {
+  if (Mask == 0b1111)
+    return 0;
+  int Swizzle = 0, Count = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (Mask & (1 << i))
+      Swizzle |= (i + 1) << (Count++ * 4);
+  }
+  return Swizzle;
+}
+
+static bool IsConstantRegister(const neocode_variable &V) {
+  return V.RegisterType <= 0 && V.Register >= 0x20 && V.Register < 0x80;
+}
+
+static float ConstantComponent(const neocode_variable &V, int Index) {
+  switch (Index) {
+  case 0:
+    return V.Const.Float.X;
+  case 1:
+    return V.Const.Float.Y;
+  case 2:
+    return V.Const.Float.Z;
+  }
+  return V.Const.Float.W;
+}
+
+// Try to read the lanes Lanes of Values out of the constant register V,
+// possibly negated.
+static bool MatchConstant(const neocode_variable &V, const float *Values,
+                          int Lanes, int Negate, neocode_variable &Out) {
+  int Swizzle = 0;
+  for (int i = 0; i < 4; ++i) {
+    int Found = 0;
+    if (Lanes & (1 << i)) {
+      float Want = Negate ? -Values[i] : Values[i];
+      while (Found < 4 && ConstantComponent(V, Found) != Want)
+        ++Found;
+      if (Found == 4)
+        return false;
+    }
+    Swizzle |= (Found + 1) << (i * 4);
+  }
+  Out = V;
+  Out.Swizzle = Swizzle == 0x4321 ? 0 : Swizzle;
+  Out.Negate = Negate;
+  return true;
+}
+
+// Constants live in the float uniform file. Reuse a register that already
+// holds every component needed, else set up a new one.
+static neocode_variable MaterializeConstant(neocode_program *Program,
+                                            const ir_operand &Op, int Lanes) {
+  float Values[4];
+  for (int i = 0; i < 4; ++i) {
+    Values[i] = Op.Constant[IRSwizzleSelector(Op, i)];
+    if (Op.Negate)
+      Values[i] = -Values[i];
+  }
+
+  neocode_variable Out;
+  for (int Negate = 0; Negate < 2; ++Negate) {
+    for (neocode_variable &V : Program->Globals) {
+      if (V.RegisterType == 0 && IsConstantRegister(V) &&
+          V.TypeName.compare("mat4") != 0 &&
+          MatchConstant(V, Values, Lanes, Negate, Out))
+        return Out;
+    }
+  }
+
+  bool Splat = true;
+  for (int i = 0; i < 4; ++i) {
+    if (!(Lanes & (1 << i)))
+      Values[i] = Values[0];
+    Splat &= Values[i] == Values[0];
+  }
+  neocode_variable Constant = {};
+  Constant.Type = ast_node::FLOAT_LITERAL;
+  Constant.Register = Program->Registers.AllocConstant();
+  if (Constant.Register < 0) {
+    CGNeoError(Program, "out of float registers for constants");
+    Constant.Register = 0x20;
+  }
+  Constant.TypeName = Splat ? "float" : "";
+  Constant.Name = std::string(Splat ? "Anonymous_float_c" : "Anonymous_vec4_c") +
+                  std::to_string(Constant.Register - 0x20);
+  Constant.Const.Float.X = Values[0];
+  Constant.Const.Float.Y = Values[1];
+  Constant.Const.Float.Z = Values[2];
+  Constant.Const.Float.W = Values[3];
+  Program->Globals.push_back(Constant);
+  return Constant;
+}
+
+// Loop parameters live in the integer uniforms, of which there are four.
+static neocode_variable MaterializeInteger(neocode_program *Program,
+                                           const neocode_constant &Const) {
+  for (neocode_variable &V : Program->Globals) {
+    if (V.RegisterType == 0 && V.Register >= 0x90 &&
+        V.Const.Integer.X == Const.Integer.X &&
+        V.Const.Integer.Y == Const.Integer.Y &&
+        V.Const.Integer.Z == Const.Integer.Z &&
+        V.Const.Integer.W == Const.Integer.W)
+      return V;
+  }
+
+  neocode_variable Constant = {};
+  Constant.Type = ast_node::INT_LITERAL;
+  Constant.Register = Program->Registers.AllocInteger();
+  if (Constant.Register < 0) {
+    CGNeoError(Program, "out of integer registers for loop counters");
+    Constant.Register = 0x90;
+  }
+  Constant.TypeName = "ivec4";
+  Constant.Name =
+      "Anonymous_ivec4_i" + std::to_string(Constant.Register - 0x90);
+  Constant.Const = Const;
+  Program->Globals.push_back(Constant);
+  return Constant;
+}
+
+// The comparison with its operands swapped: a < b is b > a.
+static int MirrorCompare(int Compare) {
+  switch (Compare) {
+  case CMP_LT:
+    return CMP_GT;
+  case CMP_LE:
+    return CMP_GE;
+  case CMP_GT:
+    return CMP_LT;
+  case CMP_GE:
+    return CMP_LE;
+  }
+  return Compare;
+}
+
+static neocode_variable LowerOperand(ir_function *Function,
+                                     const ir_instruction &In, int Index) {
+  const ir_operand &Op = Index < 0 ? In.Args[-1 - Index] : In.Src[Index];
+  neocode_variable V = {};
+  switch (Op.Kind) {
+  case ir_operand::VALUE:
+    V = Function->Locations[Op.Value];
+    V.Swizzle = Op.Swizzle;
+    break;
+  case ir_operand::GLOBAL:
+    V = Op.Global;
+    if (V.TypeName.compare("mat4") != 0)
+      V.Swizzle = Op.Swizzle;
+    break;
+  case ir_operand::CONSTANT:
+    return MaterializeConstant(Function->Program, Op,
+                               Index < 0 ? 0b1111 : IRReadLanes(In, Index));
+  }
+  V.Negate = Op.Negate;
+  return V;
+}
+
+// What a0.x and a0.y hold and which of the two was set up last. Nothing is
+// known at the start of a block, after a call, or after an asm MOVA.
+struct address_state {
+  ir_operand Index[2];
+  int Last;
+
+  address_state() : Last(1) {}
+};
+
+static bool SameIndex(const ir_operand &A, const ir_operand &B) {
+  ir_operand X = A, Y = B;
+  X.Swizzle = Y.Swizzle = 0;
+  return A.Kind != ir_operand::NONE && IRSameOperand(X, Y) &&
+         IRSwizzleSelector(A, 0) == IRSwizzleSelector(B, 0);
+}
+
+// Point a0.x or a0.y at the index of the load In, unless one of them is
+// there already, and return the element read relative to it. A load by the
+// loop counter reads relative to aL.
+static neocode_variable LowerLoad(ir_function *Function,
+                                  const ir_instruction &In,
+                                  address_state &Address,
+                                  neocode_function *Out) {
+  neocode_variable Element = IRArrayElement(In.Dst, In.Dst.Swizzle);
+  Element.Name.clear();
+  Element.TypeName.clear();
+  if (In.Src[0].Kind == ir_operand::VALUE &&
+      Function->Locations[In.Src[0].Value].Relative == 3) {
+    Element.Relative = 3;
+    return Element;
+  }
+
+  int Lane = 0;
+  while (Lane < 2 && !SameIndex(Address.Index[Lane], In.Src[0]))
+    ++Lane;
+  if (Lane == 2) {
+    Lane = 1 - Address.Last;
+    neocode_instruction Mova;
+    Mova.Type = neocode_instruction::MOVA;
+    Mova.Dst.Register = 0x80;
+    Mova.Dst.Swizzle = Lane + 1;
+    Mova.Src1 = LowerOperand(Function, In, 0);
+    int Selector = Mova.Src1.Swizzle ? (Mova.Src1.Swizzle & 0b1111) - 1 : 0;
+    Mova.Src1.Swizzle = (Selector + 1) * 0x1111;
+    Out->Instructions.push_back(Mova);
+    Address.Index[Lane] = In.Src[0];
+  }
+  Address.Last = Lane;
+  Element.Relative = Lane + 1;
+  return Element;
+}
+
+// The element a load reads can stand in for the load in the instruction
+// right after it, provided that reads it in the slot that reaches the float
+// uniforms and reads no other uniform.
+static bool CanForward(const ir_instruction &Load, const ir_instruction &In,
+                       const std::vector<int> &Uses) {
+  if (Uses[Load.Result] != 1)
+    return false;
+  switch (In.Op) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::FLR:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::MAD:
+  case neocode_instruction::IFC:
+  case IR_STORE:
+    break;
+  default:
+    return false;
+  }
+  bool Found = false;
+  for (int i = 0; i < IRSourceCount(In); ++i) {
+    const ir_operand &Op = In.Src[i];
+    if (Op.Kind == ir_operand::VALUE && Op.Value == Load.Result) {
+      if (In.Op == neocode_instruction::MAD && i == 0)
+        return false;
+      Found = true;
+    } else if (Op.Kind == ir_operand::CONSTANT ||
+               (Op.Kind == ir_operand::GLOBAL &&
+                IsConstantRegister(Op.Global))) {
+      return false;
+    }
+  }
+  return Found;
+}
+
+// Put the forwarded element in place of the sources that read Value.
+static void Forward(const ir_instruction &In, neocode_instruction &I,
+                    int Value, const neocode_variable &Element) {
+  neocode_variable *Sources[] = {&I.Src1, &I.Src2, &I.Src3};
+  for (int i = 0; i < IRSourceCount(In); ++i) {
+    if (In.Src[i].Kind != ir_operand::VALUE || In.Src[i].Value != Value)
+      continue;
+    neocode_variable V = Element;
+    V.Swizzle = Sources[i]->Swizzle;
+    V.Negate = Sources[i]->Negate;
+    *Sources[i] = V;
+  }
+}
+
+void IRLowerFunction(ir_function *Function, neocode_function *Out) {
+  Out->Name = Function->Name;
+  for (int P : Function->Parameters) {
+    Out->Parameters.push_back(Function->Locations[P]);
+    Out->Variables.push_back(Function->Locations[P]);
+  }
+
+  // Phis have their values in place by now; a latch ends the body of the
+  // last LOOP still open. The else part of a branch starts at its second
+  // successor if the then part does not lead there, and the if ends where
+  // the then part leads.
+  std::vector<ir_block> &Blocks = Function->Blocks;
+  std::vector<ir_loop> Loops;
+  IRFindLoops(Function, Loops);
+  std::vector<int> ElseAt(Blocks.size() + 1, 0), EndsAt(Blocks.size() + 1, 0);
+  for (size_t b = 0; b < Blocks.size(); ++b) {
+    std::vector<ir_instruction> &Ins = Blocks[b].Instructions;
+    if (Ins.empty() || !IRIsBranch(Ins.back()))
+      continue;
+    int Second = Blocks[b].Successors[1];
+    int Join = Blocks[Second - 1].Successors[0];
+    if (Join != Second)
+      ++ElseAt[Second];
+    ++EndsAt[Join];
+  }
+
+  std::vector<int> Uses;
+  IRCountUses(Function, Uses);
+  for (size_t b = 0; b < Blocks.size(); ++b) {
+    address_state Address;
+    int Forwarded = -1;
+    neocode_variable Element = {};
+    for (int i = 0; i < EndsAt[b]; ++i) {
+      neocode_instruction I;
+      I.Type = neocode_instruction::ENDIF;
+      Out->Instructions.push_back(I);
+    }
+    if (ElseAt[b]) {
+      neocode_instruction I;
+      I.Type = neocode_instruction::ELSE;
+      Out->Instructions.push_back(I);
+    }
+    std::vector<ir_instruction> &Ins = Blocks[b].Instructions;
+    for (size_t n = 0; n < Ins.size(); ++n) {
+      ir_instruction &In = Ins[n];
+      if (In.Op == neocode_instruction::EMPTY || In.Op == IR_PARAM ||
+          In.Op == IR_PHI || In.Op == IR_COUNTER)
+        continue;
+      if (In.Op == IR_LOAD) {
+        Element = LowerLoad(Function, In, Address, Out);
+        if (n + 1 < Ins.size() && CanForward(In, Ins[n + 1], Uses)) {
+          Forwarded = In.Result;
+          continue;
+        }
+        neocode_instruction I;
+        I.Type = neocode_instruction::MOV;
+        I.Dst = Function->Locations[In.Result];
+        I.Dst.Swizzle = MaskSwizzle(In.Mask);
+        I.Src1 = Element;
+        Out->Instructions.push_back(I);
+        continue;
+      }
+      if (In.Op == neocode_instruction::LOOP) {
+        neocode_instruction I;
+        I.Type = In.Op;
+        I.Src1 = MaterializeInteger(Function->Program, In.Dst.Const);
+        Out->Instructions.push_back(I);
+        continue;
+      }
+      if (In.Op == neocode_instruction::IFC) {
+        neocode_instruction I;
+        I.Type = neocode_instruction::CMP;
+        I.Dst.Const.Integer.X = In.Dst.Const.Integer.X;
+        I.Src1 = LowerOperand(Function, In, 0);
+        I.Src2 = LowerOperand(Function, In, 1);
+        Forward(In, I, Forwarded, Element);
+        if (IsConstantRegister(I.Src2) && !IsConstantRegister(I.Src1)) {
+          std::swap(I.Src1, I.Src2);
+          I.Dst.Const.Integer.X = MirrorCompare(I.Dst.Const.Integer.X);
+        }
+        Out->Instructions.push_back(I);
+        neocode_instruction Branch;
+        Branch.Type = neocode_instruction::IFC;
+        Out->Instructions.push_back(Branch);
+        continue;
+      }
+
+      neocode_instruction I;
+      I.Type = In.Op;
+      if (In.Op == IR_STORE) {
+        I.Type = neocode_instruction::MOV;
+        I.Dst = In.Dst;
+        I.Dst.Swizzle = MaskSwizzle(In.Mask);
+      } else if (In.Result >= 0) {
+        I.Dst = Function->Locations[In.Result];
+        I.Dst.Swizzle = MaskSwizzle(In.Mask);
+      } else {
+        I.Dst = In.Dst;
+        I.Dst.Swizzle = MaskSwizzle(In.Mask);
+      }
+
+      if (In.Op == neocode_instruction::INVOKE) {
+        I.ExtraData = In.Name;
+        for (size_t a = 0; a < In.Args.size(); ++a)
+          I.Args.push_back(LowerOperand(Function, In, -1 - (int)a));
+        Out->Callees.push_back(In.Name);
+      }
+      if (IRSourceCount(In) > 0)
+        I.Src1 = LowerOperand(Function, In, 0);
+      if (IRSourceCount(In) > 1)
+        I.Src2 = LowerOperand(Function, In, 1);
+      if (IRSourceCount(In) > 2)
+        I.Src3 = LowerOperand(Function, In, 2);
+      Forward(In, I, Forwarded, Element);
+
+      // Only src1 reaches the whole register space, except in MAD, whose
+      // factors reach it through src2.
+      if (IRIsCommutative(In.Op) && IsConstantRegister(I.Src2) &&
+          !IsConstantRegister(I.Src1))
+        std::swap(I.Src1, I.Src2);
+      if (In.Op == neocode_instruction::MAD && IsConstantRegister(I.Src1) &&
+          !IsConstantRegister(I.Src2))
+        std::swap(I.Src1, I.Src2);
+      Out->Instructions.push_back(I);
+      if (In.Op == neocode_instruction::INVOKE ||
+          In.Op == neocode_instruction::MOVA)
+        Address = address_state();
+    }
+    for (ir_loop &L : Loops) {
+      if (L.Latch == (int)b) {
+        neocode_instruction I;
+        I.Type = neocode_instruction::ENDLOOP;
+        Out->Instructions.push_back(I);
+      }
+    }
+  }
+}
@@ -0,0 +1,215 @@
+#include "ir.h"
+#include <cstdio>
+
+// Values computed from uniforms and constants alone are the same for every
+// vertex. The widest such values that the shader goes on to use become new
+// uniforms, and the code computing them is handed to the CPU as C.
+
+static bool IsEvaluable(int Op) {
+  switch (Op) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::MAD:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SGE:
+  case neocode_instruction::SLT:
+  case neocode_instruction::FLR:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+    return true;
+  }
+  return false;
+}
+
+static std::string Temporary(ir_function *Function, int Value) {
+  return Function->Name + "_" + std::to_string(Value);
+}
+
+static std::string Component(ir_function *Function, const ir_operand &Op,
+                             int Lane) {
+  std::vector<int> &Inputs = Function->Program->PreshaderInputs;
+  int Selector = IRSwizzleSelector(Op, Lane);
+  std::string S;
+  switch (Op.Kind) {
+  case ir_operand::VALUE:
+    S = Temporary(Function, Op.Value) + "[" + std::to_string(Selector) + "]";
+    break;
+  case ir_operand::GLOBAL: {
+    int Register = Op.Global.Register - 0x20;
+    if (Op.Global.TypeName.compare("mat4") == 0)
+      Register += Op.Global.Swizzle;
+    Inputs.push_back(Register + 0x20);
+    S = "c[" + std::to_string(Register) + "][" + std::to_string(Selector) +
+        "]";
+    break;
+  }
+  case ir_operand::CONSTANT: {
+    char Buffer[32];
+    snprintf(Buffer, sizeof(Buffer), "%.9gf", Op.Constant[Selector]);
+    S = Buffer;
+    if (S.find_first_of(".en") == std::string::npos)
+      S.insert(S.size() - 1, ".0");
+    break;
+  }
+  }
+  return Op.Negate ? "-(" + S + ")" : S;
+}
+
+static std::string Dot(ir_function *Function, const ir_instruction &In,
+                       int Count) {
+  std::string S;
+  for (int i = 0; i < Count; ++i) {
+    if (i)
+      S += " + ";
+    S += Component(Function, In.Src[0], i) + " * " +
+         Component(Function, In.Src[1], i);
+  }
+  return S;
+}
+
+static std::string Evaluate(ir_function *Function, const ir_instruction &In,
+                            int Lane) {
+  std::string A = Component(Function, In.Src[0], Lane);
+  std::string B, C;
+  if (IRSourceCount(In) > 1)
+    B = Component(Function, In.Src[1], Lane);
+  if (IRSourceCount(In) > 2)
+    C = Component(Function, In.Src[2], Lane);
+  std::string X = Component(Function, In.Src[0], 0);
+  switch (In.Op) {
+  case neocode_instruction::MOV:
+    return A;
+  case neocode_instruction::ADD:
+    return A + " + " + B;
+  case neocode_instruction::MUL:
+    return A + " * " + B;
+  case neocode_instruction::MAD:
+    return A + " * " + B + " + " + C;
+  case neocode_instruction::DP3:
+    return Dot(Function, In, 3);
+  case neocode_instruction::DP4:
+    return Dot(Function, In, 4);
+  case neocode_instruction::DPH:
+    return Dot(Function, In, 3) + " + " + Component(Function, In.Src[1], 3);
+  case neocode_instruction::MIN:
+    return A + " < " + B + " ? " + A + " : " + B;
+  case neocode_instruction::MAX:
+    return A + " > " + B + " ? " + A + " : " + B;
+  case neocode_instruction::SGE:
+    return A + " >= " + B + " ? 1.0f : 0.0f";
+  case neocode_instruction::SLT:
+    return A + " < " + B + " ? 1.0f : 0.0f";
+  case neocode_instruction::FLR:
+    return "floorf(" + A + ")";
+  case neocode_instruction::RCP:
+    return "1.0f / " + X;
+  case neocode_instruction::RSQ:
+    return "1.0f / sqrtf(" + X + ")";
+  case neocode_instruction::EX2:
+    return "exp2f(" + X + ")";
+  case neocode_instruction::LG2:
+    return "log2f(" + X + ")";
+  }
+  return "0.0f";
+}
+
+void IRExtractPreshader(ir_function *Function) {
+  neocode_program *Program = Function->Program;
+  if (!Program->Options.Preshader)
+    return;
+
+  int Count = Function->ValueCount;
+  std::vector<int> Uniform(Count, 0), Work(Count, 0), Hoist(Count, 0);
+  std::vector<ir_instruction *> Linear;
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions)
+      Linear.push_back(&In);
+  }
+
+  // Work marks values that take more than a copy to compute; hoisting a
+  // plain uniform read would only cost a register.
+  for (ir_instruction *In : Linear) {
+    if (In->Result < 0 || IRHasSideEffects(*In) || !IsEvaluable(In->Op))
+      continue;
+    bool IsUniform = true;
+    bool IsWork = In->Op != neocode_instruction::MOV;
+    for (ir_operand *Op : IROperands(*In)) {
+      if (Op->Kind == ir_operand::VALUE) {
+        IsUniform &= Uniform[Op->Value] != 0;
+        IsWork |= Work[Op->Value] != 0;
+      } else if (Op->Kind == ir_operand::GLOBAL) {
+        IsUniform &=
+            Op->Global.RegisterType == neocode_variable::INPUT_UNIFORM;
+      }
+    }
+    Uniform[In->Result] = IsUniform;
+    Work[In->Result] = IsUniform && IsWork;
+  }
+
+  bool Any = false;
+  for (ir_instruction *In : Linear) {
+    if (In->Result >= 0 && Uniform[In->Result])
+      continue;
+    for (ir_operand *Op : IROperands(*In)) {
+      if (Op->Kind == ir_operand::VALUE && Work[Op->Value]) {
+        Hoist[Op->Value] = 1;
+        Any = true;
+      }
+    }
+  }
+  if (!Any)
+    return;
+
+  std::vector<int> Needed(Count, 0);
+  for (size_t p = Linear.size(); p-- > 0;) {
+    ir_instruction *In = Linear[p];
+    if (In->Result < 0 || !(Hoist[In->Result] || Needed[In->Result]))
+      continue;
+    Needed[In->Result] = 1;
+    for (ir_operand *Op : IROperands(*In)) {
+      if (Op->Kind == ir_operand::VALUE)
+        Needed[Op->Value] = 1;
+    }
+  }
+
+  std::string &Code = Program->Preshader;
+  for (ir_instruction *In : Linear) {
+    if (In->Result < 0 || !Needed[In->Result])
+      continue;
+    std::string T = Temporary(Function, In->Result);
+    Code += "  float " + T + "[4] = {0.0f, 0.0f, 0.0f, 0.0f};\n";
+    for (int i = 0; i < 4; ++i) {
+      std::string Lane = T + "[" + std::to_string(i) + "] = ";
+      if (In->Mask & (1 << i))
+        Code += "  " + Lane + Evaluate(Function, *In, i) + ";\n";
+      else if (In->Prior.Kind != ir_operand::NONE)
+        Code += "  " + Lane + Component(Function, In->Prior, i) + ";\n";
+    }
+  }
+
+  for (int v = 0; v < Count; ++v) {
+    if (!Hoist[v])
+      continue;
+    int Register = Program->Registers.AllocConstant();
+    if (Register < 0)
+      break;
+    neocode_variable Derived = {};
+    Derived.Register = Register;
+    Derived.RegisterType = neocode_variable::INPUT_UNIFORM;
+    Derived.TypeName = "vec4";
+    Derived.Name = "Preshader_c" + std::to_string(Register - 0x20);
+    Program->Globals.push_back(Derived);
+    for (int i = 0; i < 4; ++i)
+      Code += "  c[" + std::to_string(Register - 0x20) + "][" +
+              std::to_string(i) + "] = " + Temporary(Function, v) + "[" +
+              std::to_string(i) + "];\n";
+    IRReplaceValue(Function, v, IRGlobal(Derived));
+  }
+}
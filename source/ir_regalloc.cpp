@@ -0,0 +1,436 @@
+#include "ir.h"
+#include <algorithm>
+
+// r15 is kept for return values, see OPT_SLOT_RETURN.
+enum { IR_TEMP_REGISTERS = 15 };
+
+static const neocode_variable ReturnRegister = {"", "", 0, 0x1F, 0};
+
+struct ra_group {
+  int Start;
+  int End;
+  int Lanes;
+  int Fixed;
+  neocode_variable Location;
+  std::vector<int> Members;
+};
+
+static int Find(std::vector<int> &Parent, int V) {
+  while (Parent[V] != V)
+    V = Parent[V] = Parent[Parent[V]];
+  return V;
+}
+
+// Where a loop sits in the linear order: its LOOP instruction and the first
+// and last position of its body.
+struct ra_loop {
+  int Start;
+  int Head;
+  int Tail;
+};
+
+// Live ranges over the instructions in order. A phi reads each of its values
+// at the end of the predecessor it comes from, so a loop phi reads its entry
+// value at the LOOP and its latch value at the end of the body. A value that
+// is live into a loop stays live until its end, as the body runs again. The
+// parts of an if need nothing special: laid out one after the other, their
+// ranges only ever cover more than they have to.
+struct ra_intervals {
+  std::vector<ir_instruction *> Linear;
+  std::vector<int> Def;
+  std::vector<int> End;
+  std::vector<int> Uses;
+};
+
+static void ComputeIntervals(ir_function *Function, ra_intervals &R) {
+  std::vector<int> BlockStart;
+  R.Linear.clear();
+  for (ir_block &B : Function->Blocks) {
+    BlockStart.push_back(R.Linear.size());
+    for (ir_instruction &In : B.Instructions)
+      R.Linear.push_back(&In);
+  }
+  BlockStart.push_back(R.Linear.size());
+
+  std::vector<ir_loop> Loops;
+  IRFindLoops(Function, Loops);
+  std::vector<ra_loop> Spans;
+  for (ir_loop &L : Loops)
+    Spans.push_back({BlockStart[L.Header] - 1, BlockStart[L.Header],
+                     BlockStart[L.Latch + 1] - 1});
+  std::vector<std::vector<int>> Predecessors;
+  IRFindPredecessors(Function, Predecessors);
+
+  int Count = Function->ValueCount;
+  R.Def.assign(Count, 0);
+  R.End.assign(Count, -1);
+  R.Uses.assign(Count, 0);
+  for (size_t b = 0; b < Function->Blocks.size(); ++b) {
+    for (int p = BlockStart[b]; p < BlockStart[b + 1]; ++p) {
+      ir_instruction &In = *R.Linear[p];
+      for (ir_operand *Op : IROperands(In)) {
+        if (Op->Kind != ir_operand::VALUE)
+          continue;
+        int At = p;
+        if (In.Op == IR_PHI)
+          At = BlockStart[Predecessors[b][Op == &In.Src[0] ? 0 : 1] + 1] - 1;
+        R.End[Op->Value] = std::max(R.End[Op->Value], At);
+        ++R.Uses[Op->Value];
+      }
+      if (In.Result < 0)
+        continue;
+      // Parameters are all written by the caller before entry.
+      bool IsParam = In.Op == IR_PARAM;
+      R.Def[In.Result] = IsParam ? 0 : p;
+      R.End[In.Result] = std::max(R.End[In.Result], R.Def[In.Result]);
+      if (IsParam)
+        R.End[In.Result] = std::max(R.End[In.Result],
+                                    (int)Function->Parameters.size());
+    }
+  }
+
+  for (ra_loop &S : Spans) {
+    for (int v = 0; v < Count; ++v) {
+      if (R.Def[v] < S.Head && R.End[v] >= S.Head)
+        R.End[v] = std::max(R.End[v], S.Tail);
+    }
+  }
+}
+
+static ir_instruction Copy(ir_function *Function, const ir_operand &Src,
+                           int Mask) {
+  ir_instruction In;
+  In.Op = neocode_instruction::MOV;
+  In.Result = Function->NewValue();
+  In.Mask = Mask;
+  In.Src[0] = Src;
+  return In;
+}
+
+// Copies go at the end of a block, but in front of the LOOP or branch that
+// ends it.
+static void InsertAtEnd(std::vector<ir_instruction> &Ins,
+                        const std::vector<ir_instruction> &Copies) {
+  std::vector<ir_instruction>::iterator At = Ins.end();
+  if (Ins.size() && (Ins.back().Op == neocode_instruction::LOOP ||
+                     IRIsBranch(Ins.back())))
+    --At;
+  Ins.insert(At, Copies.begin(), Copies.end());
+}
+
+// A phi and its values share a register: each value is copied in at the end
+// of the block it comes from, so a loop phi gets its entry value before the
+// LOOP and its latch value at the end of the body. All copies at the end of
+// a latch read the values of the iteration that is ending, so a phi that a
+// latch value or the code after the loop still reads is saved first.
+// Returns the pairs of copy and phi, those of latches first.
+static std::vector<std::pair<int, int>> InsertPhiCopies(ir_function *Function) {
+  std::vector<std::pair<int, int>> Copies, Entry;
+  std::vector<std::vector<int>> Predecessors;
+  IRFindPredecessors(Function, Predecessors);
+  std::vector<ir_block> &Blocks = Function->Blocks;
+  for (size_t Header = 0; Header < Blocks.size(); ++Header) {
+    std::vector<int> Phis;
+    for (size_t i = 0; i < Blocks[Header].Instructions.size() &&
+                       Blocks[Header].Instructions[i].Op == IR_PHI;
+         ++i)
+      Phis.push_back(i);
+    if (Phis.empty())
+      continue;
+    int First = Predecessors[Header][0];
+    int Last = Predecessors[Header][1];
+    bool IsLoop = Last >= (int)Header;
+
+    std::vector<ir_instruction> End;
+    for (size_t i = 0; IsLoop && i < Phis.size(); ++i) {
+      ir_instruction &Phi = Blocks[Header].Instructions[Phis[i]];
+      std::vector<ir_operand *> Readers;
+      for (size_t j = 0; j < Phis.size(); ++j) {
+        ir_instruction &Other = Blocks[Header].Instructions[Phis[j]];
+        if (j != i && Other.Src[1].Kind == ir_operand::VALUE &&
+            Other.Src[1].Value == Phi.Result)
+          Readers.push_back(&Other.Src[1]);
+      }
+      for (size_t b = Last + 1; b < Blocks.size(); ++b) {
+        for (ir_instruction &In : Blocks[b].Instructions) {
+          for (ir_operand *Op : IROperands(In)) {
+            if (Op->Kind == ir_operand::VALUE && Op->Value == Phi.Result)
+              Readers.push_back(Op);
+          }
+        }
+      }
+      if (Readers.empty())
+        continue;
+      ir_instruction Save = Copy(Function, IRValue(Phi.Result), Phi.Mask);
+      for (ir_operand *Op : Readers)
+        *Op = IRCompose(*Op, IRValue(Save.Result));
+      End.push_back(Save);
+    }
+
+    std::vector<ir_instruction> Start;
+    for (int i : Phis) {
+      ir_instruction &Phi = Blocks[Header].Instructions[i];
+      ir_instruction Second = Copy(Function, Phi.Src[1], Phi.Mask);
+      ir_instruction Init = Copy(Function, Phi.Src[0], Phi.Mask);
+      Phi.Src[1] = IRValue(Second.Result);
+      Phi.Src[0] = IRValue(Init.Result);
+      (IsLoop ? Copies : Entry)
+          .push_back(std::make_pair(Second.Result, Phi.Result));
+      Entry.push_back(std::make_pair(Init.Result, Phi.Result));
+      End.push_back(Second);
+      Start.push_back(Init);
+    }
+    InsertAtEnd(Blocks[First].Instructions, Start);
+    InsertAtEnd(Blocks[Last].Instructions, End);
+  }
+  Copies.insert(Copies.end(), Entry.begin(), Entry.end());
+  return Copies;
+}
+
+// A partial write lands in the register of the value it completes, which is
+// only possible if that value is not needed afterwards. Otherwise, and for
+// anything but a plain value, work on a copy.
+static void InsertTieCopies(ir_function *Function) {
+  ra_intervals R;
+  ComputeIntervals(Function, R);
+  std::vector<int> Untie(Function->ValueCount, 0);
+  for (size_t p = 0; p < R.Linear.size(); ++p) {
+    ir_operand &Prior = R.Linear[p]->Prior;
+    if (Prior.Kind != ir_operand::NONE &&
+        !(Prior.Kind == ir_operand::VALUE && Prior.Swizzle == 0 &&
+          !Prior.Negate && R.End[Prior.Value] <= (int)p))
+      Untie[R.Linear[p]->Result] = 1;
+  }
+
+  for (ir_block &B : Function->Blocks) {
+    for (size_t i = 0; i < B.Instructions.size(); ++i) {
+      ir_instruction &In = B.Instructions[i];
+      if (In.Result < 0 || !Untie[In.Result])
+        continue;
+      ir_instruction Tie = Copy(Function, In.Prior, 0b1111);
+      In.Prior = IRValue(Tie.Result);
+      B.Instructions.insert(B.Instructions.begin() + i++, Tie);
+    }
+  }
+}
+
+static bool Overlap(const ra_intervals &R, int A, int B) {
+  return R.Def[A] < R.End[B] && R.Def[B] < R.End[A];
+}
+
+// Drop the copies of a phi whose source can take the phi's register itself,
+// which it can if none of the values in one register are live while any of
+// the other one's are. The latch copies go first, as they run every
+// iteration.
+static void CoalescePhiCopies(ir_function *Function,
+                              const std::vector<std::pair<int, int>> &Copies,
+                              std::vector<int> &Parent) {
+  int Count = Function->ValueCount;
+  for (const std::pair<int, int> &C : Copies) {
+    ra_intervals R;
+    ComputeIntervals(Function, R);
+    ir_instruction *In = nullptr;
+    for (ir_instruction *Candidate : R.Linear) {
+      if (Candidate->Result == C.first)
+        In = Candidate;
+    }
+    ir_operand &Src = In->Src[0];
+    if (Src.Kind != ir_operand::VALUE || Src.Swizzle || Src.Negate)
+      continue;
+    int From = Src.Value;
+    int Into = Find(Parent, C.second);
+    if (Find(Parent, From) != Into) {
+      R.End[From] = std::max(R.End[From], R.End[C.first]);
+      bool Interferes = false;
+      for (int a = 0; a < Count && !Interferes; ++a) {
+        if (Find(Parent, a) != Find(Parent, From))
+          continue;
+        for (int b = 0; b < Count && !Interferes; ++b) {
+          if (b != C.first && Find(Parent, b) == Into)
+            Interferes = Overlap(R, a, b);
+        }
+      }
+      if (Interferes)
+        continue;
+    }
+
+    In->Op = neocode_instruction::EMPTY;
+    for (ir_block &B : Function->Blocks) {
+      std::vector<ir_instruction> &Ins = B.Instructions;
+      Ins.erase(std::remove_if(Ins.begin(), Ins.end(),
+                               [](const ir_instruction &In) {
+                                 return In.Op == neocode_instruction::EMPTY;
+                               }),
+                Ins.end());
+    }
+    IRReplaceValue(Function, C.first, IRValue(From));
+    Parent[Find(Parent, From)] = Into;
+  }
+}
+
+static bool SameRegister(const neocode_variable &A, const neocode_variable &B) {
+  return A.RegisterType == B.RegisterType && A.Register == B.Register;
+}
+
+void IRAllocateRegisters(ir_function *Function) {
+  std::vector<std::pair<int, int>> Copies = InsertPhiCopies(Function);
+  InsertTieCopies(Function);
+
+  int Count = Function->ValueCount;
+  std::vector<int> Parent(Count);
+  for (int v = 0; v < Count; ++v)
+    Parent[v] = v;
+  std::vector<int> IsParam(Count, 0), IsCall(Count, 0), IsPhi(Count, 0);
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      if (In.Prior.Kind == ir_operand::VALUE)
+        Parent[Find(Parent, In.Result)] = Find(Parent, In.Prior.Value);
+      if (In.Op != IR_PHI)
+        continue;
+      IsPhi[In.Result] = 1;
+      for (int s = 0; s < 2; ++s)
+        Parent[Find(Parent, In.Src[s].Value)] = Find(Parent, In.Result);
+    }
+  }
+  CoalescePhiCopies(Function, Copies, Parent);
+
+  ra_intervals R;
+  ComputeIntervals(Function, R);
+  std::vector<ir_instruction *> &Linear = R.Linear;
+  std::vector<int> &Def = R.Def, &End = R.End, &Uses = R.Uses;
+  for (ir_instruction *In : Linear) {
+    if (In->Result < 0)
+      continue;
+    IsParam[In->Result] = In->Op == IR_PARAM;
+    IsCall[In->Result] = In->Op == neocode_instruction::INVOKE;
+  }
+
+  std::map<int, ra_group> Groups;
+  for (size_t p = 0; p < Linear.size(); ++p) {
+    int V = Linear[p]->Result;
+    if (V < 0)
+      continue;
+    int Root = Find(Parent, V);
+    if (!Groups.count(Root)) {
+      ra_group G;
+      G.Start = Def[V];
+      G.End = End[V];
+      G.Lanes = 0;
+      G.Fixed = 0;
+      Groups[Root] = G;
+    }
+    ra_group &G = Groups[Root];
+    G.Start = std::min(G.Start, Def[V]);
+    G.End = std::max(G.End, End[V]);
+    G.Lanes |= Linear[p]->Mask;
+    G.Members.push_back(V);
+  }
+
+  // A counter lives in aL, which only a load can read.
+  for (ir_instruction *In : Linear) {
+    if (In->Op != IR_COUNTER)
+      continue;
+    ra_group &G = Groups[Find(Parent, In->Result)];
+    G.Fixed = 1;
+    G.Location = neocode_variable();
+    G.Location.Relative = 3;
+  }
+
+  // A value that is computed only to be stored to an output or returned is
+  // computed right into that register instead, as long as nothing else
+  // writes or emits the register while the value is being built.
+  std::vector<size_t> Folded;
+  for (size_t s = 0; s < Linear.size(); ++s) {
+    ir_instruction &Store = *Linear[s];
+    ir_operand &Src = Store.Src[0];
+    if (Store.Op != IR_STORE || Src.Kind != ir_operand::VALUE || Src.Negate)
+      continue;
+    bool Fits = true;
+    for (int i = 0; i < 4; ++i) {
+      if (Store.Mask & (1 << i))
+        Fits &= IRSwizzleSelector(Src, i) == i;
+    }
+    ra_group &G = Groups[Find(Parent, Src.Value)];
+    Fits &= !G.Fixed && G.Lanes == Store.Mask && G.End == (int)s;
+    for (int V : G.Members)
+      Fits &= Uses[V] == 1 && !IsParam[V] && !IsCall[V] && !IsPhi[V];
+    for (int p = G.Start + 1; Fits && p < (int)s; ++p) {
+      ir_instruction &In = *Linear[p];
+      Fits &= In.Op != neocode_instruction::INVOKE &&
+              In.Op != neocode_instruction::EMIT &&
+              !(In.Op == IR_STORE && SameRegister(In.Dst, Store.Dst));
+    }
+    if (!Fits)
+      continue;
+    G.Fixed = 1;
+    G.Location = Store.Dst;
+    G.Location.Swizzle = 0;
+    Folded.push_back(s);
+  }
+
+  std::vector<ra_group *> Order;
+  for (auto &Entry : Groups) {
+    if (!Entry.second.Fixed)
+      Order.push_back(&Entry.second);
+  }
+  std::stable_sort(Order.begin(), Order.end(),
+                   [](const ra_group *A, const ra_group *B) {
+                     return A->Start < B->Start;
+                   });
+
+  // Linear scan over register components: values that write disjoint lanes
+  // can share a register. Always taking the lowest register that fits keeps
+  // the set a function touches small, which leaves more room to inline it.
+  int BusyUntil[IR_TEMP_REGISTERS][4];
+  for (int r = 0; r < IR_TEMP_REGISTERS; ++r) {
+    for (int l = 0; l < 4; ++l)
+      BusyUntil[r][l] = -1;
+  }
+  bool Exhausted = false;
+  for (ra_group *G : Order) {
+    int Best = 0;
+    for (; Best < IR_TEMP_REGISTERS; ++Best) {
+      bool Fits = true;
+      for (int l = 0; l < 4; ++l) {
+        if (G->Lanes & (1 << l))
+          Fits &= BusyUntil[Best][l] <= G->Start;
+      }
+      if (Fits)
+        break;
+    }
+    if (Best == IR_TEMP_REGISTERS) {
+      if (!Exhausted)
+        CGNeoError(Function->Program, "%s: out of temporary registers",
+                   Function->Name.c_str());
+      Exhausted = true;
+      Best = 0;
+    }
+    for (int l = 0; l < 4; ++l) {
+      if (G->Lanes & (1 << l))
+        BusyUntil[Best][l] = G->End;
+    }
+    G->Location = ReturnRegister;
+    G->Location.Register = 0x10 + Best;
+  }
+
+  Function->Locations.assign(Count, neocode_variable());
+  for (auto &Entry : Groups) {
+    for (int V : Entry.second.Members)
+      Function->Locations[V] = Entry.second.Location;
+  }
+  for (ir_instruction *In : Linear) {
+    if (In->Op == IR_PARAM)
+      Function->Locations[In->Result].Name = Function->Name + "_" + In->Name;
+  }
+
+  for (size_t s : Folded)
+    Linear[s]->Op = neocode_instruction::EMPTY;
+  for (ir_block &B : Function->Blocks) {
+    std::vector<ir_instruction> &Ins = B.Instructions;
+    Ins.erase(std::remove_if(Ins.begin(), Ins.end(),
+                             [](const ir_instruction &In) {
+                               return In.Op == neocode_instruction::EMPTY;
+                             }),
+              Ins.end());
+  }
+}
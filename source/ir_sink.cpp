@@ -0,0 +1,33 @@
+#include "ir.h"
+
+static bool Reads(ir_instruction &In, int Value) {
+  for (ir_operand *Op : IROperands(In)) {
+    if (Op->Kind == ir_operand::VALUE && Op->Value == Value)
+      return true;
+  }
+  return false;
+}
+
+// A load used once moves down to right before its use in the same block, so
+// that lowering can read the element in place instead of copying it to a
+// register first. The index is a value and the uniforms never change, so
+// nothing in between can make the load read something else.
+void IRSinkLoads(ir_function *Function) {
+  std::vector<int> Uses;
+  IRCountUses(Function, Uses);
+  for (ir_block &B : Function->Blocks) {
+    std::vector<ir_instruction> &Ins = B.Instructions;
+    for (size_t i = Ins.size(); i-- > 0;) {
+      if (Ins[i].Op != IR_LOAD || Uses[Ins[i].Result] != 1)
+        continue;
+      size_t User = i + 1;
+      while (User < Ins.size() && !Reads(Ins[User], Ins[i].Result))
+        ++User;
+      if (User == Ins.size() || User == i + 1 || Ins[User].Op == IR_PHI)
+        continue;
+      ir_instruction Load = Ins[i];
+      Ins.insert(Ins.begin() + User, Load);
+      Ins.erase(Ins.begin() + i);
+    }
+  }
+}
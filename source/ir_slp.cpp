@@ -0,0 +1,332 @@
+#include "ir.h"
+
+static int LaneCount(int Mask) {
+  int Count = 0;
+  for (int i = 0; i < 4; ++i)
+    Count += (Mask >> i) & 1;
+  return Count;
+}
+
+// Every written lane of these gets the same scalar result.
+static bool IsScalar(int Op) {
+  switch (Op) {
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+    return true;
+  }
+  return false;
+}
+
+static void SweepDemand(ir_function *Function, std::vector<int> &Demand) {
+  for (size_t b = Function->Blocks.size(); b-- > 0;) {
+    std::vector<ir_instruction> &Ins = Function->Blocks[b].Instructions;
+    for (size_t i = Ins.size(); i-- > 0;) {
+      ir_instruction In = Ins[i];
+      int Live = In.Result >= 0 ? Demand[In.Result] : 0b1111;
+      if (!IRHasSideEffects(In))
+        In.Mask &= Live;
+      for (int s = 0; s < IRSourceCount(In); ++s) {
+        if (In.Src[s].Kind == ir_operand::VALUE && In.Mask)
+          Demand[In.Src[s].Value] |=
+              IROperandComponents(In.Src[s], IRReadLanes(In, s));
+      }
+      if (In.Prior.Kind == ir_operand::VALUE)
+        Demand[In.Prior.Value] |=
+            IROperandComponents(In.Prior, Live & ~Ins[i].Mask);
+      for (ir_operand &Arg : In.Args) {
+        if (Arg.Kind == ir_operand::VALUE)
+          Demand[Arg.Value] |= IROperandComponents(Arg, 0b1111);
+      }
+    }
+  }
+}
+
+// The components of every value that something downstream looks at. A phi
+// reads its latch value before the sweep gets to its definition, so it takes
+// until nothing changes.
+static void ComputeDemand(ir_function *Function, std::vector<int> &Demand) {
+  Demand.assign(Function->ValueCount, 0);
+  std::vector<int> Previous;
+  while (Previous != Demand) {
+    Previous = Demand;
+    SweepDemand(Function, Demand);
+  }
+}
+
+// Compute only the lanes that are used. A partial write none of whose lanes
+// matter is just its Prior.
+static void Narrow(ir_function *Function) {
+  std::vector<int> Demand;
+  ComputeDemand(Function, Demand);
+  for (ir_block &B : Function->Blocks) {
+    for (size_t i = 0; i < B.Instructions.size(); ++i) {
+      ir_instruction &In = B.Instructions[i];
+      if (In.Result < 0 || IRHasSideEffects(In) || !Demand[In.Result])
+        continue;
+      int Mask = In.Mask & Demand[In.Result];
+      if (Mask) {
+        In.Mask = Mask;
+        continue;
+      }
+      if (In.Prior.Kind == ir_operand::NONE)
+        continue;
+      int Value = In.Result;
+      ir_operand Prior = In.Prior;
+      B.Instructions.erase(B.Instructions.begin() + i--);
+      IRReplaceValue(Function, Value, Prior);
+    }
+  }
+}
+
+static bool SameSource(const ir_operand &A, const ir_operand &B) {
+  if (A.Kind != B.Kind)
+    return false;
+  switch (A.Kind) {
+  case ir_operand::VALUE:
+    return A.Value == B.Value && A.Negate == B.Negate;
+  case ir_operand::GLOBAL:
+    return A.Global.RegisterType == B.Global.RegisterType &&
+           A.Global.Register == B.Global.Register &&
+           A.Global.Swizzle == B.Global.Swizzle && A.Negate == B.Negate;
+  case ir_operand::CONSTANT:
+    return true;
+  }
+  return false;
+}
+
+// Put the lanes Lanes of From into the lanes Map[] of Into.
+static void MergeSource(ir_operand &Into, const ir_operand &From, int Lanes,
+                        const int *Map) {
+  if (Into.Kind == ir_operand::CONSTANT) {
+    ir_operand Merged = Into;
+    Merged.Swizzle = 0;
+    Merged.Negate = 0;
+    for (int i = 0; i < 4; ++i) {
+      float V = Into.Constant[IRSwizzleSelector(Into, i)];
+      Merged.Constant[i] = Into.Negate ? -V : V;
+    }
+    for (int i = 0; i < 4; ++i) {
+      if (!(Lanes & (1 << i)))
+        continue;
+      float V = From.Constant[IRSwizzleSelector(From, i)];
+      Merged.Constant[Map[i]] = From.Negate ? -V : V;
+    }
+    Into = Merged;
+    return;
+  }
+  if (Into.Swizzle == 0)
+    Into.Swizzle = 0x4321;
+  for (int i = 0; i < 4; ++i) {
+    if (!(Lanes & (1 << i)))
+      continue;
+    Into.Swizzle &= ~(0b1111 << (Map[i] * 4));
+    Into.Swizzle |= (IRSwizzleSelector(From, i) + 1) << (Map[i] * 4);
+  }
+  if (Into.Swizzle == 0x4321)
+    Into.Swizzle = 0;
+}
+
+static bool IsPackable(const ir_instruction &In) {
+  return In.Result >= 0 && IRIsComponentwise(In.Op) &&
+         In.Prior.Kind == ir_operand::NONE && LaneCount(In.Mask) < 4;
+}
+
+static bool Uses(ir_instruction &In, int Value) {
+  for (ir_operand *Op : IROperands(In)) {
+    if (Op->Kind == ir_operand::VALUE && Op->Value == Value)
+      return true;
+  }
+  return false;
+}
+
+// Try to fold B into the lanes A leaves free. The packed instruction takes
+// A's place if B's sources are ready by then, otherwise B's place as long as
+// nothing reads A before it.
+static bool PackPair(ir_function *Function, std::vector<ir_instruction> &Ins,
+                     size_t A, size_t B, const std::vector<int> &DefinedAt,
+                     const std::vector<int> &Tied) {
+  ir_instruction &X = Ins[A];
+  ir_instruction Y = Ins[B];
+  if (Y.Op != X.Op || LaneCount(X.Mask) + LaneCount(Y.Mask) > 4 ||
+      (Tied[Y.Result] && (X.Mask & Y.Mask)))
+    return false;
+
+  int Sources = IRSourceCount(X);
+  bool Match = true;
+  for (int s = 0; s < Sources; ++s)
+    Match &= SameSource(X.Src[s], Y.Src[s]);
+  if (!Match && (IRIsCommutative(X.Op) || X.Op == neocode_instruction::MAD)) {
+    std::swap(Y.Src[0], Y.Src[1]);
+    Match = true;
+    for (int s = 0; s < Sources; ++s)
+      Match &= SameSource(X.Src[s], Y.Src[s]);
+  }
+  if (!Match)
+    return false;
+
+  bool Early = true;
+  for (int s = 0; s < Sources; ++s) {
+    if (Y.Src[s].Kind == ir_operand::VALUE)
+      Early &= DefinedAt[Y.Src[s].Value] < (int)A;
+  }
+  bool Late = true;
+  for (size_t i = A + 1; i <= B && Late; ++i)
+    Late &= !Uses(Ins[i], X.Result);
+  if (!Early && !Late)
+    return false;
+
+  int Map[4] = {0, 1, 2, 3};
+  int Free = 0b1111 & ~X.Mask;
+  int Mask = X.Mask;
+  for (int i = 0; i < 4; ++i) {
+    if (!(Y.Mask & (1 << i)))
+      continue;
+    if (X.Mask & Y.Mask) {
+      Map[i] = 0;
+      while (!(Free & (1 << Map[i])))
+        ++Map[i];
+    }
+    Free &= ~(1 << Map[i]);
+    Mask |= 1 << Map[i];
+  }
+
+  ir_instruction Packed = X;
+  Packed.Result = Function->NewValue();
+  Packed.Mask = Mask;
+  for (int s = 0; s < Sources; ++s)
+    MergeSource(Packed.Src[s], Y.Src[s], Y.Mask, Map);
+
+  ir_operand FromY = IRValue(Packed.Result);
+  FromY.Swizzle = 0x4321;
+  for (int i = 0; i < 4; ++i) {
+    if (!(Y.Mask & (1 << i)))
+      continue;
+    FromY.Swizzle &= ~(0b1111 << (i * 4));
+    FromY.Swizzle |= (Map[i] + 1) << (i * 4);
+  }
+  if (FromY.Swizzle == 0x4321)
+    FromY.Swizzle = 0;
+
+  int OldX = X.Result, OldY = Y.Result;
+  if (Early) {
+    Ins.erase(Ins.begin() + B);
+    Ins[A] = Packed;
+  } else {
+    Ins[B] = Packed;
+    Ins.erase(Ins.begin() + A);
+  }
+  IRReplaceValue(Function, OldX, IRValue(Packed.Result));
+  IRReplaceValue(Function, OldY, FromY);
+  return true;
+}
+
+// Values that a partial write completes in place. Moving their lanes would
+// cost a copy; a swizzled Prior needs one anyway.
+static void TiedValues(ir_function *Function, std::vector<int> &Tied) {
+  Tied.assign(Function->ValueCount, 0);
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      if (In.Prior.Kind == ir_operand::VALUE && In.Prior.Swizzle == 0 &&
+          !In.Prior.Negate)
+        Tied[In.Prior.Value] = 1;
+      // The values of a phi share its register.
+      if (In.Op == IR_PHI) {
+        Tied[In.Result] = 1;
+        for (int s = 0; s < 2; ++s) {
+          if (In.Src[s].Kind == ir_operand::VALUE)
+            Tied[In.Src[s].Value] = 1;
+        }
+      }
+    }
+  }
+}
+
+static void Pack(ir_function *Function) {
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    std::vector<int> Tied;
+    TiedValues(Function, Tied);
+    for (ir_block &Block : Function->Blocks) {
+      std::vector<ir_instruction> &Ins = Block.Instructions;
+      std::vector<int> DefinedAt(Function->ValueCount, -1);
+      for (size_t i = 0; i < Ins.size(); ++i) {
+        if (Ins[i].Result >= 0)
+          DefinedAt[Ins[i].Result] = i;
+      }
+      for (size_t b = 0; b < Ins.size() && !Changed; ++b) {
+        if (!IsPackable(Ins[b]))
+          continue;
+        for (size_t a = 0; a < b && !Changed; ++a) {
+          if (IsPackable(Ins[a]))
+            Changed = PackPair(Function, Ins, a, b, DefinedAt, Tied);
+        }
+      }
+    }
+  }
+}
+
+// Move single-lane values apart so that the register allocator can keep up
+// to four of them in one register. A value written to one component of an
+// output goes to that component, where it can be computed in place.
+static void SpreadScalars(ir_function *Function) {
+  std::vector<int> Tied, UseCount;
+  TiedValues(Function, Tied);
+  IRCountUses(Function, UseCount);
+  std::vector<int> StoreLane(Function->ValueCount, -1);
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      if (In.Op != IR_STORE || In.Src[0].Kind != ir_operand::VALUE ||
+          LaneCount(In.Mask) != 1)
+        continue;
+      int Lane = 0;
+      while (!(In.Mask & (1 << Lane)))
+        ++Lane;
+      StoreLane[In.Src[0].Value] = Lane;
+    }
+  }
+
+  int Next = 0;
+  for (ir_block &B : Function->Blocks) {
+    for (ir_instruction &In : B.Instructions) {
+      if (In.Result < 0 || IRHasSideEffects(In) || Tied[In.Result] ||
+          In.Prior.Kind != ir_operand::NONE || LaneCount(In.Mask) != 1 ||
+          !(IRIsComponentwise(In.Op) || IsScalar(In.Op)))
+        continue;
+      int From = 0;
+      while (!(In.Mask & (1 << From)))
+        ++From;
+      int To = Next++ & 3;
+      if (UseCount[In.Result] == 1 && StoreLane[In.Result] >= 0)
+        To = StoreLane[In.Result];
+      if (To == From)
+        continue;
+
+      if (IRIsComponentwise(In.Op)) {
+        for (int s = 0; s < IRSourceCount(In); ++s) {
+          int Map[4] = {0, 1, 2, 3};
+          Map[From] = To;
+          ir_operand Src = In.Src[s];
+          MergeSource(In.Src[s], Src, In.Mask, Map);
+        }
+      }
+      In.Mask = 1 << To;
+      ir_operand Moved = IRValue(In.Result);
+      Moved.Swizzle = 0x4321;
+      Moved.Swizzle &= ~(0b1111 << (From * 4));
+      Moved.Swizzle |= (To + 1) << (From * 4);
+      IRReplaceValue(Function, In.Result, Moved);
+    }
+  }
+}
+
+void IRPackLanes(ir_function *Function) {
+  Narrow(Function);
+  Pack(Function);
+  SpreadScalars(Function);
+}
@@ -95,6 +95,17 @@ _CheckWhiteSpace:
       ++End;
     }
     std::string TheID = std::string(Current, End - Current);
+    // An identifier straight after a '.' selects fields or components and
+    // never names a symbol of its own.
+    if (Current > State->SourcePtr && Current[-1] == '.') {
+      ReturnToken.Id = TheID;
+      ReturnToken.Type = token::FIELD_SELECTION;
+      ReturnToken.Line = State->LineCurrent;
+      ReturnToken.Offset = State->OffsetCurrent;
+      State->OffsetCurrent += End - Current;
+      Current = End;
+      goto _Exit;
+    }
     symtable_entry *Entry = State->Table->Lookup(TheID);
     if (Entry->SymbolType == 0)
       Entry = State->Table->Insert(TheID, token::IDENTIFIER);
@@ -117,7 +128,8 @@ _CheckWhiteSpace:
     return ((C >= '0') && (C <= '9')) || (C == '.');
   };
 
-  if (IsNumberOrDot(Current[0])) {
+  if (IsNumberOrDot(Current[0]) &&
+      (Current[0] != '.' || (Current[1] >= '0' && Current[1] <= '9'))) {
     bool IsFloat = false;
     char *End = Current;
     while (IsNumberOrDot(*End) && (End < State->EndPtr)) {
@@ -217,19 +229,40 @@ _CheckWhiteSpace:
   }
 
   switch (Current[0]) {
-  case '<': {
+  case '<':
+  case '>': {
+    bool Left = Current[0] == '<';
+    ReturnToken.Type = Current[0];
     if (Current < State->EndPtr) {
-      if (Current[1] == '<') {
-        ReturnToken.Type = token::LEFT_ASSIGN;
+      if (Current[1] == Current[0]) {
+        ReturnToken.Type = Left ? token::LEFT_OP : token::RIGHT_OP;
         ++State->OffsetCurrent;
+        ++Current;
+        if (Current < State->EndPtr && Current[1] == '=') {
+          ReturnToken.Type = Left ? token::LEFT_ASSIGN : token::RIGHT_ASSIGN;
+          ++State->OffsetCurrent;
+          ++Current;
+        }
       } else if (Current[1] == '=') {
-        ReturnToken.Type = token::LE_OP;
+        ReturnToken.Type = Left ? token::LE_OP : token::GE_OP;
         ++State->OffsetCurrent;
+        ++Current;
       }
     }
     goto _BuildToken;
   }
 
+  case '=':
+  case '!': {
+    ReturnToken.Type = Current[0];
+    if (Current < State->EndPtr && Current[1] == '=') {
+      ReturnToken.Type = Current[0] == '=' ? token::EQ_OP : token::NE_OP;
+      ++State->OffsetCurrent;
+      ++Current;
+    }
+    goto _BuildToken;
+  }
+
   case '|': {
     if (Current < State->EndPtr) {
       if (Current[1] == '|') {
@@ -244,6 +277,39 @@ _CheckWhiteSpace:
     }
   }
 
+  case '+':
+  case '-':
+  case '*':
+  case '/': {
+    ReturnToken.Type = Current[0];
+    if (Current < State->EndPtr) {
+      if (Current[1] == '=') {
+        switch (Current[0]) {
+        case '+':
+          ReturnToken.Type = token::ADD_ASSIGN;
+          break;
+        case '-':
+          ReturnToken.Type = token::SUB_ASSIGN;
+          break;
+        case '*':
+          ReturnToken.Type = token::MUL_ASSIGN;
+          break;
+        case '/':
+          ReturnToken.Type = token::DIV_ASSIGN;
+          break;
+        }
+        ++State->OffsetCurrent;
+        ++Current;
+      } else if (Current[1] == Current[0] && Current[0] != '*' &&
+                 Current[0] != '/') {
+        ReturnToken.Type = Current[0] == '+' ? token::INC_OP : token::DEC_OP;
+        ++State->OffsetCurrent;
+        ++Current;
+      }
+    }
+    goto _BuildToken;
+  }
+
   default:
     ReturnToken.Type = Current[0];
   _BuildToken:
@@ -0,0 +1,162 @@
+#include "optimizer.h"
+
+// Instructions that run one after the other with nothing but data flow
+// between them.
+static bool IsStraight(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::FLR:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::MAD:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::CMP:
+  case neocode_instruction::EMPTY:
+    return true;
+  }
+  return false;
+}
+
+static bool IsTemp(const neocode_variable &V) {
+  int Slot = OptRegisterSlot(V);
+  return V.Relative == 0 && Slot >= OPT_SLOT_TEMP && Slot < OPT_SLOT_CONST;
+}
+
+// A register that fits every source field: an attribute or a temp.
+static bool IsNarrow(const neocode_variable &V) {
+  return V.Relative == 0 && OptRegisterSlot(V) < OPT_SLOT_CONST &&
+         V.TypeName.compare("mat4") != 0;
+}
+
+static bool Reads(const neocode_instruction &In, int Slot) {
+  for (int s = 0; s < OptSourceCount(In); ++s) {
+    if (OptRegisterSlot(*OptSource(const_cast<neocode_instruction *>(&In),
+                                   s)) == Slot)
+      return true;
+  }
+  return false;
+}
+
+static bool Writes(const neocode_instruction &In, int Slot) {
+  return OptHasDst(In) && OptRegisterSlot(In.Dst) == Slot;
+}
+
+// Read the source of the copy Copy directly where Use reads its
+// destination.
+static neocode_variable Forward(const neocode_variable &Use,
+                                const neocode_variable &Source) {
+  neocode_variable V = Source;
+  V.Swizzle = 0;
+  for (int i = 0; i < 4; ++i)
+    V.Swizzle |= (OptSwizzleSelector(Source, OptSwizzleSelector(Use, i)) + 1)
+                 << (i * 4);
+  if (V.Swizzle == 0x4321)
+    V.Swizzle = 0;
+  V.Negate = Use.Negate != Source.Negate;
+  return V;
+}
+
+// Later instructions read what the copy at Index read, for as long as both
+// registers keep the components involved. Returns whether any did.
+static bool PropagateForward(neocode_function *Function, size_t Index) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  const neocode_instruction Copy = Ins[Index];
+  int Slot = OptRegisterSlot(Copy.Dst);
+  int From = OptRegisterSlot(Copy.Src1);
+  int Held = OptWriteMask(Copy);
+  bool Changed = false;
+  for (size_t i = Index + 1; i < Ins.size() && IsStraight(Ins[i]); ++i) {
+    neocode_instruction &In = Ins[i];
+    for (int s = 0; s < OptSourceCount(In); ++s) {
+      neocode_variable *V = OptSource(&In, s);
+      if (OptRegisterSlot(*V) != Slot || V->Relative ||
+          (OptReadMask(In, s) & ~Held))
+        continue;
+      *V = Forward(*V, Copy.Src1);
+      Changed = true;
+    }
+    if (Writes(In, From))
+      break;
+    if (Writes(In, Slot))
+      Held &= ~OptWriteMask(In);
+    if (!Held)
+      break;
+  }
+  return Changed;
+}
+
+// The instruction computing what the copy at Index moves writes the
+// destination of the copy itself, provided the value is not needed in its
+// temp otherwise. Returns whether that happened.
+static bool CoalesceBackward(neocode_function *Function, size_t Index,
+                             const opt_live_set &LiveAfter) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  neocode_instruction &Copy = Ins[Index];
+  int Slot = OptRegisterSlot(Copy.Src1);
+  int Target = OptRegisterSlot(Copy.Dst);
+  int Mask = OptWriteMask(Copy);
+  if (Copy.Src1.Negate || LiveAfter.Mask[Slot] & Mask)
+    return false;
+  for (int i = 0; i < 4; ++i) {
+    if ((Mask & (1 << i)) && OptSwizzleSelector(Copy.Src1, i) != i)
+      return false;
+  }
+
+  for (size_t k = Index; k-- > 0 && IsStraight(Ins[k]);) {
+    neocode_instruction &In = Ins[k];
+    if (Writes(In, Slot)) {
+      if (In.Type == neocode_instruction::MOVA ||
+          In.Dst.Swizzle != Copy.Dst.Swizzle || OptWriteMask(In) != Mask)
+        return false;
+      neocode_variable Dst = Copy.Dst;
+      Dst.Swizzle = In.Dst.Swizzle;
+      In.Dst = Dst;
+      Copy.Type = neocode_instruction::EMPTY;
+      return true;
+    }
+    if (Reads(In, Slot) || Reads(In, Target) || Writes(In, Target))
+      return false;
+  }
+  return false;
+}
+
+// Copies are what is left of the argument and result moves of an inlined
+// call, and of values the IR kept in a temp across a store. A copy out of
+// an attribute or a temp is read from there directly, and one into an
+// output is written there by the instruction computing it. Dead code
+// elimination then drops the copies nothing reads any more.
+void OptPropagateCopies(neocode_program *Program) {
+  for (neocode_function &F : Program->Functions) {
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      std::vector<opt_live_set> LiveAfter;
+      OptComputeLiveness(&F, LiveAfter);
+      for (size_t i = 0; i < F.Instructions.size() && !Changed; ++i) {
+        neocode_instruction &In = F.Instructions[i];
+        if (In.Type != neocode_instruction::MOV || !IsTemp(In.Dst) ||
+            !IsNarrow(In.Src1))
+          continue;
+        if (OptRegisterSlot(In.Src1) != OptRegisterSlot(In.Dst))
+          Changed |= PropagateForward(&F, i);
+      }
+      for (size_t i = 0; i < F.Instructions.size() && !Changed; ++i) {
+        neocode_instruction &In = F.Instructions[i];
+        if (In.Type == neocode_instruction::MOV && IsTemp(In.Src1) &&
+            OptRegisterSlot(In.Src1) != OptRegisterSlot(In.Dst))
+          Changed = CoalesceBackward(&F, i, LiveAfter[i]);
+      }
+    }
+  }
+}
@@ -0,0 +1,139 @@
+#include "optimizer.h"
+#include <set>
+
+static void MarkReachable(neocode_program *Program, const std::string &Name,
+                          std::set<std::string> &Reached) {
+  if (Reached.count(Name))
+    return;
+  neocode_function *F = OptFindFunction(Program, Name);
+  if (!F)
+    return;
+  Reached.insert(Name);
+  for (std::string &Callee : F->Callees) {
+    MarkReachable(Program, Callee, Reached);
+  }
+}
+
+static void EliminateUnreachableFunctions(neocode_program *Program) {
+  if (!OptFindFunction(Program, "main"))
+    return;
+  std::set<std::string> Reached;
+  MarkReachable(Program, "main", Reached);
+
+  std::vector<neocode_function> Kept;
+  for (neocode_function &F : Program->Functions) {
+    if (Reached.count(F.Name))
+      Kept.push_back(F);
+  }
+  Program->Functions = Kept;
+}
+
+// Liveness comes from OptComputeLiveness so that values carried around a
+// loop stay alive; removing a dead instruction can kill the ones feeding it,
+// so this repeats until nothing more goes.
+static void EliminateDeadInstructions(neocode_function *Function) {
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    std::vector<opt_live_set> LiveAfter;
+    OptComputeLiveness(Function, LiveAfter);
+    std::vector<neocode_instruction> Kept;
+    for (size_t i = 0; i < Function->Instructions.size(); ++i) {
+      neocode_instruction &In = Function->Instructions[i];
+      bool Dead = In.Type == neocode_instruction::EMPTY;
+      if (OptHasDst(In))
+        Dead |= (LiveAfter[i].Mask[OptRegisterSlot(In.Dst)] &
+                 OptWriteMask(In)) == 0;
+      if (Dead) {
+        Changed = true;
+        continue;
+      }
+      Kept.push_back(In);
+    }
+    Function->Instructions = Kept;
+  }
+
+  std::set<std::string> Referenced;
+  for (neocode_instruction &In : Function->Instructions) {
+    if (OptHasDst(In))
+      Referenced.insert(In.Dst.Name);
+    for (int s = 0; s < OptSourceCount(In); ++s)
+      Referenced.insert(OptSource(&In, s)->Name);
+  }
+  for (neocode_variable &V : Function->Parameters)
+    Referenced.insert(V.Name);
+  std::vector<neocode_variable> Variables;
+  for (neocode_variable &V : Function->Variables) {
+    if (Referenced.count(V.Name))
+      Variables.push_back(V);
+  }
+  Function->Variables = Variables;
+}
+
+static void EliminateUnusedGlobals(neocode_program *Program) {
+  int Used[OPT_SLOT_COUNT] = {0};
+  for (neocode_function &F : Program->Functions) {
+    for (neocode_instruction &In : F.Instructions) {
+      for (int s = 0; s < OptSourceCount(In); ++s)
+        Used[OptRegisterSlot(*OptSource(&In, s))] = 1;
+    }
+  }
+  for (int Register : Program->PreshaderInputs)
+    Used[Register] = 1;
+
+  // Attributes that survive are packed down to the lowest input registers so
+  // the freed ones become available to the vertex loader. Attributes that
+  // share a register move together. The inputs of a geometry shader are laid
+  // out by the vertex shader and stay where they are, and so do those of a
+  // shader set, where every program has to agree on them.
+  bool Fixed =
+      Program->Options.Geometry || Program->Options.SharedGlobals.size();
+  int InputMap[OPT_SLOT_TEMP];
+  for (int i = 0; i < OPT_SLOT_TEMP; ++i)
+    InputMap[i] = -1;
+  int NextInput = 0;
+
+  std::vector<neocode_variable> Kept;
+  for (neocode_variable &V : Program->Globals) {
+    if (V.RegisterType > 0) {
+      Kept.push_back(V);
+      continue;
+    }
+    int Count = V.RegisterCount();
+    bool IsUsed = false;
+    for (int i = 0; i < Count; ++i)
+      IsUsed |= Used[OptRegisterSlot(V) + i] != 0;
+    if (!IsUsed)
+      continue;
+
+    if (V.Register < OPT_SLOT_TEMP && !Fixed) {
+      if (InputMap[V.Register] < 0)
+        InputMap[V.Register] = NextInput++;
+      V.Register = InputMap[V.Register];
+    }
+    Kept.push_back(V);
+  }
+  Program->Globals = Kept;
+
+  for (neocode_function &F : Program->Functions) {
+    for (neocode_instruction &In : F.Instructions) {
+      for (int s = 0; s < OptSourceCount(In); ++s) {
+        neocode_variable *Src = OptSource(&In, s);
+        if (Src->RegisterType == 0 && Src->Register < OPT_SLOT_TEMP &&
+            InputMap[Src->Register] >= 0)
+          Src->Register = InputMap[Src->Register];
+      }
+    }
+  }
+
+  for (int i = 0; i < 8 && !Fixed; ++i)
+    Program->Registers.Vertex[i] = i < NextInput;
+}
+
+void OptEliminateDeadCode(neocode_program *Program) {
+  EliminateUnreachableFunctions(Program);
+  for (neocode_function &F : Program->Functions) {
+    EliminateDeadInstructions(&F);
+  }
+  EliminateUnusedGlobals(Program);
+}
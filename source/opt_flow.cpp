@@ -0,0 +1,114 @@
+#include "optimizer.h"
+
+static int InvertCompare(int Compare) {
+  switch (Compare) {
+  case CMP_EQ:
+    return CMP_NE;
+  case CMP_NE:
+    return CMP_EQ;
+  case CMP_LT:
+    return CMP_GE;
+  case CMP_LE:
+    return CMP_GT;
+  case CMP_GT:
+    return CMP_LE;
+  case CMP_GE:
+    return CMP_LT;
+  }
+  return Compare;
+}
+
+static bool IsIf(const neocode_instruction &In) {
+  return In.Type == neocode_instruction::IFC ||
+         In.Type == neocode_instruction::IFU ||
+         In.Type == neocode_instruction::JMPU;
+}
+
+// The shader unit checks for the end of a loop or of a then part after each
+// instruction it completes, so the last instruction of a body has to be one
+// that falls through: an inner loop, an inner if or a call there would skip
+// the outer test. An else part and what a JMPU skips simply fall through.
+// Bodies that dead code elimination emptied are dropped altogether. An if
+// with only an else part tests the opposite instead, and a JMPU stands for
+// an IFU whose then part is empty. An IFU around nothing but a call becomes
+// a CALLU.
+static void FinishControlFlow(neocode_function *Function) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  std::vector<neocode_instruction> Kept;
+  std::vector<int> Checked;
+  for (neocode_instruction &In : Ins) {
+    if (In.Type == neocode_instruction::EMPTY)
+      continue;
+    if (In.Type == neocode_instruction::ENDLOOP && Kept.size() &&
+        Kept.back().Type == neocode_instruction::LOOP) {
+      Kept.pop_back();
+      continue;
+    }
+    if (In.Type == neocode_instruction::ENDIF && Kept.size() &&
+        Kept.back().Type == neocode_instruction::ELSE) {
+      Kept.pop_back();
+      Checked.back() = 1;
+    }
+    if (In.Type == neocode_instruction::ENDIF && Kept.size() &&
+        IsIf(Kept.back())) {
+      if (Kept.back().Type == neocode_instruction::IFC)
+        Kept.pop_back();
+      Kept.pop_back();
+      Checked.pop_back();
+      continue;
+    }
+    size_t Size = Kept.size();
+    if (In.Type == neocode_instruction::ENDIF && Checked.back() && Size > 1 &&
+        Kept[Size - 1].Type == neocode_instruction::CALL &&
+        Kept[Size - 2].Type == neocode_instruction::IFU) {
+      neocode_instruction Call = Kept.back();
+      Call.Type = neocode_instruction::CALLU;
+      Call.Src1 = Kept[Size - 2].Src1;
+      Kept.pop_back();
+      Kept.back() = Call;
+      Checked.pop_back();
+      continue;
+    }
+    if (In.Type == neocode_instruction::ELSE && Size &&
+        Kept.back().Type == neocode_instruction::IFC) {
+      int &Compare = Kept[Size - 2].Dst.Const.Integer.X;
+      Compare = InvertCompare(Compare);
+      continue;
+    }
+    if (In.Type == neocode_instruction::ELSE && Size &&
+        Kept.back().Type == neocode_instruction::IFU) {
+      Kept.back().Type = neocode_instruction::JMPU;
+      Checked.back() = 0;
+      continue;
+    }
+
+    bool Check = In.Type == neocode_instruction::ENDLOOP ||
+                 In.Type == neocode_instruction::ELSE ||
+                 (In.Type == neocode_instruction::ENDIF && Checked.back());
+    if (Check && Kept.size()) {
+      neocode_instruction &Last = Kept.back();
+      if (Last.Type == neocode_instruction::ENDLOOP ||
+          Last.Type == neocode_instruction::ENDIF ||
+          Last.Type == neocode_instruction::CALL ||
+          Last.Type == neocode_instruction::CALLU ||
+          Last.Type == neocode_instruction::INVOKE) {
+        neocode_instruction Nop;
+        Nop.Type = neocode_instruction::NOP;
+        Kept.push_back(Nop);
+      }
+    }
+    if (IsIf(In))
+      Checked.push_back(1);
+    else if (In.Type == neocode_instruction::ELSE)
+      Checked.back() = 0;
+    else if (In.Type == neocode_instruction::ENDIF)
+      Checked.pop_back();
+    Kept.push_back(In);
+  }
+  Ins = Kept;
+}
+
+void OptFinishControlFlow(neocode_program *Program) {
+  for (neocode_function &F : Program->Functions)
+    FinishControlFlow(&F);
+}
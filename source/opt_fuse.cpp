@@ -0,0 +1,139 @@
+#include "optimizer.h"
+
+static bool IsConstant(const neocode_variable &V) {
+  return V.RegisterType <= 0 && V.Register >= OPT_SLOT_CONST;
+}
+
+static bool IsTemp(const neocode_variable &V) {
+  return V.RegisterType == 0 && V.Register >= OPT_SLOT_TEMP &&
+         V.Register < OPT_SLOT_CONST;
+}
+
+static bool IsMatrixRow(const neocode_variable &V) {
+  return V.TypeName.compare("mat4") == 0;
+}
+
+static bool IsBarrier(const neocode_instruction &In) {
+  return In.Type == neocode_instruction::CALL ||
+         In.Type == neocode_instruction::CALLU ||
+         In.Type == neocode_instruction::INVOKE ||
+         In.Type == neocode_instruction::MOVA ||
+         In.Type == neocode_instruction::LOOP ||
+         In.Type == neocode_instruction::ENDLOOP ||
+         In.Type == neocode_instruction::CMP ||
+         In.Type == neocode_instruction::IFC ||
+         In.Type == neocode_instruction::IFU ||
+         In.Type == neocode_instruction::JMPU ||
+         In.Type == neocode_instruction::ELSE ||
+         In.Type == neocode_instruction::ENDIF ||
+         In.Type == neocode_instruction::EMIT;
+}
+
+// Rewrite a MUL operand so that it reads, for every lane the ADD writes, the
+// value the MUL used for the product component the ADD picked up.
+static neocode_variable Compose(const neocode_variable &MulSrc,
+                                const neocode_variable &Product, int Lanes) {
+  neocode_variable V = MulSrc;
+  V.Swizzle = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (!(Lanes & (1 << i)))
+      continue;
+    int Component = OptSwizzleSelector(Product, i);
+    V.Swizzle |= (OptSwizzleSelector(MulSrc, Component) + 1) << (i * 4);
+  }
+  if (V.Swizzle == 0x4321)
+    V.Swizzle = 0;
+  return V;
+}
+
+// Try to fold the MUL that produced operand Index of the ADD at AddIndex.
+static bool FuseAt(neocode_function *Function, size_t AddIndex, int Index,
+                   std::vector<opt_live_set> &LiveAfter) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  neocode_instruction &Add = Ins[AddIndex];
+  neocode_variable &Product = *OptSource(&Add, Index);
+  neocode_variable &Addend = *OptSource(&Add, 1 - Index);
+  if (!IsTemp(Product))
+    return false;
+  int Slot = OptRegisterSlot(Product);
+  int Needed = OptReadMask(Add, Index);
+
+  size_t MulIndex = AddIndex;
+  while (MulIndex-- > 0) {
+    neocode_instruction &In = Ins[MulIndex];
+    if (IsBarrier(In))
+      return false;
+    if (OptHasDst(In) && OptRegisterSlot(In.Dst) == Slot &&
+        (OptWriteMask(In) & Needed))
+      break;
+  }
+  if (MulIndex >= AddIndex)
+    return false;
+
+  neocode_instruction &Mul = Ins[MulIndex];
+  int Produced = OptWriteMask(Mul);
+  if (Mul.Type != neocode_instruction::MUL || (Needed & ~Produced) ||
+      IsMatrixRow(Mul.Src1) || IsMatrixRow(Mul.Src2) ||
+      OptRegisterSlot(Mul.Src1) == Slot || OptRegisterSlot(Mul.Src2) == Slot)
+    return false;
+
+  // The MUL has to disappear: nothing else may read the product, and its
+  // factors must still hold the same values where the ADD sits.
+  int Kept = LiveAfter[AddIndex].Mask[Slot] & Produced;
+  if (OptRegisterSlot(Add.Dst) == Slot)
+    Kept &= ~OptWriteMask(Add);
+  if (Kept)
+    return false;
+  for (size_t i = MulIndex + 1; i < AddIndex; ++i) {
+    neocode_instruction &In = Ins[i];
+    for (int s = 0; s < OptSourceCount(In); ++s) {
+      if (OptRegisterSlot(*OptSource(&In, s)) == Slot &&
+          (OptReadMask(In, s) & Produced))
+        return false;
+    }
+    if (!OptHasDst(In))
+      continue;
+    int DstSlot = OptRegisterSlot(In.Dst);
+    if (DstSlot == OptRegisterSlot(Mul.Src1) ||
+        DstSlot == OptRegisterSlot(Mul.Src2) || DstSlot == Slot)
+      return false;
+  }
+
+  int Lanes = OptWriteMask(Add);
+  neocode_variable A = Compose(Mul.Src1, Product, Lanes);
+  neocode_variable B = Compose(Mul.Src2, Product, Lanes);
+  if (Product.Negate)
+    A.Negate = !A.Negate;
+
+  // MAD reaches the constant file through src2, MADI through src3; the other
+  // operands must be inputs or temps.
+  if (IsConstant(A))
+    std::swap(A, B);
+  if (IsConstant(A) || (IsConstant(B) && IsConstant(Addend)))
+    return false;
+
+  neocode_instruction Mad = Add;
+  Mad.Type = neocode_instruction::MAD;
+  Mad.Src1 = A;
+  Mad.Src2 = B;
+  Mad.Src3 = Addend;
+  Ins[AddIndex] = Mad;
+  Ins.erase(Ins.begin() + MulIndex);
+  return true;
+}
+
+void OptFuseMultiplyAdd(neocode_program *Program) {
+  for (neocode_function &F : Program->Functions) {
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      std::vector<opt_live_set> LiveAfter;
+      OptComputeLiveness(&F, LiveAfter);
+      for (size_t i = 0; i < F.Instructions.size() && !Changed; ++i) {
+        if (F.Instructions[i].Type != neocode_instruction::ADD)
+          continue;
+        Changed = FuseAt(&F, i, 0, LiveAfter) || FuseAt(&F, i, 1, LiveAfter);
+      }
+    }
+  }
+}
@@ -0,0 +1,341 @@
+#include "optimizer.h"
+#include <functional>
+#include <map>
+#include <set>
+
+static neocode_variable TempRegister(int Slot) {
+  return (neocode_variable){"", "", ast_node::STRUCT, Slot, 0, {0}, 0};
+}
+
+static bool IsTemp(const neocode_variable &V) {
+  return V.RegisterType == 0 && V.Register >= OPT_SLOT_TEMP &&
+         V.Register < OPT_SLOT_CONST;
+}
+
+static bool ContainsCall(neocode_function *Function) {
+  for (neocode_instruction &In : Function->Instructions) {
+    if (In.Type == neocode_instruction::CALL ||
+        In.Type == neocode_instruction::INVOKE)
+      return true;
+  }
+  return false;
+}
+
+static neocode_instruction Move(const neocode_variable &Dst,
+                                const neocode_variable &Src) {
+  neocode_instruction In;
+  In.Type = neocode_instruction::MOV;
+  In.Dst = Dst;
+  In.Src1 = Src;
+  return In;
+}
+
+static int TempsLiveAround(neocode_function *Function, size_t First,
+                           size_t Last, int Exclude) {
+  std::vector<opt_live_set> LiveAfter;
+  OptComputeLiveness(Function, LiveAfter);
+
+  opt_live_set Before = LiveAfter[First];
+  neocode_instruction &In = Function->Instructions[First];
+  if (OptHasDst(In))
+    Before.Mask[OptRegisterSlot(In.Dst)] &= ~OptWriteMask(In);
+  for (int s = 0; s < OptSourceCount(In); ++s)
+    Before.Mask[OptRegisterSlot(*OptSource(&In, s))] |= OptReadMask(In, s);
+
+  int Busy = 0;
+  for (int t = 0; t < 16; ++t) {
+    if (OPT_SLOT_TEMP + t == Exclude)
+      continue;
+    if (Before.Mask[OPT_SLOT_TEMP + t] || LiveAfter[Last].Mask[OPT_SLOT_TEMP + t])
+      Busy |= 1 << t;
+  }
+  return Busy;
+}
+
+// Replace the INVOKE at Index with a copy of the callee's body. Every temp of
+// the callee is renamed onto a register that is free across the call, with
+// r15 landing directly in the caller's destination when possible.
+static bool InlineCall(neocode_function *Caller, size_t Index,
+                       neocode_function *Callee) {
+  neocode_instruction Call = Caller->Instructions[Index];
+  int Busy = TempsLiveAround(Caller, Index, Index, Call.Dst.Register) |
+             1 << (Call.Dst.Register - OPT_SLOT_TEMP);
+
+  std::map<int, int> Map;
+  bool ReturnToDst = Call.Dst.Swizzle == 0;
+  for (neocode_variable &Arg : Call.Args)
+    ReturnToDst &= OptRegisterSlot(Arg) != Call.Dst.Register;
+  if (ReturnToDst)
+    Map[OPT_SLOT_RETURN] = Call.Dst.Register;
+
+  auto MapTemp = [&](const neocode_variable &V) -> bool {
+    if (!IsTemp(V) || Map.count(V.Register))
+      return true;
+    for (int t = 0; t < 16; ++t) {
+      if (!(Busy & (1 << t))) {
+        Busy |= 1 << t;
+        Map[V.Register] = OPT_SLOT_TEMP + t;
+        return true;
+      }
+    }
+    return false;
+  };
+
+  bool Fits = MapTemp(TempRegister(OPT_SLOT_RETURN));
+  for (neocode_variable &P : Callee->Parameters)
+    Fits &= MapTemp(P);
+  for (neocode_instruction &In : Callee->Instructions) {
+    if (OptHasDst(In))
+      Fits &= MapTemp(In.Dst);
+    for (int s = 0; s < OptSourceCount(In); ++s)
+      Fits &= MapTemp(*OptSource(&In, s));
+  }
+  if (!Fits)
+    return false;
+
+  auto Rename = [&](neocode_variable &V) {
+    if (IsTemp(V)) {
+      V.Register = Map[V.Register];
+      V.Name = "";
+    }
+  };
+
+  std::vector<neocode_instruction> Body;
+  for (size_t i = 0; i < Callee->Parameters.size() && i < Call.Args.size();
+       ++i) {
+    neocode_variable P = Callee->Parameters[i];
+    Rename(P);
+    Body.push_back(Move(P, Call.Args[i]));
+  }
+  for (neocode_instruction In : Callee->Instructions) {
+    if (In.Type == neocode_instruction::EMPTY)
+      continue;
+    if (OptHasDst(In))
+      Rename(In.Dst);
+    for (int s = 0; s < OptSourceCount(In); ++s)
+      Rename(*OptSource(&In, s));
+    Body.push_back(In);
+  }
+  if (!ReturnToDst)
+    Body.push_back(Move(Call.Dst, TempRegister(Map[OPT_SLOT_RETURN])));
+
+  Caller->Instructions.erase(Caller->Instructions.begin() + Index);
+  Caller->Instructions.insert(Caller->Instructions.begin() + Index,
+                              Body.begin(), Body.end());
+  return true;
+}
+
+// Register calling convention: arguments are moved into the callee's own
+// parameter registers, the callee leaves its result in r15 and clobbers
+// whatever else it touches. ResolveCallConflicts later renames callee
+// registers so that nothing the caller keeps live across the call is hit.
+static void EmitCall(neocode_function *Caller, size_t Index,
+                     neocode_function *Callee) {
+  neocode_instruction Call = Caller->Instructions[Index];
+  std::vector<neocode_instruction> Sequence;
+  neocode_instruction In;
+  In.Type = neocode_instruction::CALL;
+  In.ExtraData = Callee->Name;
+  In.Dst = TempRegister(OPT_SLOT_RETURN);
+  for (size_t i = 0; i < Callee->Parameters.size() && i < Call.Args.size();
+       ++i) {
+    neocode_variable P = TempRegister(Callee->Parameters[i].Register);
+    Sequence.push_back(Move(P, Call.Args[i]));
+    In.Args.push_back(P);
+  }
+  Sequence.push_back(In);
+  Sequence.push_back(Move(Call.Dst, In.Dst));
+
+  Caller->Instructions.erase(Caller->Instructions.begin() + Index);
+  Caller->Instructions.insert(Caller->Instructions.begin() + Index,
+                              Sequence.begin(), Sequence.end());
+}
+
+// Operands of a call sequence that name the callee's registers rather than
+// the caller's own: the argument moves' destinations, the CALL itself and
+// the r15 read right after it.
+static bool IsCallOperand(neocode_function *Function, size_t Index,
+                          neocode_variable *V) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  if (Ins[Index].Type == neocode_instruction::CALL)
+    return true;
+  if (Index > 0 && Ins[Index - 1].Type == neocode_instruction::CALL)
+    return V == &Ins[Index].Src1;
+  for (size_t c = Index + 1; c < Ins.size(); ++c) {
+    if (Ins[c].Type == neocode_instruction::CALL)
+      return c - Index <= Ins[c].Args.size() && V == &Ins[Index].Dst;
+    if (Ins[c].Type != neocode_instruction::MOV)
+      break;
+  }
+  return false;
+}
+
+static void RenameFunction(neocode_function *Function, int Forbidden) {
+  int Used = 0;
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  auto ForEachOwnTemp = [&](std::function<void(neocode_variable &)> Fn) {
+    for (size_t i = 0; i < Ins.size(); ++i) {
+      std::vector<neocode_variable *> Operands;
+      if (OptHasDst(Ins[i]))
+        Operands.push_back(&Ins[i].Dst);
+      for (int s = 0; s < OptSourceCount(Ins[i]); ++s)
+        Operands.push_back(OptSource(&Ins[i], s));
+      for (neocode_variable *V : Operands) {
+        if (IsTemp(*V) && V->Register != OPT_SLOT_RETURN &&
+            !IsCallOperand(Function, i, V))
+          Fn(*V);
+      }
+    }
+    for (neocode_variable &V : Function->Variables)
+      Fn(V);
+    for (neocode_variable &V : Function->Parameters)
+      Fn(V);
+  };
+  ForEachOwnTemp([&](neocode_variable &V) {
+    Used |= 1 << (V.Register - OPT_SLOT_TEMP);
+  });
+
+  int Map[16];
+  int Taken = 1 << 15;
+  for (int t = 0; t < 16; ++t) {
+    Map[t] = t;
+    if ((Used & (1 << t)) && !(Forbidden & (1 << t)))
+      Taken |= 1 << t;
+  }
+  for (int t = 0; t < 16; ++t) {
+    if (!(Used & (1 << t)) || !(Forbidden & (1 << t)))
+      continue;
+    for (int r = 0; r < 16; ++r) {
+      if (!((Taken | Forbidden) & (1 << r))) {
+        Taken |= 1 << r;
+        Map[t] = r;
+        break;
+      }
+    }
+  }
+  ForEachOwnTemp([&](neocode_variable &V) {
+    V.Register = OPT_SLOT_TEMP + Map[V.Register - OPT_SLOT_TEMP];
+  });
+}
+
+static void ResolveCallConflicts(neocode_program *Program) {
+  std::map<std::string, int> Forbidden;
+  for (size_t f = Program->Functions.size(); f-- > 0;) {
+    neocode_function &F = Program->Functions[f];
+    if (Forbidden.count(F.Name)) {
+      RenameFunction(&F, Forbidden[F.Name]);
+      for (neocode_function &Caller : Program->Functions) {
+        std::vector<neocode_instruction> &Ins = Caller.Instructions;
+        for (size_t c = 0; c < Ins.size(); ++c) {
+          if (Ins[c].Type != neocode_instruction::CALL ||
+              Ins[c].ExtraData.compare(F.Name) != 0)
+            continue;
+          size_t n = Ins[c].Args.size();
+          for (size_t i = 0; i < n; ++i) {
+            Ins[c].Args[i].Register = F.Parameters[i].Register;
+            Ins[c - n + i].Dst.Register = F.Parameters[i].Register;
+          }
+        }
+      }
+    }
+
+    std::vector<neocode_instruction> &Ins = F.Instructions;
+    for (size_t c = 0; c < Ins.size(); ++c) {
+      if (Ins[c].Type != neocode_instruction::CALL)
+        continue;
+      size_t n = Ins[c].Args.size();
+      neocode_instruction &Ret = Ins[c + 1];
+      int Exclude = Ret.Dst.Swizzle == 0 ? Ret.Dst.Register : -1;
+      Forbidden[Ins[c].ExtraData] |=
+          Forbidden[F.Name] | TempsLiveAround(&F, c - n, c + 1, Exclude);
+    }
+  }
+}
+
+// Whether calling From can lead back into To.
+static bool Reaches(neocode_program *Program, const std::string &From,
+                    const std::string &To, std::set<std::string> &Seen) {
+  if (From.compare(To) == 0)
+    return true;
+  neocode_function *F = OptFindFunction(Program, From);
+  if (!F || !Seen.insert(From).second)
+    return false;
+  for (neocode_instruction &In : F->Instructions) {
+    if ((In.Type == neocode_instruction::INVOKE ||
+         In.Type == neocode_instruction::CALL) &&
+        Reaches(Program, In.ExtraData, To, Seen))
+      return true;
+  }
+  return false;
+}
+
+// GLSL has no recursion, and the shader unit would have nowhere to keep
+// the arguments and temps of the outer calls.
+static void CheckCalls(neocode_program *Program) {
+  for (neocode_function &F : Program->Functions) {
+    std::set<std::string> Checked;
+    for (neocode_instruction &In : F.Instructions) {
+      if (In.Type != neocode_instruction::INVOKE ||
+          !Checked.insert(In.ExtraData).second)
+        continue;
+      std::set<std::string> Seen;
+      if (!OptFindFunction(Program, In.ExtraData))
+        CGNeoError(Program, "%s: call to undefined function %s()",
+                   F.Name.c_str(), In.ExtraData.c_str());
+      else if (Reaches(Program, In.ExtraData, F.Name, Seen))
+        CGNeoError(Program, "%s: recursive call to %s()", F.Name.c_str(),
+                   In.ExtraData.c_str());
+    }
+  }
+}
+
+void OptLowerCalls(neocode_program *Program) {
+  CheckCalls(Program);
+  if (Program->ErrorCount)
+    return;
+
+  std::map<std::string, int> CallSites;
+  for (neocode_function &F : Program->Functions) {
+    for (neocode_instruction &In : F.Instructions) {
+      if (In.Type == neocode_instruction::INVOKE)
+        ++CallSites[In.ExtraData];
+    }
+  }
+
+  // Inlining trades the call sequence (argument moves, CALL and the result
+  // move) for a copy of the callee. Small or single-use callees always win;
+  // anything else is inlined only while the program stays within the
+  // instruction memory, and not at all when building for size at level 4
+  // and up. CALL encodes the callee length in 8 bits, so longer bodies have
+  // to be inlined regardless.
+  for (neocode_function &F : Program->Functions) {
+    for (size_t i = 0; i < F.Instructions.size(); ++i) {
+      neocode_instruction &In = F.Instructions[i];
+      if (In.Type != neocode_instruction::INVOKE)
+        continue;
+      neocode_function *Callee = OptFindFunction(Program, In.ExtraData);
+      int CallCost = In.Args.size() + 2;
+      int Size = OptFunctionSize(Callee);
+      bool Fits = Program->Options.SizeLevel < 4 &&
+                  OptProgramSize(Program) + Size - CallCost <=
+                      OPT_MAX_PROGRAM_SIZE;
+      bool Inline = Program->Options.OptLevel >= 1 && !ContainsCall(Callee) &&
+                    (Size <= CallCost || CallSites[Callee->Name] == 1 || Fits);
+      Inline |= Size > OPT_MAX_CALL_SIZE && !ContainsCall(Callee);
+      size_t Before = F.Instructions.size();
+      if (!Inline || !InlineCall(&F, i, Callee))
+        EmitCall(&F, i, Callee);
+      i += F.Instructions.size() - Before;
+    }
+  }
+
+  ResolveCallConflicts(Program);
+
+  for (neocode_function &F : Program->Functions) {
+    F.Callees.clear();
+    for (neocode_instruction &In : F.Instructions) {
+      if (In.Type == neocode_instruction::CALL)
+        F.Callees.push_back(In.ExtraData);
+    }
+  }
+}
@@ -0,0 +1,162 @@
+#include "optimizer.h"
+#include <map>
+
+// Straight-line instructions only: flow control names places in its own
+// function, and a CALL inside a subroutine would nest one level deeper.
+static bool IsOutlinable(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::MOV:
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::FLR:
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::MAD:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::CMP:
+    return true;
+  }
+  return false;
+}
+
+static void AppendOperand(std::string &Key, const neocode_variable &V) {
+  Key += std::to_string(V.Register) + "," + std::to_string(V.RegisterType) +
+         "," + std::to_string(V.Swizzle) + "," + std::to_string(V.Negate) +
+         "," + std::to_string(V.Relative) +
+         (V.TypeName.compare("mat4") == 0 ? "m;" : ";");
+}
+
+static std::string InstructionKey(const neocode_instruction &In) {
+  std::string Key = std::to_string(In.Type) + ":";
+  AppendOperand(Key, In.Dst);
+  for (int s = 0; s < OptSourceCount(In); ++s)
+    AppendOperand(Key, *OptSource(const_cast<neocode_instruction *>(&In), s));
+  if (In.Type == neocode_instruction::CMP)
+    Key += std::to_string(In.Dst.Const.Integer.X);
+  return Key;
+}
+
+struct opt_site {
+  size_t Function;
+  size_t Index;
+};
+
+// A sequence of Length instructions found at Count places costs
+// Count * Length words inline, and Count CALLs plus one copy outlined.
+static int OutlineGain(int Count, int Length) {
+  return Count * Length - Count - Length;
+}
+
+// The sequence that saves the most words, as the places it starts at.
+// Windows are compared by the ids of their instructions, one length after
+// the other until no window of a length repeats.
+static int FindSequence(const std::vector<int> &Ids, std::vector<size_t> &Best,
+                        int &BestLength) {
+  std::vector<int> Run(Ids.size() + 1, 0);
+  for (size_t i = Ids.size(); i-- > 0;)
+    Run[i] = Ids[i] < 0 ? 0 : Run[i + 1] + 1;
+
+  int BestGain = 0;
+  for (int Length = 2; Length <= OPT_MAX_CALL_SIZE; ++Length) {
+    std::map<std::vector<int>, std::vector<size_t>> Windows;
+    for (size_t i = 0; i + Length <= Ids.size(); ++i) {
+      if (Run[i] >= Length)
+        Windows[std::vector<int>(Ids.begin() + i, Ids.begin() + i + Length)]
+            .push_back(i);
+    }
+    bool Repeats = false;
+    for (auto &W : Windows) {
+      if (W.second.size() < 2)
+        continue;
+      Repeats = true;
+      std::vector<size_t> Starts;
+      for (size_t i : W.second) {
+        if (Starts.empty() || i >= Starts.back() + Length)
+          Starts.push_back(i);
+      }
+      int Gain = OutlineGain(Starts.size(), Length);
+      if (Gain > BestGain) {
+        BestGain = Gain;
+        Best = Starts;
+        BestLength = Length;
+      }
+    }
+    if (!Repeats)
+      break;
+  }
+  return BestGain;
+}
+
+// Code-size pass: an instruction sequence that repeats, in one function or
+// across several, moves into a subroutine of its own and every copy becomes
+// a CALL. The copies are identical down to the registers, so nothing has to
+// be passed or renamed. Sequences are taken greedily, the one that saves
+// the most words first.
+void OptOutlineSequences(neocode_program *Program) {
+  size_t Original = Program->Functions.size();
+  for (neocode_function &F : Program->Functions) {
+    std::vector<neocode_instruction> &Ins = F.Instructions;
+    for (size_t i = Ins.size(); i-- > 0;) {
+      if (Ins[i].Type == neocode_instruction::EMPTY)
+        Ins.erase(Ins.begin() + i);
+    }
+  }
+
+  for (int Count = 0;; ++Count) {
+    std::map<std::string, int> Keys;
+    std::vector<int> Ids;
+    std::vector<opt_site> Sites;
+    for (size_t f = 0; f < Original; ++f) {
+      neocode_function &F = Program->Functions[f];
+      std::vector<neocode_instruction> &Ins = F.Instructions;
+      for (size_t i = 0; i < Ins.size(); ++i) {
+        int Id = -1;
+        if (IsOutlinable(Ins[i]))
+          Id = Keys.insert({InstructionKey(Ins[i]), (int)Keys.size()})
+                   .first->second;
+        Ids.push_back(Id);
+        Sites.push_back({f, i});
+      }
+      Ids.push_back(-1);
+      Sites.push_back({f, Ins.size()});
+    }
+
+    std::vector<size_t> Starts;
+    int Length = 0;
+    if (FindSequence(Ids, Starts, Length) <= 0)
+      break;
+
+    neocode_function Outlined(Program);
+    Outlined.Name = "__outlined" + std::to_string(Count);
+    Outlined.ReturnType = 0;
+    const opt_site &First = Sites[Starts[0]];
+    std::vector<neocode_instruction> &Source =
+        Program->Functions[First.Function].Instructions;
+    Outlined.Instructions.assign(Source.begin() + First.Index,
+                                 Source.begin() + First.Index + Length);
+
+    neocode_instruction Call;
+    Call.Type = neocode_instruction::CALL;
+    Call.ExtraData = Outlined.Name;
+    Call.Dst.Register = OPT_SLOT_RETURN;
+    for (size_t s = Starts.size(); s-- > 0;) {
+      const opt_site &Site = Sites[Starts[s]];
+      neocode_function &F = Program->Functions[Site.Function];
+      F.Instructions.erase(F.Instructions.begin() + Site.Index,
+                           F.Instructions.begin() + Site.Index + Length);
+      F.Instructions.insert(F.Instructions.begin() + Site.Index, Call);
+      if (s == 0 || Sites[Starts[s - 1]].Function != Site.Function)
+        F.Callees.push_back(Outlined.Name);
+    }
+    Program->Functions.push_back(Outlined);
+  }
+}
@@ -0,0 +1,162 @@
+#include "optimizer.h"
+
+// Approximate result latencies in cycles. The special function unit (RCP,
+// RSQ, EX2, LG2) and the dot products take noticeably longer than the simple
+// vector ops, so consumers placed right behind them stall the shader unit.
+static int Latency(int Type) {
+  switch (Type) {
+  case neocode_instruction::RCP:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+    return 5;
+
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+    return 4;
+
+  case neocode_instruction::MUL:
+  case neocode_instruction::MAD:
+    return 2;
+  }
+  return 1;
+}
+
+static bool IsBarrier(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::EMPTY:
+  case neocode_instruction::NOP:
+  case neocode_instruction::END:
+  case neocode_instruction::CALL:
+  case neocode_instruction::CALLU:
+  case neocode_instruction::INVOKE:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::LOOP:
+  case neocode_instruction::ENDLOOP:
+  case neocode_instruction::CMP:
+  case neocode_instruction::IFC:
+  case neocode_instruction::IFU:
+  case neocode_instruction::JMPU:
+  case neocode_instruction::ELSE:
+  case neocode_instruction::ENDIF:
+  case neocode_instruction::SETEMIT:
+  case neocode_instruction::EMIT:
+    return true;
+  }
+  return false;
+}
+
+struct sched_node {
+  neocode_instruction *In;
+  std::vector<int> Succs;
+  std::vector<int> SuccLatency;
+  int PredCount;
+  int Height;
+  int Ready;
+};
+
+static void ScheduleBlock(std::vector<neocode_instruction> &Block) {
+  int Count = Block.size();
+  std::vector<sched_node> Nodes(Count);
+  for (int i = 0; i < Count; ++i) {
+    Nodes[i].In = &Block[i];
+    Nodes[i].PredCount = 0;
+    Nodes[i].Height = 0;
+    Nodes[i].Ready = 0;
+  }
+
+  for (int j = 0; j < Count; ++j) {
+    neocode_instruction &B = Block[j];
+    int BSlot = OptRegisterSlot(B.Dst);
+    int BWrite = OptWriteMask(B);
+    for (int i = 0; i < j; ++i) {
+      neocode_instruction &A = Block[i];
+      int ASlot = OptRegisterSlot(A.Dst);
+      int AWrite = OptWriteMask(A);
+      int Edge = -1;
+      for (int s = 0; s < OptSourceCount(B); ++s) {
+        if (OptRegisterSlot(*OptSource(&B, s)) == ASlot &&
+            (OptReadMask(B, s) & AWrite))
+          Edge = Latency(A.Type);
+      }
+      if (Edge < 0 && ASlot == BSlot && (AWrite & BWrite))
+        Edge = 1;
+      for (int s = 0; Edge < 0 && s < OptSourceCount(A); ++s) {
+        if (OptRegisterSlot(*OptSource(&A, s)) == BSlot &&
+            (OptReadMask(A, s) & BWrite))
+          Edge = 0;
+      }
+      if (Edge >= 0) {
+        Nodes[i].Succs.push_back(j);
+        Nodes[i].SuccLatency.push_back(Edge);
+        ++Nodes[j].PredCount;
+      }
+    }
+  }
+
+  for (int i = Count; i-- > 0;) {
+    Nodes[i].Height = Latency(Block[i].Type);
+    for (size_t s = 0; s < Nodes[i].Succs.size(); ++s) {
+      int H = Nodes[i].SuccLatency[s] + Nodes[Nodes[i].Succs[s]].Height;
+      if (H > Nodes[i].Height)
+        Nodes[i].Height = H;
+    }
+  }
+
+  // Single-issue list scheduling: every cycle pick the ready instruction
+  // whose operands are available soonest, breaking ties on the longest
+  // remaining latency path and then on source order. Registers are already
+  // assigned and every dependence through them is honoured, so no value ever
+  // needs a register it did not have before.
+  std::vector<neocode_instruction> Scheduled;
+  std::vector<int> Done(Count, 0);
+  int Cycle = 0;
+  for (int n = 0; n < Count; ++n) {
+    int Best = -1;
+    for (int i = 0; i < Count; ++i) {
+      if (Done[i] || Nodes[i].PredCount)
+        continue;
+      if (Best < 0)
+        Best = i;
+      int Start = Nodes[i].Ready > Cycle ? Nodes[i].Ready : Cycle;
+      int BestStart = Nodes[Best].Ready > Cycle ? Nodes[Best].Ready : Cycle;
+      if (Start < BestStart ||
+          (Start == BestStart && Nodes[i].Height > Nodes[Best].Height))
+        Best = i;
+    }
+
+    if (Nodes[Best].Ready > Cycle)
+      Cycle = Nodes[Best].Ready;
+    Done[Best] = 1;
+    Scheduled.push_back(Block[Best]);
+    for (size_t s = 0; s < Nodes[Best].Succs.size(); ++s) {
+      sched_node &Succ = Nodes[Nodes[Best].Succs[s]];
+      --Succ.PredCount;
+      if (Cycle + Nodes[Best].SuccLatency[s] > Succ.Ready)
+        Succ.Ready = Cycle + Nodes[Best].SuccLatency[s];
+    }
+    ++Cycle;
+  }
+  Block = Scheduled;
+}
+
+void OptScheduleInstructions(neocode_program *Program) {
+  for (neocode_function &F : Program->Functions) {
+    std::vector<neocode_instruction> Result;
+    std::vector<neocode_instruction> Block;
+    for (neocode_instruction &In : F.Instructions) {
+      if (IsBarrier(In)) {
+        ScheduleBlock(Block);
+        Result.insert(Result.end(), Block.begin(), Block.end());
+        Result.push_back(In);
+        Block.clear();
+      } else {
+        Block.push_back(In);
+      }
+    }
+    ScheduleBlock(Block);
+    Result.insert(Result.end(), Block.begin(), Block.end());
+    F.Instructions = Result;
+  }
+}
@@ -0,0 +1,289 @@
+#include "optimizer.h"
+#include <cstring>
+
+int OptRegisterSlot(const neocode_variable &V) {
+  if (V.Register >= 0xA0)
+    return OPT_SLOT_BOOLEAN + V.Register - 0xA0;
+  if (V.RegisterType == 0 && V.Register >= 0x90)
+    return OPT_SLOT_INTEGER + V.Register - 0x90;
+  if (V.RegisterType == 0 && V.Register >= 0x80)
+    return OPT_SLOT_ADDRESS;
+  int Register = V.Register;
+  if (V.TypeName.compare("mat4") == 0)
+    Register += V.Swizzle;
+  if (V.RegisterType > 0)
+    return OPT_SLOT_OUTPUT + Register;
+  return Register;
+}
+
+// Instructions that only mark a place and take up no room in the program.
+bool OptIsMarker(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::EMPTY:
+  case neocode_instruction::ENDLOOP:
+  case neocode_instruction::ELSE:
+  case neocode_instruction::ENDIF:
+    return true;
+  }
+  return false;
+}
+
+int OptSwizzleSelector(const neocode_variable &V, int Lane) {
+  if (V.Swizzle == 0 || V.TypeName.compare("mat4") == 0)
+    return Lane;
+  int Index = ((V.Swizzle >> (Lane * 4)) & 0b1111) - 1;
+  return Index < 0 ? 0 : Index;
+}
+
+int OptSourceCount(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::CALL:
+  case neocode_instruction::CALLU:
+  case neocode_instruction::INVOKE:
+    return In.Args.size();
+
+  case neocode_instruction::MOV:
+  case neocode_instruction::RSQ:
+  case neocode_instruction::RCP:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::FLR:
+  case neocode_instruction::MOVA:
+  case neocode_instruction::LOOP:
+  case neocode_instruction::IFU:
+  case neocode_instruction::JMPU:
+    return 1;
+
+  case neocode_instruction::ADD:
+  case neocode_instruction::MUL:
+  case neocode_instruction::DP3:
+  case neocode_instruction::DP4:
+  case neocode_instruction::DPH:
+  case neocode_instruction::MIN:
+  case neocode_instruction::MAX:
+  case neocode_instruction::SLT:
+  case neocode_instruction::SGE:
+  case neocode_instruction::CMP:
+    return 2;
+
+  case neocode_instruction::MAD:
+    return 3;
+  }
+  return 0;
+}
+
+bool OptHasDst(const neocode_instruction &In) {
+  switch (In.Type) {
+  case neocode_instruction::EMPTY:
+  case neocode_instruction::NOP:
+  case neocode_instruction::END:
+  case neocode_instruction::LOOP:
+  case neocode_instruction::ENDLOOP:
+  case neocode_instruction::CMP:
+  case neocode_instruction::IFC:
+  case neocode_instruction::ELSE:
+  case neocode_instruction::ENDIF:
+  case neocode_instruction::IFU:
+  case neocode_instruction::JMPU:
+  case neocode_instruction::SETEMIT:
+  case neocode_instruction::EMIT:
+    return false;
+  }
+  return true;
+}
+
+neocode_variable *OptSource(neocode_instruction *In, int Index) {
+  if (In->Type == neocode_instruction::CALL ||
+      In->Type == neocode_instruction::CALLU ||
+      In->Type == neocode_instruction::INVOKE)
+    return &In->Args[Index];
+  if (Index == 2)
+    return &In->Src3;
+  return Index == 0 ? &In->Src1 : &In->Src2;
+}
+
+int OptWriteMask(const neocode_instruction &In) {
+  if (!OptHasDst(In))
+    return 0;
+  if (In.Dst.Swizzle == 0)
+    return 0b1111;
+  int Mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    int V = ((In.Dst.Swizzle >> (i * 4)) & 0b1111) - 1;
+    if (V >= 0)
+      Mask |= 1 << V;
+  }
+  return Mask;
+}
+
+int OptReadMask(const neocode_instruction &In, int Index) {
+  if (In.Type == neocode_instruction::CALL ||
+      In.Type == neocode_instruction::CALLU ||
+      In.Type == neocode_instruction::INVOKE)
+    return 0b1111;
+  const neocode_variable &V =
+      *OptSource(const_cast<neocode_instruction *>(&In), Index);
+  int Lanes;
+  switch (In.Type) {
+  case neocode_instruction::DP4:
+    Lanes = 0b1111;
+    break;
+
+  case neocode_instruction::DP3:
+    Lanes = 0b0111;
+    break;
+
+  case neocode_instruction::DPH:
+    Lanes = Index == 0 ? 0b0111 : 0b1111;
+    break;
+
+  case neocode_instruction::RSQ:
+  case neocode_instruction::RCP:
+  case neocode_instruction::EX2:
+  case neocode_instruction::LG2:
+  case neocode_instruction::CMP:
+  case neocode_instruction::IFU:
+  case neocode_instruction::JMPU:
+    Lanes = 0b0001;
+    break;
+
+  default:
+    Lanes = OptWriteMask(In);
+    break;
+  }
+
+  int Mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (Lanes & (1 << i))
+      Mask |= 1 << OptSwizzleSelector(V, i);
+  }
+  return Mask;
+}
+
+void OptFunctionLiveOut(neocode_function *Function, opt_live_set &Live) {
+  Live.Clear();
+  for (int i = OPT_SLOT_OUTPUT; i < OPT_SLOT_ADDRESS; ++i)
+    Live.Mask[i] = 0b1111;
+  if (Function->Name.compare("main") != 0)
+    Live.Mask[OPT_SLOT_RETURN] = 0b1111;
+}
+
+// Whatever is live at the top of a loop body is live at its end as well,
+// since the body may run again. That feeds back into the body, so a function
+// with loops is swept until nothing changes. An IFC or IFU goes on with
+// either of its parts, and the end of the then part jumps over the else
+// part. An EMIT reads every output, and a source relative to a0.x or a0.y
+// reads that lane of the address register.
+struct opt_if_live {
+  opt_live_set Join;
+  opt_live_set Else;
+};
+
+void OptComputeLiveness(neocode_function *Function,
+                        std::vector<opt_live_set> &LiveAfter) {
+  std::vector<neocode_instruction> &Ins = Function->Instructions;
+  std::vector<int> Opening(Ins.size(), -1), Open;
+  bool HasLoops = false;
+  for (size_t i = 0; i < Ins.size(); ++i) {
+    if (Ins[i].Type == neocode_instruction::LOOP) {
+      Open.push_back(i);
+    } else if (Ins[i].Type == neocode_instruction::ENDLOOP && Open.size()) {
+      Opening[i] = Open.back();
+      Open.pop_back();
+      HasLoops = true;
+    }
+  }
+
+  LiveAfter.assign(Ins.size(), opt_live_set());
+  bool Changed = true;
+  while (Changed) {
+    std::vector<opt_live_set> Previous;
+    if (HasLoops)
+      Previous = LiveAfter;
+    std::vector<opt_if_live> Ifs;
+    opt_live_set Live;
+    OptFunctionLiveOut(Function, Live);
+    for (size_t i = Ins.size(); i-- > 0;) {
+      neocode_instruction &In = Ins[i];
+      if (Opening[i] >= 0) {
+        const opt_live_set &Top = LiveAfter[Opening[i]];
+        for (int s = 0; s < OPT_SLOT_COUNT; ++s)
+          Live.Mask[s] |= Top.Mask[s];
+      }
+      if (In.Type == neocode_instruction::ENDIF) {
+        Ifs.push_back({Live, Live});
+      } else if (In.Type == neocode_instruction::ELSE && Ifs.size()) {
+        Ifs.back().Else = Live;
+        Live = Ifs.back().Join;
+      } else if ((In.Type == neocode_instruction::IFC ||
+                  In.Type == neocode_instruction::IFU ||
+                  In.Type == neocode_instruction::JMPU) &&
+                 Ifs.size()) {
+        for (int s = 0; s < OPT_SLOT_COUNT; ++s)
+          Live.Mask[s] |= Ifs.back().Else.Mask[s];
+        Ifs.pop_back();
+      }
+      LiveAfter[i] = Live;
+      if (OptHasDst(In))
+        Live.Mask[OptRegisterSlot(In.Dst)] &= ~OptWriteMask(In);
+      for (int s = 0; s < OptSourceCount(In); ++s) {
+        neocode_variable *Src = OptSource(&In, s);
+        Live.Mask[OptRegisterSlot(*Src)] |= OptReadMask(In, s);
+        if (Src->Relative == 1 || Src->Relative == 2)
+          Live.Mask[OPT_SLOT_ADDRESS] |= 1 << (Src->Relative - 1);
+      }
+      for (int s = OPT_SLOT_OUTPUT;
+           In.Type == neocode_instruction::EMIT && s < OPT_SLOT_ADDRESS; ++s)
+        Live.Mask[s] = 0b1111;
+    }
+
+    Changed = false;
+    for (size_t i = 0; HasLoops && i < Ins.size() && !Changed; ++i)
+      Changed = memcmp(Previous[i].Mask, LiveAfter[i].Mask,
+                       sizeof(LiveAfter[i].Mask)) != 0;
+  }
+}
+
+neocode_function *OptFindFunction(neocode_program *Program,
+                                  const std::string &Name) {
+  for (neocode_function &F : Program->Functions) {
+    if (F.Name.compare(Name) == 0)
+      return &F;
+  }
+  return nullptr;
+}
+
+int OptFunctionSize(neocode_function *Function) {
+  int Size = 0;
+  for (neocode_instruction &In : Function->Instructions) {
+    if (In.Type == neocode_instruction::INVOKE)
+      Size += In.Args.size() + 2;
+    else if (!OptIsMarker(In))
+      ++Size;
+  }
+  return Size;
+}
+
+int OptProgramSize(neocode_program *Program) {
+  int Size = 0;
+  for (neocode_function &F : Program->Functions)
+    Size += OptFunctionSize(&F);
+  return Size;
+}
+
+void OptRunPasses(neocode_program *Program) {
+  OptLowerCalls(Program);
+  if (Program->ErrorCount)
+    return;
+  if (Program->Options.OptLevel >= 1) {
+    OptPropagateCopies(Program);
+    OptEliminateDeadCode(Program);
+    OptFuseMultiplyAdd(Program);
+  }
+  if (Program->Options.OptLevel >= 2) {
+    OptScheduleInstructions(Program);
+  }
+  if (Program->Options.SizeLevel & 1)
+    OptOutlineSequences(Program);
+  OptFinishControlFlow(Program);
+}
@@ -479,17 +479,26 @@ parse_node parser::ParsePostfixExpression() {
     parse_node N;
     if (Token.Type == token::LEFT_BRACKET) {
       N.Children.push_back(P);
+      N.Children.push_back(parse_node(Token));
       Match(token::LEFT_BRACKET);
       N.Children.push_back(ParseIntegerExpression());
       Match(token::RIGHT_BRACKET);
     } else if (Token.Type == token::DEC_OP || Token.Type == token::INC_OP) {
+      N.Children.push_back(P);
       N.Children.push_back(parse_node(Token));
       Match(Token.Type);
     } else if (Token.Type == token::DOT) {
+      N.Children.push_back(P);
       N.Children.push_back(parse_node(Token));
       Match(token::DOT);
       N.Children.push_back(parse_node(Token));
       Match(token::FIELD_SELECTION);
+    } else {
+      return N;
+    }
+    parse_node C = ParseExtPostfix(N);
+    if (!C.Empty()) {
+      return C;
     }
     return N;
   };